@@ -0,0 +1,225 @@
+// * vodus-archive: reads the frame archives written by `vodus --archive`
+
+#include <cstdio>
+#include <cassert>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "./vodus_archive.cpp"
+
+void usage(FILE *stream) {
+  fprintf(stream, "Usage: ./vodus-archive <command> <archive> [arguments]\n");
+  fprintf(stream, "Commands:\n");
+  fprintf(stream, "    info <archive>                     print the format and the frame range\n");
+  fprintf(stream, "    extract <archive> <index>...       write the frames into frame-<index>.<format>\n");
+  fprintf(stream, "    cat <archive> [begin end]          stream the frames to stdout in order\n");
+  fprintf(stream, "    ffmpeg <archive> <output> [args]   stream the frames into ffmpeg, args go before <output>\n");
+}
+
+size_t parse_index(const char *arg) {
+  char *end = nullptr;
+  errno = 0;
+  unsigned long long value = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0') {
+    usage(stderr);
+    fprintf(stderr, "ERROR: %s is not a frame index\n", arg);
+    exit(1);
+  }
+  return (size_t)value;
+}
+
+void write_all(int fd, const uint8_t *data, size_t size, const char *file_path) {
+  struct iovec iov = {(void *)data, size};
+  write_all_iov(fd, &iov, 1, file_path);
+}
+
+const uint8_t *archive_frame_or_die(const Archive *archive, size_t index, size_t *size) {
+  const uint8_t *data = archive_frame(archive, index, size);
+  if (data == nullptr) {
+    fprintf(stderr, "ERROR: frame %zu is not in the archive\n", index);
+    exit(1);
+  }
+  return data;
+}
+
+void archive_info(const Archive *archive) {
+  const Archive_Header *header = archive->header;
+  const Archive_Footer *footer = archive->footer;
+
+  // * the duplicates point at the same bytes
+  size_t unique = 0;
+  uint64_t previous_offset = 0;
+  for (uint64_t i = 0; i < footer->frames_count; ++i) {
+    if (archive->entries[i].size > 0 && (i == 0 || archive->entries[i].offset != previous_offset)) {
+      unique += 1;
+    }
+    previous_offset = archive->entries[i].offset;
+  }
+
+  printf("Format: %s\n", archive_format_names[header->format]);
+  printf("Size:   %ux%u at %u fps\n", header->width, header->height, header->fps);
+  printf("Frames: [%llu, %llu), %zu unique\n",
+         (unsigned long long)footer->frames_begin,
+         (unsigned long long)(footer->frames_begin + footer->frames_count),
+         unique);
+  printf("Bytes:  %zu\n", archive->size);
+}
+
+constexpr size_t FFMPEG_INPUT_ARGS_CAPA = 16;
+
+// * Input options of ffmpeg for the frames of the archive coming from a
+// * pipe. The numbers are formatted into fps and size. Returns the amount
+// * of the arguments.
+size_t ffmpeg_input_args(const Archive *archive, const char **args, char *fps, char *size, size_t capacity) {
+  const Archive_Header *header = archive->header;
+  snprintf(fps, capacity, "%u", header->fps);
+  snprintf(size, capacity, "%ux%u", header->width, header->height);
+
+  size_t count = 0;
+  args[count++] = "-framerate";
+  args[count++] = fps;
+  switch ((Archive_Format)header->format) {
+  case ARCHIVE_FORMAT_PNG:
+  case ARCHIVE_FORMAT_QOI:
+    args[count++] = "-f";
+    args[count++] = "image2pipe";
+    args[count++] = "-c:v";
+    args[count++] = archive_format_names[header->format];
+    break;
+  case ARCHIVE_FORMAT_RAW:
+    args[count++] = "-f";
+    args[count++] = "rawvideo";
+    args[count++] = "-pix_fmt";
+    args[count++] = "rgba";
+    args[count++] = "-s";
+    args[count++] = size;
+    break;
+  default:
+    assert(0 && "unreachable: format is checked by archive_open");
+  }
+  args[count++] = "-i";
+  args[count++] = "-";
+  assert(count <= FFMPEG_INPUT_ARGS_CAPA);
+  return count;
+}
+
+void stream_frames(const Archive *archive, int fd, size_t begin, size_t end) {
+  for (size_t index = begin; index < end; ++index) {
+    size_t size = 0;
+    const uint8_t *data = archive_frame_or_die(archive, index, &size);
+    write_all(fd, data, size, "the output stream");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage(stderr);
+    exit(1);
+  }
+
+  const char *command = argv[1];
+  const char *archive_filepath = argv[2];
+
+  Archive archive;
+  archive_open(&archive, archive_filepath);
+  size_t frames_begin = (size_t)archive.footer->frames_begin;
+  size_t frames_end = frames_begin + (size_t)archive.footer->frames_count;
+
+  if (strcmp(command, "info") == 0) {
+    archive_info(&archive);
+  } else if (strcmp(command, "extract") == 0) {
+    constexpr size_t FILE_PATH_CAPA = 256;
+    char file_path[FILE_PATH_CAPA];
+
+    for (int i = 3; i < argc; ++i) {
+      size_t index = parse_index(argv[i]);
+      size_t size = 0;
+      const uint8_t *data = archive_frame_or_die(&archive, index, &size);
+
+      snprintf(file_path, FILE_PATH_CAPA, "frame-%05zu.%s", index, archive_format_names[archive.header->format]);
+      int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+        exit(1);
+      }
+      write_all(fd, data, size, file_path);
+      close(fd);
+      printf("Extracted %s\n", file_path);
+    }
+  } else if (strcmp(command, "cat") == 0) {
+    size_t begin = frames_begin;
+    size_t end = frames_end;
+    if (argc >= 5) {
+      begin = parse_index(argv[3]);
+      end = parse_index(argv[4]);
+    }
+    stream_frames(&archive, STDOUT_FILENO, begin, end);
+  } else if (strcmp(command, "ffmpeg") == 0) {
+    if (argc < 4) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: no output file for ffmpeg\n");
+      exit(1);
+    }
+
+    // * ffmpeg -y <input args> [args] <output> nullptr, no shell in between
+    // * so the paths and the arguments go to ffmpeg as they are
+    constexpr size_t NUMBER_CAPA = 32;
+    char fps[NUMBER_CAPA], size[NUMBER_CAPA];
+    const char **ffmpeg_argv = (const char **)malloc(sizeof(char *) * (FFMPEG_INPUT_ARGS_CAPA + (size_t)argc));
+    assert(ffmpeg_argv);
+    size_t count = 0;
+    ffmpeg_argv[count++] = "ffmpeg";
+    ffmpeg_argv[count++] = "-y";
+    count += ffmpeg_input_args(&archive, ffmpeg_argv + count, fps, size, NUMBER_CAPA);
+    for (int i = 4; i < argc; ++i) {
+      ffmpeg_argv[count++] = argv[i];
+    }
+    ffmpeg_argv[count++] = argv[3];
+    ffmpeg_argv[count] = nullptr;
+
+    for (size_t i = 0; i < count; ++i) {
+      printf(i + 1 < count ? "%s " : "%s\n", ffmpeg_argv[i]);
+    }
+    fflush(stdout);
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+      fprintf(stderr, "could not create a pipe: %s\n", strerror(errno));
+      exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "could not run ffmpeg: %s\n", strerror(errno));
+      exit(1);
+    }
+    if (pid == 0) {
+      dup2(pipe_fds[0], STDIN_FILENO);
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      execvp("ffmpeg", (char *const *)ffmpeg_argv);
+      fprintf(stderr, "could not run ffmpeg: %s\n", strerror(errno));
+      _exit(127);
+    }
+    close(pipe_fds[0]);
+    stream_frames(&archive, pipe_fds[1], frames_begin, frames_end);
+    close(pipe_fds[1]);
+    free(ffmpeg_argv);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "ffmpeg failed with status %d\n", status);
+      exit(1);
+    }
+  } else {
+    usage(stderr);
+    fprintf(stderr, "ERROR: unknown command %s\n", command);
+    exit(1);
+  }
+
+  archive_close(&archive);
+  return 0;
+}
@@ -0,0 +1,259 @@
+// * vodus-chatgen: writes synthetic chat logs for `vodus --bench`
+// *
+// * The same options and seed always give the same log. The messages
+// * arrive as a Poisson process of --rate messages per second, which is
+// * multiplied by --raid-factor for --raid-seconds every --raid-every
+// * seconds. Every message has a geometrically distributed amount of words,
+// * every word is the emote code with the probability --emotes, else a
+// * non-ASCII word with the probability --unicode, else an ASCII one.
+
+#include <cstdio>
+#include <cmath>
+#include <cassert>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "./vodus_chatlog.cpp"
+
+const char *ascii_words[] = {
+  "lol", "lmao", "pog", "poggers", "gg", "wp", "kekw", "xd", "no", "yes", "what", "chat",
+  "is", "this", "real", "clip", "it", "hello", "streamer", "bro", "the", "a", "of", "game",
+  "first", "time", "again", "wait", "omg", "nice", "haha", "sadge", "copium", "letsgo",
+  "tsoding", "rust", "c++", "zig", "segfault", "malloc", "based", "cringe", "true", "monkaS",
+};
+
+const char *unicode_words[] = {
+  "café", "naïve", "über", "señor", "ça", "żółw", "привет", "спасибо", "ура", "γεια",
+  "שלום", "مرحبا", "こんにちは", "草", "やばい", "你好", "加油", "안녕", "ㅋㅋㅋ",
+  "😂", "🔥", "❤️", "👍", "🎉", "🐸", "e\xcc\x81", "ñ", "→", "™",
+};
+
+constexpr size_t ASCII_WORDS_COUNT = sizeof(ascii_words) / sizeof(ascii_words[0]);
+constexpr size_t UNICODE_WORDS_COUNT = sizeof(unicode_words) / sizeof(unicode_words[0]);
+
+// * xorshift64*, the output must not depend on the libc
+struct Random {
+  uint64_t state;
+};
+
+uint64_t random_next(Random *random) {
+  random->state ^= random->state >> 12;
+  random->state ^= random->state << 25;
+  random->state ^= random->state >> 27;
+  return random->state * 2685821657736338717ULL;
+}
+
+// * [0, 1)
+double random_double(Random *random) {
+  return (double)(random_next(random) >> 11) * 0x1.0p-53;
+}
+
+size_t random_index(Random *random, size_t count) {
+  return (size_t)(random_next(random) % count);
+}
+
+struct Chatgen_Config {
+  size_t messages;
+  double rate;
+  double mean_words;
+  size_t max_words;
+  double emotes;
+  const char *emote;
+  double unicode;
+  double raid_every;
+  double raid_seconds;
+  double raid_factor;
+  uint64_t seed;
+};
+
+void usage(FILE *stream) {
+  fprintf(stream, "Usage: ./vodus-chatgen [options] [output]\n");
+  fprintf(stream, "Writes a chat log for `vodus --bench` into output or stdout.\n");
+  fprintf(stream, "Options:\n");
+  fprintf(stream, "    --messages <n>         amount of the messages (default: 1000)\n");
+  fprintf(stream, "    --rate <n>             average messages per second outside of the raids (default: 10)\n");
+  fprintf(stream, "    --words <n>            average words in a message (default: 6)\n");
+  fprintf(stream, "    --max-words <n>        no message is longer than that (default: 40)\n");
+  fprintf(stream, "    --emotes <p>           probability of a word being the emote code (default: 0.1)\n");
+  fprintf(stream, "    --emote <code>         the emote code (default: gasm, the name of the png)\n");
+  fprintf(stream, "    --unicode <p>          probability of a word being non-ASCII (default: 0)\n");
+  fprintf(stream, "    --raid-every <s>       seconds between the raids, 0 is no raids (default: 0)\n");
+  fprintf(stream, "    --raid-seconds <s>     how long a raid lasts (default: 5)\n");
+  fprintf(stream, "    --raid-factor <n>      the rate is multiplied by n during a raid (default: 20)\n");
+  fprintf(stream, "    --seed <n>             seed of the generator (default: 1)\n");
+}
+
+double parse_number(const char *option, const char *arg, double min, double max) {
+  char *end = nullptr;
+  errno = 0;
+  double value = strtod(arg, &end);
+  if (errno != 0 || end == arg || *end != '\0' || !(value >= min && value <= max)) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: `%s` is not a valid value for %s\n", arg, option);
+    exit(1);
+  }
+  return value;
+}
+
+// * The counts and the seed are whole numbers, the seed takes all the 64 bits
+unsigned long long parse_integer(const char *option, const char *arg, unsigned long long min, unsigned long long max) {
+  char *end = nullptr;
+  errno = 0;
+  unsigned long long value = strtoull(arg, &end, 10);
+  // * strtoull negates the "-1" silently
+  if (errno != 0 || end == arg || *end != '\0' || *arg == '-' || value < min || value > max) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: `%s` is not a valid value for %s, expected %llu..%llu\n", arg, option, min, max);
+    exit(1);
+  }
+  return value;
+}
+
+const char *option_value(int argc, char *argv[], int *i) {
+  if (*i + 1 >= argc) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: %s expects an argument\n", argv[*i]);
+    exit(1);
+  }
+  *i += 1;
+  return argv[*i];
+}
+
+bool in_raid(const Chatgen_Config *config, double t) {
+  return config->raid_every > 0 && fmod(t, config->raid_every) >= config->raid_every - config->raid_seconds;
+}
+
+// * Writes the words of one message into text, which has room for the
+// * longest word times max_words
+void generate_message(const Chatgen_Config *config, Random *random, char *text) {
+  // * geometric on [1, max_words] with the given mean
+  double p = 1.0 / config->mean_words;
+  size_t words = 1;
+  while (words < config->max_words && random_double(random) >= p) {
+    words += 1;
+  }
+
+  size_t size = 0;
+  for (size_t i = 0; i < words; ++i) {
+    const char *word = nullptr;
+    double kind = random_double(random);
+    if (kind < config->emotes) {
+      word = config->emote;
+    } else if (kind < config->emotes + (1.0 - config->emotes) * config->unicode) {
+      word = unicode_words[random_index(random, UNICODE_WORDS_COUNT)];
+    } else {
+      word = ascii_words[random_index(random, ASCII_WORDS_COUNT)];
+    }
+
+    if (i > 0) text[size++] = ' ';
+    size_t word_size = strlen(word);
+    memcpy(text + size, word, word_size);
+    size += word_size;
+  }
+  text[size] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+  Chatgen_Config config = {};
+  config.messages = 1000;
+  config.rate = 10;
+  config.mean_words = 6;
+  config.max_words = 40;
+  config.emotes = 0.1;
+  config.emote = "gasm";
+  config.unicode = 0;
+  config.raid_every = 0;
+  config.raid_seconds = 5;
+  config.raid_factor = 20;
+  config.seed = 1;
+  const char *output_filepath = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--messages") == 0) {
+      config.messages = (size_t)parse_integer("--messages", option_value(argc, argv, &i), 1, 1000000000000ULL);
+    } else if (strcmp(argv[i], "--rate") == 0) {
+      config.rate = parse_number("--rate", option_value(argc, argv, &i), 1e-3, 1e6);
+    } else if (strcmp(argv[i], "--words") == 0) {
+      config.mean_words = parse_number("--words", option_value(argc, argv, &i), 1, 1000);
+    } else if (strcmp(argv[i], "--max-words") == 0) {
+      config.max_words = (size_t)parse_integer("--max-words", option_value(argc, argv, &i), 1, 1000);
+    } else if (strcmp(argv[i], "--emotes") == 0) {
+      config.emotes = parse_number("--emotes", option_value(argc, argv, &i), 0, 1);
+    } else if (strcmp(argv[i], "--emote") == 0) {
+      config.emote = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--unicode") == 0) {
+      config.unicode = parse_number("--unicode", option_value(argc, argv, &i), 0, 1);
+    } else if (strcmp(argv[i], "--raid-every") == 0) {
+      config.raid_every = parse_number("--raid-every", option_value(argc, argv, &i), 0, 1e9);
+    } else if (strcmp(argv[i], "--raid-seconds") == 0) {
+      config.raid_seconds = parse_number("--raid-seconds", option_value(argc, argv, &i), 0, 1e9);
+    } else if (strcmp(argv[i], "--raid-factor") == 0) {
+      config.raid_factor = parse_number("--raid-factor", option_value(argc, argv, &i), 1, 1e6);
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      config.seed = (uint64_t)parse_integer("--seed", option_value(argc, argv, &i), 0, UINT64_MAX);
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: unknown option %s\n", argv[i]);
+      exit(1);
+    } else if (output_filepath == nullptr) {
+      output_filepath = argv[i];
+    } else {
+      usage(stderr);
+      fprintf(stderr, "ERROR: too many arguments\n");
+      exit(1);
+    }
+  }
+  if (config.raid_every > 0 && config.raid_seconds >= config.raid_every) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: --raid-seconds has to be shorter than --raid-every\n");
+    exit(1);
+  }
+  if (strchr(config.emote, ' ') || strchr(config.emote, '\n') || *config.emote == '\0') {
+    usage(stderr);
+    fprintf(stderr, "ERROR: the emote code has to be one word\n");
+    exit(1);
+  }
+
+  FILE *stream = stdout;
+  if (output_filepath) {
+    stream = fopen(output_filepath, "w");
+    if (!stream) {
+      fprintf(stderr, "could not open %s: %s\n", output_filepath, strerror(errno));
+      exit(1);
+    }
+  }
+
+  fprintf(stream, "# vodus-chatgen --messages %zu --rate %g --words %g --max-words %zu --emotes %g --emote %s "
+          "--unicode %g --raid-every %g --raid-seconds %g --raid-factor %g --seed %llu\n",
+          config.messages, config.rate, config.mean_words, config.max_words, config.emotes, config.emote,
+          config.unicode, config.raid_every, config.raid_seconds, config.raid_factor,
+          (unsigned long long)config.seed);
+
+  // * the seed 0 would be stuck at 0 forever
+  Random random = {config.seed * 0x9E3779B97F4A7C15ULL + 1};
+
+  size_t longest_word = strlen(config.emote);
+  for (size_t i = 0; i < ASCII_WORDS_COUNT; ++i) longest_word = std::max(longest_word, strlen(ascii_words[i]));
+  for (size_t i = 0; i < UNICODE_WORDS_COUNT; ++i) longest_word = std::max(longest_word, strlen(unicode_words[i]));
+  char *text = (char *)malloc((longest_word + 1) * config.max_words + 1);
+  assert(text);
+
+  double t = 0;
+  for (size_t i = 0; i < config.messages; ++i) {
+    // * exponential gaps between the arrivals, the rate of the moment
+    // * they start from is good enough for the raids of a few seconds
+    double rate = in_raid(&config, t) ? config.rate * config.raid_factor : config.rate;
+    t += -log(1.0 - random_double(&random)) / rate;
+
+    generate_message(&config, &random, text);
+    chat_log_write_message(stream, (uint64_t)(t * 1000.0), text);
+  }
+
+  free(text);
+  if (output_filepath) {
+    fclose(stream);
+  }
+  return 0;
+}
@@ -6,20 +6,30 @@
 #include <png.h>
 #include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
 #include <atomic>
+#include <algorithm>
 
 extern "C" {
   #include <libavcodec/avcodec.h>
+  #include <libavformat/avformat.h>
   #include <libavutil/opt.h>
   #include <libavutil/imgutils.h>
+  #include <libavutil/pixdesc.h>
 }
 
 #include FT_FREETYPE_H
 
+#include <hb.h>
+#include <hb-ft.h>
+
 #define FACE_FILE_PATH "./Comic-Sans-MS.ttf"
 #define VODUS_WIDTH 690
 #define VODUS_HEIGHT 420
-#define VODUS_OUTPUT_THREADS_COUNT 4
 
 template <typename F>
 struct Defer
@@ -35,7 +45,9 @@ struct Defer
 
 void avec(int code) {
   if(code < 0) {
-    fprintf(stderr, "libavcodec popped itself: %s\n", av_err2str(code));
+    char error[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_make_error_string(error, AV_ERROR_MAX_STRING_SIZE, code);
+    fprintf(stderr, "libavcodec popped itself: %s\n", error);
     exit(1);
   }
 }
@@ -49,11 +61,16 @@ struct Pixels32 {
 };
 
 // * Simple custom image fomat
+// * stride is the distance between the rows in pixels, so an Image32 can
+// * point into a buffer owned by somebody else (like an AVFrame)
 struct Image32 {
   int height, width;
   Pixels32 *pixels;
+  int stride;
 };
 
+#include "./vodus_memory.cpp"
+
 int save_image32_as_png(Image32 image32, const char *filename) {
   png_image pimage;
   memset(&pimage, 0, sizeof(png_image));
@@ -64,7 +81,8 @@ int save_image32_as_png(Image32 image32, const char *filename) {
   pimage.format = PNG_FORMAT_RGBA;
 
   int convert_to_8bit = 0;
-  png_image_write_to_file(&pimage, filename, convert_to_8bit, image32.pixels, 0, nullptr);
+  png_int_32 row_stride = image32.stride * 4;
+  png_image_write_to_file(&pimage, filename, convert_to_8bit, image32.pixels, row_stride, nullptr);
 
   return 0;
 }
@@ -85,7 +103,7 @@ int save_image32_as_ppm(Image32 *image, const char* filename) {
 
   for (int row = 0; row < (int)image->height; ++row) {
     for (int col = 0; col < (int)image->width; ++col) {
-      int index = ((int)image->width * row) + col;
+      int index = (image->stride * row) + col;
       Pixels32 p = *(image->pixels + index);
       // printf("%c\n", x);
       fputc(p.r, f);
@@ -98,51 +116,97 @@ int save_image32_as_ppm(Image32 *image, const char* filename) {
   return 0;
 }
 
+// * A rectangle of an Image32. pixels points to the pixel at
+// * (origin_x, origin_y) of the image. The slap_* functions take the
+// * coordinates of the whole image and clip everything to the view, so
+// * different threads can composite different views of one image.
+struct Image32_View {
+  int origin_x, origin_y;
+  int height, width;
+  Pixels32 *pixels;
+  int stride;
+};
+
+Image32_View image32_view(Image32 image) {
+  Image32_View view = {
+    .origin_x = 0,
+    .origin_y = 0,
+    .height = image.height,
+    .width = image.width,
+    .pixels = image.pixels,
+    .stride = image.stride};
+  return view;
+}
+
+// * x, y, width and height are in the coordinates of the whole image.
+// * The result is clipped to the view.
+Image32_View image32_subview(Image32_View view, int x, int y, int width, int height) {
+  int x0 = std::max(x, view.origin_x);
+  int y0 = std::max(y, view.origin_y);
+  int x1 = std::min(x + width, view.origin_x + view.width);
+  int y1 = std::min(y + height, view.origin_y + view.height);
+
+  Image32_View result = {
+    .origin_x = x0,
+    .origin_y = y0,
+    .height = std::max(y1 - y0, 0),
+    .width = std::max(x1 - x0, 0),
+    .pixels = view.pixels + (y0 - view.origin_y) * view.stride + (x0 - view.origin_x),
+    .stride = view.stride};
+  return result;
+}
+
+#include "./vodus_simd.cpp"
+
 // * Slap image32 onto Image32
-void slap_onto_image32(Image32 dest, Image32 *src, int x, int y) {
-  for (int row = 0; (row < (int)src->height); ++row) {
-    if ((row + x < (int)dest.height)) {
-      for (int col = 0; (col < (int)src->width); ++col) {
-        if((col + y < (int)dest.width)) {
-          dest.pixels[(row + y) * dest.width + col + x] = src->pixels[row * src->width + col];
-        }
-      }
-    }
+void slap_onto_image32(Image32_View dest, Image32 *src, int x, int y) {
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = std::max(0, -y);
+  int row_end = std::min(src->height, dest.height - y);
+  int col_begin = std::max(0, -x);
+  int col_end = std::min(src->width, dest.width - x);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    copy_pixels32.run(dest.pixels + (row + y) * dest.stride + col_begin + x,
+                      src->pixels + row * src->stride + col_begin,
+                      (size_t)std::max(col_end - col_begin, 0));
   }
 }
 
-void fill_image32_with_color(Image32 image, Pixels32 color)
+void fill_image32_with_color(Image32_View image, Pixels32 color)
 {
-  int n = image.height * image.width;
-  for(int i = 0; i < n ;++i) {
-    image.pixels[i] = color;
+  for (int row = 0; row < image.height; ++row) {
+    fill_pixels32.run(image.pixels + row * image.stride, (size_t)image.width, color);
   }
 }
 
 // * Slap FreeType bitmap onto Image32
-void slap_onto_image32(Image32 dest, FT_Bitmap *src, Pixels32 color, int x, int y) {
+void slap_onto_image32(Image32_View dest, FT_Bitmap *src, Pixels32 color, int x, int y) {
   assert(src->pixel_mode == FT_PIXEL_MODE_GRAY);
   assert(src->num_grays == 256);
 
-  for (int row = 0; (row < (int)src->rows); ++row) {
-    if((row + x < (int)dest.height)) {
-      for (int col = 0; (col < (int)src->width); ++col) {
-        if ((col + y < (int)dest.width)) {
-          int index = (row + y) * dest.width + col + x;
-          float a = src->buffer[row * src->pitch + col] / 255.0f;
-
-          dest.pixels[index].r = (uint8_t)(color.r * a + (1.0f - a) * dest.pixels[index].r);
-          dest.pixels[index].g = (uint8_t)(color.g * a + (1.0f - a) * dest.pixels[index].g);
-          dest.pixels[index].b = (uint8_t)(color.b * a + (1.0f - a) * dest.pixels[index].b);
-          dest.pixels[index].a = (uint8_t)(color.a * a + (1.0f - a) * dest.pixels[index].a);
-        }
-      }
-    }
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = std::max(0, -y);
+  int row_end = std::min((int)src->rows, dest.height - y);
+  int col_begin = std::max(0, -x);
+  int col_end = std::min((int)src->width, dest.width - x);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    blend_pixels32.run(dest.pixels + (row + y) * dest.stride + col_begin + x,
+                       src->buffer + row * src->pitch + col_begin,
+                       (size_t)std::max(col_end - col_begin, 0), color);
   }
 }
 
+#include "./vodus_mask.cpp"
+#include "./vodus_resample.cpp"
+
 // * Slap giflib single image frame onto Image32
-void slap_onto_image32(Image32 dest, SavedImage *src, ColorMapObject *SColorMap, int x, int y) {
+void slap_onto_image32(Image32_View dest, SavedImage *src, ColorMapObject *SColorMap, int x, int y) {
   assert(src);
   assert(SColorMap);
   assert(SColorMap->BitsPerPixel == 8);
@@ -150,21 +214,29 @@ void slap_onto_image32(Image32 dest, SavedImage *src, ColorMapObject *SColorMap,
   assert(src->ImageDesc.Top == 0);
   assert(src->ImageDesc.Left == 0);
 
-  for (int row = 0; (row < (int)src->ImageDesc.Height); ++row) {
-    if ((row + x < (int)dest.height)) {
-      for (int col = 0; (col < (int)src->ImageDesc.Width); ++col) {
-        if ((col + y < (int)dest.width)) {
-          GifColorType pixel = SColorMap->Colors[src->RasterBits[row * src->ImageDesc.Width + col]];
-          int dest_index = (row + y) * dest.width + col + x;
-          dest.pixels[dest_index].r = pixel.Red;
-          dest.pixels[dest_index].g = pixel.Green;
-          dest.pixels[dest_index].b = pixel.Blue;
-        }
-      }
-    }
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = std::max(0, -y);
+  int row_end = std::min((int)src->ImageDesc.Height, dest.height - y);
+  int col_begin = std::max(0, -x);
+  int col_end = std::min((int)src->ImageDesc.Width, dest.width - x);
+
+  // * all 256 entries, the indices past ColorCount are black
+  Pixels32 palette[256] = {};
+  for (int i = 0; i < std::min(SColorMap->ColorCount, 256); ++i) {
+    palette[i] = {SColorMap->Colors[i].Red, SColorMap->Colors[i].Green, SColorMap->Colors[i].Blue, 0};
+  }
+
+  for (int row = row_begin; row < row_end; ++row) {
+    expand_palette.run(dest.pixels + (row + y) * dest.stride + col_begin + x,
+                       src->RasterBits + row * src->ImageDesc.Width + col_begin,
+                       (size_t)std::max(col_end - col_begin, 0), palette);
   }
 }
 
+#include "./vodus_animation.cpp"
+
 // * Save FreeType bitmap as a ppm file
 // * https://netpbm.sourceforge.net/doc/ppm.html [PPM Specification]
 int save_bitmap_as_ppm(FT_Bitmap *bitmap, const char* filename) {
@@ -234,150 +306,807 @@ Image32 load_image32_from_png(const char *filepath) {
   
   png_int_32 row_stride = 0;
   png_image_finish_read(&png, NULL, buffer, row_stride, NULL);
+  memory_track_alloc(MEMORY_EMOTES, sizeof(Pixels32) * png.height * png.width);
 
   // free(buffer);
   png_image_free(&png);
 
   Image32 result = {
-      .width = (int)png.width,
       .height = (int)png.height,
-      .pixels = buffer};
+      .width = (int)png.width,
+      .pixels = buffer,
+      .stride = (int)png.width};
   return result;
 }
 
-void slap_text_onto_image32(Image32 surface, FT_Face face, const char *text, Pixels32 color, int x, int y) {
-  size_t text_count = strlen(text);
-  int pen_x = x, pen_y = y;
-  FT_GlyphSlot slot = face->glyph; /* a small shortcut */
+#include "./vodus_shaping.cpp"
+
+// * Glyphs are rasterized once and then only slapped. Besides being way
+// * cheaper than FT_Render_Glyph on every frame, the cached glyphs can be
+// * read by many threads at once while the FT_Face can not.
+struct Glyph {
+  bool loaded;
+  uint32_t face;
+  uint32_t glyph_index;
+  Mask mask;
+  int left, top;
+};
 
-  for(int i = 0; i < (int) text_count; ++i) {
+// * Open addressing hash table of the glyphs by (face, glyph index) plus
+// * the shaped texts they are slapped by
+struct Glyph_Cache {
+  Font_Chain fonts;
+  Shape_Cache shapes;
 
-    // * retrieve glyph index from character code
-    FT_UInt glyph_index = FT_Get_Char_Index(face, (FT_UInt)text[i]);
+  size_t capacity;
+  size_t count;
+  Glyph *glyphs;
+};
 
-    // * load glyph image into the slot (erase previous one)
-    auto error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT);
-    if (error) {
-      fprintf(stderr, "could not load glyph for %c\n", text[i]);
-      exit(1);
+Glyph *glyph_cache_find_slot(Glyph *glyphs, size_t capacity, uint32_t face, uint32_t glyph_index) {
+  uint64_t hash = ((uint64_t)face << 32 | glyph_index) * 11400714819323198485ULL;
+  for (size_t i = (size_t)(hash >> 32) & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+    Glyph *glyph = &glyphs[i];
+    if (!glyph->loaded || (glyph->face == face && glyph->glyph_index == glyph_index)) {
+      return glyph;
     }
+  }
+}
 
-    // * convert to an anti-aliased bitmap
-    error = FT_Render_Glyph(face->glyph,            /* glyph slot  */
-                            FT_RENDER_MODE_NORMAL); /* render mode */
-    if (error) {
-      fprintf(stderr, "could not render glyph for %c\n", text[i]);
-      exit(1);
+void glyph_cache_grow(Glyph_Cache *cache) {
+  size_t capacity = cache->capacity == 0 ? 256 : cache->capacity * 2;
+  Glyph *glyphs = (Glyph *)calloc(capacity, sizeof(Glyph));
+  assert(glyphs);
+  memory_track_alloc(MEMORY_GLYPHS, capacity * sizeof(Glyph));
+
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    Glyph *glyph = &cache->glyphs[i];
+    if (glyph->loaded) {
+      *glyph_cache_find_slot(glyphs, capacity, glyph->face, glyph->glyph_index) = *glyph;
+    }
+  }
+
+  free(cache->glyphs);
+  memory_track_free(MEMORY_GLYPHS, cache->capacity * sizeof(Glyph));
+  cache->glyphs = glyphs;
+  cache->capacity = capacity;
+}
+
+Glyph *glyph_cache_get(Glyph_Cache *cache, uint32_t face_index, uint32_t glyph_index) {
+  if (cache->capacity > 0) {
+    Glyph *glyph = glyph_cache_find_slot(cache->glyphs, cache->capacity, face_index, glyph_index);
+    if (glyph->loaded) {
+      return glyph;
     }
+  }
+
+  // * keep the load factor under 70%
+  if ((cache->count + 1) * 10 > cache->capacity * 7) {
+    glyph_cache_grow(cache);
+  }
+
+  FT_Face face = font_chain_face(&cache->fonts, face_index);
+
+  // * load glyph image into the slot (erase previous one)
+  auto error = FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT);
+  if (error) {
+    fprintf(stderr, "could not load glyph %u\n", glyph_index);
+    exit(1);
+  }
 
-    // * load glyph image into the slot (erase previous one)
-    // error = FT_Load_Char(face, text[i], FT_LOAD_RENDER);
-    // if (error) {
-    //   fprintf(stderr, "Error during rendering character %c\n", text[i]);
-    //   exit(1);
-    // }
+  // * convert to an anti-aliased bitmap
+  error = FT_Render_Glyph(face->glyph,            /* glyph slot  */
+                          FT_RENDER_MODE_NORMAL); /* render mode */
+  if (error) {
+    fprintf(stderr, "could not render glyph %u\n", glyph_index);
+    exit(1);
+  }
 
-    slap_onto_image32(surface,
-                      &face->glyph->bitmap,
-                      color,
-                      pen_x + slot->bitmap_left,
-                      pen_y - slot->bitmap_top);
+  FT_GlyphSlot slot = face->glyph; /* a small shortcut */
+  assert(slot->bitmap.pitch >= 0);
+
+  Glyph *glyph = glyph_cache_find_slot(cache->glyphs, cache->capacity, face_index, glyph_index);
+  glyph->face = face_index;
+  glyph->glyph_index = glyph_index;
+  FT_Bitmap bitmap = slot->bitmap;
+  size_t size = (size_t)slot->bitmap.pitch * slot->bitmap.rows;
+  bitmap.buffer = (unsigned char *)malloc(size > 0 ? size : 1);
+  assert(bitmap.buffer);
+  if (size > 0) {
+    memcpy(bitmap.buffer, slot->bitmap.buffer, size);
+  }
+  glyph->mask = mask_from_bitmap(bitmap);
+  memory_track_alloc(MEMORY_GLYPHS, mask_bytes(&glyph->mask));
+  glyph->left = slot->bitmap_left;
+  glyph->top = slot->bitmap_top;
+  glyph->loaded = true;
+  cache->count += 1;
+
+  return glyph;
+}
+
+// * Calls slap(mask, x, y) for every rendered glyph of the shaped text
+template <typename Slap>
+void for_each_glyph(Glyph_Cache *cache, const char *text, int x, int y, Slap slap) {
+  const Shaped_Text *shaped = shape_cache_get(&cache->shapes, &cache->fonts, text);
+
+  // * 26.6 pen position
+  int32_t pen_x = x * 64, pen_y = y * 64;
+
+  for (size_t i = 0; i < shaped->count; ++i) {
+    const Shaped_Glyph *shaped_glyph = &shaped->glyphs[i];
+    Glyph *glyph = glyph_cache_get(cache, shaped_glyph->face, shaped_glyph->glyph_index);
+
+    slap(&glyph->mask,
+         ((pen_x + shaped_glyph->x_offset) >> 6) + glyph->left,
+         ((pen_y - shaped_glyph->y_offset) >> 6) - glyph->top);
 
     //* increment pen position
-    pen_x += slot->advance.x >> 6;
+    pen_x += shaped_glyph->x_advance;
+    pen_y -= shaped_glyph->y_advance;
+  }
+}
+
+// * Shapes and rasterizes the text upfront. After that the text can be
+// * slapped from several threads.
+void glyph_cache_load_text(Glyph_Cache *cache, const char *text) {
+  for_each_glyph(cache, text, 0, 0, [](Mask *, int, int) {});
+}
+
+void slap_text_onto_image32(Image32_View surface, Glyph_Cache *cache, const char *text, Pixels32 color, int x, int y) {
+  for_each_glyph(cache, text, x, y, [&](Mask *mask, int glyph_x, int glyph_y) {
+    slap_onto_image32(surface, mask, color, glyph_x, glyph_y);
+  });
+}
+
+// * ###################################################################
+// * Planar YUV 4:2:0
+// * ###################################################################
+
+// * BT.601 limited range
+uint8_t rgb_to_y(int r, int g, int b) {
+  return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+uint8_t rgb_to_u(int r, int g, int b) {
+  return (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+uint8_t rgb_to_v(int r, int g, int b) {
+  return (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+// * Composited directly into the planes of the encoder frames, so the
+// * frames do not go through an intermediate Image32.
+// * Every chroma sample covers 2x2 pixels. Whatever is slapped onto the
+// * surface covers a chroma sample only partially on its edges, there the
+// * chroma is blended by the covered fraction.
+// * Like Image32_View the planes point at (origin_x, origin_y) of the whole
+// * picture. The origin is always even, so the chroma samples of a view are
+// * not shared with the neighbouring views.
+struct Yuv420p {
+  int origin_x, origin_y;
+  int height, width;
+  uint8_t *y, *u, *v;
+  int y_stride, uv_stride;
+};
+
+// * Horizontal band [y, y + height) of the surface
+Yuv420p yuv420p_band(Yuv420p surface, int y, int height) {
+  assert(y % 2 == 0);
+  assert(y >= surface.origin_y);
+  assert(y + height <= surface.origin_y + surface.height);
+
+  int rows = y - surface.origin_y;
+  Yuv420p band = surface;
+  band.origin_y = y;
+  band.height = height;
+  band.y += rows * surface.y_stride;
+  band.u += rows / 2 * surface.uv_stride;
+  band.v += rows / 2 * surface.uv_stride;
+  return band;
+}
+
+void fill_yuv420p_with_color(Yuv420p surface, Pixels32 color) {
+  uint8_t y = rgb_to_y(color.r, color.g, color.b);
+  uint8_t u = rgb_to_u(color.r, color.g, color.b);
+  uint8_t v = rgb_to_v(color.r, color.g, color.b);
+
+  for (int row = 0; row < surface.height; ++row) {
+    memset(surface.y + row * surface.y_stride, y, (size_t)surface.width);
+  }
+  for (int row = 0; row < (surface.height + 1) / 2; ++row) {
+    memset(surface.u + row * surface.uv_stride, u, (size_t)(surface.width + 1) / 2);
+    memset(surface.v + row * surface.uv_stride, v, (size_t)(surface.width + 1) / 2);
+  }
+}
+
+uint8_t blend_channel(int src, int dest, int alpha) {
+  return (uint8_t)((src * alpha + dest * (255 - alpha) + 127) / 255);
+}
+
+// * Blends the chroma of the coverage, x and y are relative to the view
+void slap_chroma_onto_yuv420p(Yuv420p dest, FT_Bitmap *src, Pixels32 color, int x, int y) {
+  int color_u = rgb_to_u(color.r, color.g, color.b);
+  int color_v = rgb_to_v(color.r, color.g, color.b);
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + (int)src->rows, dest.height);
+  int col_begin = x < 0 ? 0 : x;
+  int col_end = std::min(x + (int)src->width, dest.width);
+
+  for (int row = row_begin / 2; row < (row_end + 1) / 2; ++row) {
+    for (int col = col_begin / 2; col < (col_end + 1) / 2; ++col) {
+      // * average coverage of the 2x2 pixels of the chroma sample
+      int alpha = 0;
+      for (int dy = row * 2; dy < row * 2 + 2; ++dy) {
+        for (int dx = col * 2; dx < col * 2 + 2; ++dx) {
+          if (dy >= row_begin && dy < row_end && dx >= col_begin && dx < col_end) {
+            alpha += src->buffer[(dy - y) * src->pitch + dx - x];
+          }
+        }
+      }
+      alpha /= 4;
+
+      int index = row * dest.uv_stride + col;
+      dest.u[index] = blend_channel(color_u, dest.u[index], alpha);
+      dest.v[index] = blend_channel(color_v, dest.v[index], alpha);
+    }
+  }
+}
+
+// * Slap FreeType bitmap onto Yuv420p
+void slap_onto_yuv420p(Yuv420p dest, FT_Bitmap *src, Pixels32 color, int x, int y) {
+  assert(src->pixel_mode == FT_PIXEL_MODE_GRAY);
+  assert(src->num_grays == 256);
+
+  int color_y = rgb_to_y(color.r, color.g, color.b);
 
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + (int)src->rows, dest.height);
+  int col_begin = x < 0 ? 0 : x;
+  int col_end = std::min(x + (int)src->width, dest.width);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    const uint8_t *coverage = src->buffer + (row - y) * src->pitch - x;
+    blend_plane.run(dest.y + row * dest.y_stride + col_begin, coverage + col_begin,
+                    (size_t)std::max(col_end - col_begin, 0), (uint8_t)color_y);
+  }
+
+  slap_chroma_onto_yuv420p(dest, src, color, x, y);
+}
+
+// * Slap coverage mask onto Yuv420p
+void slap_onto_yuv420p(Yuv420p dest, Mask *src, Pixels32 color, int x, int y) {
+  uint8_t color_y = rgb_to_y(color.r, color.g, color.b);
+
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + (int)src->bitmap.rows, dest.height);
+  int col_begin = std::max(0, -x);
+  int col_end = std::min((int)src->bitmap.width, dest.width - x);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    uint8_t *line = dest.y + row * dest.y_stride + x;
+    const uint8_t *coverage = src->bitmap.buffer + (row - y) * src->bitmap.pitch;
+    for_each_mask_run(src, row - y, col_begin, col_end, [&](Mask_Run_Kind kind, int col, size_t count) {
+      if (kind == MASK_RUN_SOLID) {
+        memset(line + col, color_y, count);
+      } else {
+        blend_plane.run(line + col, coverage + col, count, color_y);
+      }
+    });
+  }
+
+  slap_chroma_onto_yuv420p(dest, &src->bitmap, color, x, y);
+}
+
+// * Draft quality slap for the previews: the coverage is thresholded
+// * instead of blended and a chroma sample takes the coverage of its top
+// * left pixel
+void slap_onto_yuv420p_draft(Yuv420p dest, FT_Bitmap *src, Pixels32 color, int x, int y) {
+  assert(src->pixel_mode == FT_PIXEL_MODE_GRAY);
+
+  uint8_t color_y = rgb_to_y(color.r, color.g, color.b);
+  uint8_t color_u = rgb_to_u(color.r, color.g, color.b);
+  uint8_t color_v = rgb_to_v(color.r, color.g, color.b);
+
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + (int)src->rows, dest.height);
+  int col_begin = x < 0 ? 0 : x;
+  int col_end = std::min(x + (int)src->width, dest.width);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    uint8_t *line = dest.y + row * dest.y_stride;
+    const uint8_t *coverage = src->buffer + (row - y) * src->pitch - x;
+    for (int col = col_begin; col < col_end; ++col) {
+      if (coverage[col] >= 128) line[col] = color_y;
+    }
+  }
+
+  for (int row = (row_begin + 1) / 2; row * 2 < row_end; ++row) {
+    const uint8_t *coverage = src->buffer + (row * 2 - y) * src->pitch - x;
+    for (int col = (col_begin + 1) / 2; col * 2 < col_end; ++col) {
+      if (coverage[col * 2] >= 128) {
+        dest.u[row * dest.uv_stride + col] = color_u;
+        dest.v[row * dest.uv_stride + col] = color_v;
+      }
+    }
+  }
+}
+
+// * Slap image32 onto Yuv420p
+void slap_onto_yuv420p(Yuv420p dest, Image32 *src, int x, int y) {
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + src->height, dest.height);
+  int col_begin = x < 0 ? 0 : x;
+  int col_end = std::min(x + src->width, dest.width);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    const Pixels32 *pixels = src->pixels + (row - y) * src->stride - x;
+    rgba_to_y.run(dest.y + row * dest.y_stride + col_begin, pixels + col_begin,
+                  (size_t)std::max(col_end - col_begin, 0));
+  }
+
+  for (int row = row_begin / 2; row < (row_end + 1) / 2; ++row) {
+    for (int col = col_begin / 2; col < (col_end + 1) / 2; ++col) {
+      int r = 0, g = 0, b = 0, n = 0;
+      for (int dy = row * 2; dy < row * 2 + 2; ++dy) {
+        for (int dx = col * 2; dx < col * 2 + 2; ++dx) {
+          if (dy >= row_begin && dy < row_end && dx >= col_begin && dx < col_end) {
+            Pixels32 p = src->pixels[(dy - y) * src->stride + dx - x];
+            r += p.r;
+            g += p.g;
+            b += p.b;
+            n += 1;
+          }
+        }
+      }
+      if (n == 0) continue;
+
+      // * the image covers n out of 4 pixels of the chroma sample
+      int index = row * dest.uv_stride + col;
+      dest.u[index] = (uint8_t)((rgb_to_u(r / n, g / n, b / n) * n + dest.u[index] * (4 - n)) / 4);
+      dest.v[index] = (uint8_t)((rgb_to_v(r / n, g / n, b / n) * n + dest.v[index] * (4 - n)) / 4);
+    }
   }
 }
 
+void slap_text_onto_yuv420p(Yuv420p surface, Glyph_Cache *cache, const char *text, Pixels32 color, int x, int y) {
+  for_each_glyph(cache, text, x, y, [&](Mask *mask, int glyph_x, int glyph_y) {
+    slap_onto_yuv420p(surface, mask, color, glyph_x, glyph_y);
+  });
+}
+
+#include "./vodus_planar.cpp"
+#include "./vodus_effects.cpp"
+#include "./vodus_sdf.cpp"
+
 // * ###################################################################
-// * pthreads
+// * Timing
 // * ###################################################################
 
-// *  0   1   2   3   4
-// * [*] [*] [ ] [ ] [ ]
-// *  ^ = queue_begin = 0
-// *          ^ = queue_size = 2
-// *
-// * next_queue_frame == queue[2]
+// * 48.16 fixed-point number.
+// * Everything that moves on the screen is computed straight from the frame
+// * index, never accumulated from the previous frame. So any frame can be
+// * rendered on its own and a long VOD does not drift.
+using Fixed = int64_t;
+constexpr int FIXED_SHIFT = 16;
+constexpr Fixed FIXED_ONE = (Fixed)1 << FIXED_SHIFT;
+
+constexpr int fixed_to_int(Fixed x) {
+  return (int)(x >> FIXED_SHIFT);
+}
+
+constexpr size_t VODUS_FPS = 100;
+constexpr size_t VODUS_DURATION = 10;
+constexpr size_t VODUS_FRAMES_COUNT = VODUS_FPS * VODUS_DURATION;
+
+struct Scene {
+  int text_x, text_y;
+};
+
+Scene scene_at_frame(size_t index) {
+  // * The text goes from the bottom to the top of the surface
+  // * in VODUS_DURATION seconds
+  Fixed height = (Fixed)VODUS_HEIGHT * FIXED_ONE;
+  Fixed text_y = height - height * (Fixed)index / (Fixed)VODUS_FRAMES_COUNT;
+
+  Scene scene;
+  // * zero the padding too, the scene is hashed byte by byte
+  memset(&scene, 0, sizeof(scene));
+  scene.text_x = 0;
+  scene.text_y = fixed_to_int(text_y);
+  return scene;
+}
+
+// * FNV-1a over everything that ends up on the screen.
+// * Frames with equal scene hashes are identical, so only the first one
+// * of them has to be rendered.
+uint64_t scene_hash(Scene scene) {
+  uint64_t hash = 14695981039346656037ULL;
+  const uint8_t *bytes = (const uint8_t *)&scene;
+  for (size_t i = 0; i < sizeof(scene); ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// * ###################################################################
+// * Band-parallel compositing
+// * ###################################################################
+
+constexpr size_t BANDS_CAPACITY = 64;
+
+struct Band_Pool;
 
-constexpr size_t VODUS_QUEUE_CAPACITY = 1024;
-Image32 queue[VODUS_QUEUE_CAPACITY];
-size_t queue_begin = 0;
-size_t queue_size = 0;
+struct Band_Worker {
+  Band_Pool *pool;
+  size_t band;
+};
 
-std::atomic<bool> stop_output_threads(false);
-std::atomic<int> frame_count(0);
+// * Splits a frame into horizontal bands that are composited by different
+// * threads at the same time. The thread that runs the job takes the band 0.
+struct Band_Pool {
+  size_t count;
+  pthread_t threads[BANDS_CAPACITY];
+  Band_Worker workers[BANDS_CAPACITY];
+
+  pthread_mutex_t mutex;
+  pthread_cond_t job_cond;
+  pthread_cond_t done_cond;
+
+  void (*job)(void *context, size_t band, size_t count);
+  void *context;
+  size_t generation;
+  size_t pending;
+  bool stop;
+};
 
-pthread_mutex_t queue_mutex;
-pthread_t output_threads[VODUS_OUTPUT_THREADS_COUNT];
+void *band_thread_routine(void *arg) {
+  Band_Worker *worker = (Band_Worker *)arg;
+  Band_Pool *pool = worker->pool;
+  size_t generation = 0;
 
-bool enqueue(Image32 frame) {
-  // * lock the queue
-  pthread_mutex_lock(&queue_mutex); 
-  defer(pthread_mutex_unlock(&queue_mutex));
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stop && pool->generation == generation) {
+      pthread_cond_wait(&pool->job_cond, &pool->mutex);
+    }
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->mutex);
+      return nullptr;
+    }
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+
+    pool->job(pool->context, worker->band, pool->count);
 
-  if(queue_size >= VODUS_QUEUE_CAPACITY) {
-    return false;
+    pthread_mutex_lock(&pool->mutex);
+    pool->pending -= 1;
+    if (pool->pending == 0) {
+      pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
   }
-  queue[(queue_begin + queue_size) % VODUS_QUEUE_CAPACITY] = frame;
-  queue_size += 1;
-  return true;
 }
 
-Image32 dequeue() {
-  // * lock the queue
-  pthread_mutex_lock(&queue_mutex); 
-  defer(pthread_mutex_unlock(&queue_mutex));
+void band_pool_init(Band_Pool *pool, size_t count) {
+  assert(count > 0);
+  assert(count <= BANDS_CAPACITY);
 
-  if(queue_size == 0) {
-    return {0, 0, nullptr};
+  memset(pool, 0, sizeof(*pool));
+  pool->count = count;
+  pthread_mutex_init(&pool->mutex, nullptr);
+  pthread_cond_init(&pool->job_cond, nullptr);
+  pthread_cond_init(&pool->done_cond, nullptr);
+
+  for (size_t band = 1; band < count; ++band) {
+    pool->workers[band] = {pool, band};
+    pthread_create(&pool->threads[band], nullptr, band_thread_routine, &pool->workers[band]);
   }
-  Image32 result = queue[queue_begin];
-  queue_size -= 1;
-  queue_begin += 1;
-  // if(current_frame_count) *current_frame_count = frame_count++;
-  return result;
 }
 
-void *output_thread_routine(void *) {
+void band_pool_destroy(Band_Pool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->job_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (size_t band = 1; band < pool->count; ++band) {
+    pthread_join(pool->threads[band], nullptr);
+  }
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->job_cond);
+  pthread_mutex_destroy(&pool->mutex);
+}
+
+// * Runs job(context, band, count) for every band and waits for all of them
+void band_pool_run(Band_Pool *pool, void (*job)(void *, size_t, size_t), void *context) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->job = job;
+  pool->context = context;
+  pool->pending = pool->count - 1;
+  pool->generation += 1;
+  pthread_cond_broadcast(&pool->job_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  job(context, 0, pool->count);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+template <typename F>
+void band_pool_run(Band_Pool *pool, F f) {
+  band_pool_run(pool, [](void *context, size_t band, size_t count) {
+    (*(F *)context)(band, count);
+  }, &f);
+}
+
+// * Bands are even in height, so they never share chroma rows of a Yuv420p
+void band_rows(int height, size_t band, size_t count, int *y0, int *y1) {
+  int band_height = (height + (int)count - 1) / (int)count;
+  band_height += band_height % 2;
+  *y0 = std::min((int)band * band_height, height);
+  *y1 = std::min(*y0 + band_height, height);
+}
+
+Image32_View band_of(Image32_View surface, size_t band, size_t count) {
+  int y0, y1;
+  band_rows(surface.height, band, count, &y0, &y1);
+  return image32_subview(surface, surface.origin_x, surface.origin_y + y0, surface.width, y1 - y0);
+}
+
+Yuv420p band_of(Yuv420p surface, size_t band, size_t count) {
+  int y0, y1;
+  band_rows(surface.height, band, count, &y0, &y1);
+  return yuv420p_band(surface, surface.origin_y + y0, y1 - y0);
+}
+
+Yuv444p band_of(Yuv444p surface, size_t band, size_t count) {
+  int y0, y1;
+  band_rows(surface.height, band, count, &y0, &y1);
+  return yuv444p_band(surface, surface.origin_y + y0, y1 - y0);
+}
+
+// * ###################################################################
+// * Rendering
+// * ###################################################################
+
+// * The caches are not owned by the renderer, the renderers of the batch
+// * jobs share them (see vodus_batch.cpp)
+struct Renderer {
+  Glyph_Cache *glyphs;
+  // * outline and shadow of the glyph cache text, see vodus_effects.cpp
+  Effect_Cache *effects;
+  // * When not nullptr the text is reconstructed from the SDF atlas
+  // * at text_size instead of using the glyph cache
+  Sdf_Atlas *sdf;
+  int text_size;
+  const char *text;
+  GifFileType *gif_file;
+  Image32 png;
+  // * the png is drawn at this height, 0 is its own size
+  int emote_height;
+  Emote_Cache *emotes;
+  // * the chat messages with this word get the png in front of them,
+  // * nullptr never
+  const char *emote_code;
+  // * the gif as an animated emote of the chat, nullptr when the mode
+  // * does not draw it
+  Gif_Timeline *gif;
+  const char *gif_code;
+  // * nullptr renders the frames on the calling thread only
+  Band_Pool *bands;
+  // * 1 is the full resolution, n renders the scenes at 1/n of it
+  int scale;
+  // * thresholded text instead of blended, see slap_onto_yuv420p_draft
+  bool draft;
+};
+
+// * The name of the emote file without the directory and the extension,
+// * like gasm for emotes/gasm.png
+const char *emote_code_of(const char *filepath) {
+  const char *slash = strrchr(filepath, '/');
+  const char *name = slash ? slash + 1 : filepath;
+  const char *dot = strrchr(name, '.');
+  char *code = strndup(name, dot && dot != name ? (size_t)(dot - name) : strlen(name));
+  assert(code);
+  return code;
+}
+
+// * The png at the size it is drawn at
+Image32 *renderer_emote(Renderer *renderer) {
+  return emote_cache_get(renderer->emotes, &renderer->png, renderer->emote_height);
+}
+
+// * Shapes and rasterizes the text and its effects and scales the emote
+// * upfront. After that the text can be slapped from several threads.
+void renderer_load_text(Renderer *renderer, const char *text) {
+  renderer_emote(renderer);
+  if (renderer->sdf) return;
+  glyph_cache_load_text(renderer->glyphs, text);
+  if (text_effects_enabled(&renderer->effects->effects)) {
+    effect_cache_get(renderer->effects, renderer->glyphs, text);
+  }
+}
+
+void render_scene(Renderer *renderer, Image32_View surface, Scene scene) {
+  // * Clean up the surface
+  fill_image32_with_color(surface, {50, 50, 50, 255});
+
+  // * Slap the text onto image32
+  Pixels32 color = {255, 0, 0, 255};
+  if (renderer->sdf) {
+    slap_sdf_text_onto_image32(surface, renderer->sdf, renderer->text, renderer->text_size, color, scene.text_x, scene.text_y);
+  } else {
+    slap_text_effects_onto_image32(surface, renderer->effects, renderer->glyphs, renderer->text, scene.text_x, scene.text_y);
+    slap_text_onto_image32(surface, renderer->glyphs, renderer->text, color, scene.text_x, scene.text_y);
+  }
+
+  // int gif_index = ((int)(t / gif_dt) % renderer->gif_file->ImageCount);
+  // assert(renderer->gif_file->ImageCount > 0);
+  // slap_onto_image32(surface,
+  //                   &renderer->gif_file->SavedImages[gif_index],
+  //                   renderer->gif_file->SColorMap,
+  //                   scene.text_x, scene.text_y);
+
+  // * Slap png image onto surface
+  slap_onto_image32(surface, renderer_emote(renderer), scene.text_x, scene.text_y);
+}
+
+void render_scene(Renderer *renderer, Yuv420p surface, Scene scene) {
+  fill_yuv420p_with_color(surface, {50, 50, 50, 255});
+  if (renderer->draft && !renderer->sdf) {
+    for_each_glyph(renderer->glyphs, renderer->text, scene.text_x, scene.text_y, [&](Mask *mask, int glyph_x, int glyph_y) {
+      slap_onto_yuv420p_draft(surface, &mask->bitmap, {255, 0, 0, 255}, glyph_x, glyph_y);
+    });
+  } else if (renderer->sdf) {
+    slap_sdf_text_onto_yuv420p(surface, renderer->sdf, renderer->text, renderer->text_size, {255, 0, 0, 255}, scene.text_x, scene.text_y);
+  } else {
+    slap_text_effects_onto_yuv420p(surface, renderer->effects, renderer->glyphs, renderer->text, scene.text_x, scene.text_y);
+    slap_text_onto_yuv420p(surface, renderer->glyphs, renderer->text, {255, 0, 0, 255}, scene.text_x, scene.text_y);
+  }
+  slap_onto_yuv420p(surface, renderer_emote(renderer), scene.text_x, scene.text_y);
+}
+
+void render_scene(Renderer *renderer, Yuv444p surface, Scene scene) {
+  fill_yuv444p_with_color(surface, {50, 50, 50, 255});
+  if (renderer->sdf) {
+    slap_sdf_text_onto_yuv444p(surface, renderer->sdf, renderer->text, renderer->text_size, {255, 0, 0, 255}, scene.text_x, scene.text_y);
+  } else {
+    slap_text_effects_onto_yuv444p(surface, renderer->effects, renderer->glyphs, renderer->text, scene.text_x, scene.text_y);
+    slap_text_onto_yuv444p(surface, renderer->glyphs, renderer->text, {255, 0, 0, 255}, scene.text_x, scene.text_y);
+  }
+  slap_onto_yuv444p(surface, renderer_emote(renderer), scene.text_x, scene.text_y);
+}
+
+// * Render the frame with the given index onto the surface.
+// * Does not depend on any previously rendered frame.
+template <typename Surface>
+void render_frame(Renderer *renderer, Surface surface, size_t index) {
+  Scene scene = scene_at_frame(index);
+  if (renderer->scale > 1) {
+    scene.text_x /= renderer->scale;
+    scene.text_y /= renderer->scale;
+  }
+
+  if (renderer->bands == nullptr || renderer->bands->count <= 1) {
+    render_scene(renderer, surface, scene);
+    return;
+  }
+
+  // * The bands only read the glyph, shape and effect caches
+  renderer_load_text(renderer, renderer->text);
+  band_pool_run(renderer->bands, [&](size_t band, size_t count) {
+    render_scene(renderer, band_of(surface, band, count), scene);
+  });
+}
+
+// * ###################################################################
+// * Frames
+// * ###################################################################
+
+struct Frame {
+  size_t index;
+  Image32 image;
+  // * CLOCK_MONOTONIC nanoseconds after which nobody wants the frame
+  // * anymore and the compress stages drop it. 0 never expires.
+  uint64_t deadline;
+};
+
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// * compress stages of the PNG and archive pipeline, see vodus_pipeline.cpp
+constexpr size_t OUTPUT_THREADS_CAPACITY = 256;
+
+#include "./vodus_archive.cpp"
+#include "./vodus_io.cpp"
+
+Frame_Writer frame_writer;
+Archive_Format frame_format = ARCHIVE_FORMAT_PNG;
+
+// * Duplicate frames are never rendered, instead they become hard links
+// * to the first frame with the same scene. Done after the frame writer
+// * is finished, so the source frame is guaranteed to be on the disk.
+void link_duplicate_frames(size_t frames_begin, size_t frames_end) {
   constexpr size_t FILE_PATH_CAPA = 256;
-  char file_path[FILE_PATH_CAPA];
-  
-  for (;;) {
-    // * get the next avilable frame from queue
-    Image32 frame = dequeue();
-    if (frame.pixels == nullptr) {
-      if(stop_output_threads.load()) {
-        return nullptr;
-      }
+  char source_path[FILE_PATH_CAPA];
+  char link_path[FILE_PATH_CAPA];
+
+  uint64_t source_hash = scene_hash(scene_at_frame(frames_begin));
+  snprintf(source_path, FILE_PATH_CAPA, "output/frame-%05zu.png", frames_begin);
+
+  for (size_t index = frames_begin + 1; index < frames_end; ++index) {
+    uint64_t hash = scene_hash(scene_at_frame(index));
+    if (hash != source_hash) {
+      source_hash = hash;
+      snprintf(source_path, FILE_PATH_CAPA, "output/frame-%05zu.png", index);
       continue;
     }
-    
-    // * build filepath
-    snprintf(file_path, FILE_PATH_CAPA, "output/frame-%05d.png", frame_count.fetch_add(1, std::memory_order_relaxed));
-    save_image32_as_png(frame, file_path);
 
-    delete[] frame.pixels;
+    snprintf(link_path, FILE_PATH_CAPA, "output/frame-%05zu.png", index);
+    unlink(link_path);
+    if (link(source_path, link_path) < 0) {
+      fprintf(stderr, "could not link %s to %s: %s\n", link_path, source_path, strerror(errno));
+      exit(1);
+    }
   }
 }
 
+// * ###################################################################
+// * libavcodec
+// * ###################################################################
 
-static void encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt,
-  FILE *outfile) {
-  int ret;
+struct Encoder {
+  AVFormatContext *format;
+  AVCodecContext *context;
+  AVStream *stream;
+  AVPacket *packet;
+
+  // * Pool of the frames the renderer draws into. A frame is reused as soon
+  // * as the codec drops all of its references to it, so the renderer never
+  // * waits for the encoder threads and nothing is copied. The pool grows
+  // * to as many frames as the codec holds at once (frame threads plus the
+  // * lookahead).
+  AVFrame **frames;
+  size_t frames_count;
+  size_t frames_capacity;
+  // * The frame sent last. Kept intact because it may be repeated.
+  AVFrame *last_frame;
+  int width, height;
+};
 
+static void encode(Encoder *encoder, AVFrame *frame) {
   // * send the frame to the encoder
-  if (frame)
-    printf("Send frame %3" PRId64 "\n", frame->pts);
-
-  ret = avcodec_send_frame(enc_ctx, frame);
+  int ret = avcodec_send_frame(encoder->context, frame);
   if (ret < 0) {
     fprintf(stderr, "Error sending a frame for encoding\n");
     exit(1);
   }
 
   while (ret >= 0) {
-    ret = avcodec_receive_packet(enc_ctx, pkt);
+    ret = avcodec_receive_packet(encoder->context, encoder->packet);
     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
       return;
     else if (ret < 0) {
@@ -385,19 +1114,61 @@ static void encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt,
       exit(1);
     }
 
-    printf("Write packet %3" PRId64 " (size=%5d)\n", pkt->pts, pkt->size);
-    fwrite(pkt->data, 1, pkt->size, outfile);
-    av_packet_unref(pkt);
+    av_packet_rescale_ts(encoder->packet, encoder->context->time_base, encoder->stream->time_base);
+    encoder->packet->stream_index = encoder->stream->index;
+    // * the muxer takes the ownership of the packet data
+    avec(av_interleaved_write_frame(encoder->format, encoder->packet));
   }
 }
 
-int main2(void) {
-  /* find the mpeg1video encoder */
-  // codec = avcodec_find_encoder_by_name(codec_name);
-  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG1VIDEO);
+struct Encoder_Config {
+  const char *codec_name;
+  const char *preset;
+  // * Constant Rate Factor, negative means use bit_rate instead
+  int crf;
+  int64_t bit_rate;
+  int gop_size;
+  int max_b_frames;
+  AVPixelFormat pix_fmt;
+  // * 0 lets libavcodec pick the amount of threads by the cores count
+  int thread_count;
+};
+
+Encoder_Config default_encoder_config() {
+  Encoder_Config config = {};
+  config.codec_name = "mpeg1video";
+  config.preset = nullptr;
+  config.crf = -1;
+  config.bit_rate = 400'000;
+  /* emit one intra frame every ten frames */
+  config.gop_size = 10;
+  config.max_b_frames = 1;
+  config.pix_fmt = AV_PIX_FMT_YUV420P;
+  config.thread_count = 0;
+  return config;
+}
+
+// * The container is guessed from the file extension.
+// * Use .ts if the output has to be concatenated with plain `cat`.
+void encoder_open(Encoder *encoder, const Encoder_Config *config, const char *filepath, int width, int height) {
+  memset(encoder, 0, sizeof(*encoder));
+
+  avformat_alloc_output_context2(&encoder->format, nullptr, nullptr, filepath);
+  if (!encoder->format) {
+    fprintf(stderr, "Could not deduce output format from %s\n", filepath);
+    exit(1);
+  }
+
+  const AVCodec *codec = avcodec_find_encoder_by_name(config->codec_name);
   if (!codec) {
-      fprintf(stderr, "Codec not found\n");
-      exit(1);
+    fprintf(stderr, "Codec %s not found\n", config->codec_name);
+    exit(1);
+  }
+
+  encoder->stream = avformat_new_stream(encoder->format, nullptr);
+  if (!encoder->stream) {
+    fprintf(stderr, "Could not allocate output stream\n");
+    exit(1);
   }
 
   // * Allocate the context
@@ -406,158 +1177,714 @@ int main2(void) {
     fprintf(stderr, "Could not allocate video codec context\n");
     exit(1);
   }
-  defer(avcodec_free_context(&c));
-
-  // if (codec->id == AV_CODEC_ID_H264)
-    // av_opt_set(c->priv_data, "preset", "slow", 0);
+  encoder->context = c;
 
-  /* put sample parameters */
-  c->bit_rate = 400'000;
   /* resolution must be a multiple of two */
-  c->width = 690;
-  c->height = 420;
-  /* frames per second */
-  c->time_base = (AVRational){1, 25};
-  c->framerate = (AVRational){25, 1};
-  /* emit one intra frame every ten frames
-    * check frame pict_type before passing frame
-    * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-    * then gop_size is ignored and the output of encoder
-    * will always be I frame irrespective to gop_size
-    */
-  c->gop_size = 10;
-  c->max_b_frames = 1;
-  c->pix_fmt = AV_PIX_FMT_YUV420P;
-
-  if (codec->id == AV_CODEC_ID_H264)
-      av_opt_set(c->priv_data, "preset", "slow", 0);
-
-  AVPacket *pkt = av_packet_alloc();
-  if(!pkt) {
-    fprintf(stderr, "Could not allocate packet\n");
-    exit(1);
+  c->width = width;
+  c->height = height;
+  /* one tick of the time base is one frame, so pts == frame index */
+  c->time_base = {1, (int)VODUS_FPS};
+  c->framerate = {(int)VODUS_FPS, 1};
+  c->gop_size = config->gop_size;
+  c->max_b_frames = config->max_b_frames;
+  c->pix_fmt = config->pix_fmt;
+  /* GOPs never reference frames outside of themselves,
+   * so the segments can be glued together without re-encoding */
+  c->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+  if (encoder->format->oformat->flags & AVFMT_GLOBALHEADER) {
+    c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  /* let the codec use both frame and slice threading,
+   * whatever of them it supports */
+  c->thread_count = config->thread_count;
+  c->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  if (config->crf >= 0) {
+    c->bit_rate = 0;
+    if (av_opt_set_int(c->priv_data, "crf", config->crf, 0) < 0) {
+      fprintf(stderr, "Codec %s does not support crf\n", codec->name);
+      exit(1);
+    }
+  } else {
+    c->bit_rate = config->bit_rate;
+  }
+
+  if (config->preset) {
+    if (av_opt_set(c->priv_data, "preset", config->preset, 0) < 0) {
+      fprintf(stderr, "Codec %s does not support preset %s\n", codec->name, config->preset);
+      exit(1);
+    }
   }
-  defer(av_packet_free(&pkt));
 
   // * open it
   avec(avcodec_open2(c, codec, nullptr));
+  printf("Encoding with %s (%s, %d threads)\n",
+         codec->name, av_get_pix_fmt_name(c->pix_fmt), c->thread_count);
 
-  const char *filename = "output.mp4";
-  FILE *f = fopen(filename, "wb");
-  if(!f) {
-    fprintf(stderr, "could not open %s\n", filename);
-    exit(1);  
+  encoder->stream->time_base = c->time_base;
+  avec(avcodec_parameters_from_context(encoder->stream->codecpar, c));
+
+  if (!(encoder->format->oformat->flags & AVFMT_NOFILE)) {
+    avec(avio_open(&encoder->format->pb, filepath, AVIO_FLAG_WRITE));
+  }
+  avec(avformat_write_header(encoder->format, nullptr));
+
+  encoder->packet = av_packet_alloc();
+  if(!encoder->packet) {
+    fprintf(stderr, "Could not allocate packet\n");
+    exit(1);
+  }
+
+  encoder->width = c->width;
+  encoder->height = c->height;
+}
+
+// * The buffers the frame references
+size_t av_frame_bytes(const AVFrame *frame) {
+  size_t size = 0;
+  for (size_t i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; ++i) {
+    size += frame->buf[i]->size;
+  }
+  return size;
+}
+
+// * Returns a frame from the pool the caller is free to draw into
+AVFrame *encoder_acquire_frame(Encoder *encoder) {
+  for (size_t i = 0; i < encoder->frames_count; ++i) {
+    AVFrame *frame = encoder->frames[i];
+    if (frame != encoder->last_frame && av_frame_is_writable(frame)) {
+      return frame;
+    }
+  }
+
+  // * The codec keeps a reference to every frame of the pool
+  if (encoder->frames_count >= encoder->frames_capacity) {
+    encoder->frames_capacity = encoder->frames_capacity == 0 ? 16 : encoder->frames_capacity * 2;
+    encoder->frames = (AVFrame **)realloc(encoder->frames, sizeof(AVFrame *) * encoder->frames_capacity);
+    assert(encoder->frames);
   }
-  defer(fclose(f));
 
   AVFrame *frame = av_frame_alloc();
   if(!frame) {
     fprintf(stderr, "Could not allocate video frame\n");
     exit(1);
   }
-  frame->format = c->pix_fmt;
-  frame->width= c->width;
-  frame->height= c->height;
-  defer(av_frame_free(&frame));
-
+  frame->format = encoder->context->pix_fmt;
+  frame->width = encoder->width;
+  frame->height = encoder->height;
   avec(av_frame_get_buffer(frame, 0));
+  memory_track_alloc(MEMORY_ENCODER, av_frame_bytes(frame));
+  encoder->frames[encoder->frames_count++] = frame;
+  return frame;
+}
+
+void convert_image32_to_yuv420p(Image32 image, AVFrame *frame) {
+  //* Y
+  for (int row = 0; row < image.height; ++row) {
+    rgba_to_y.run(frame->data[0] + row * frame->linesize[0], image.pixels + row * image.stride, (size_t)image.width);
+  }
 
-  /* encode 1 second of video */
-  for (int i = 0; i < 25; i++) {
-    fflush(stdout);
-
-    /* Make sure the frame data is writable.
-        On the first round, the frame is fresh from av_frame_get_buffer()
-        and therefore we know it is writable.
-        But on the next rounds, encode() will have called
-        avcodec_send_frame(), and the codec may have kept a reference to
-        the frame in its internal structures, that makes the frame
-        unwritable.
-        av_frame_make_writable() checks that and allocates a new buffer
-        for the frame only if necessary.
-      */
-    avec(av_frame_make_writable(frame));
-
-    //* Y 
-    for (int y = 0; y < c->height; y++) {
-      for (int x = 0; x < c->width; x++) {
-          frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
+  //* Cb and Cr are averaged over 2x2 blocks
+  for (int row = 0; row < (image.height + 1) / 2; ++row) {
+    for (int col = 0; col < (image.width + 1) / 2; ++col) {
+      int r = 0, g = 0, b = 0, n = 0;
+      for (int dy = 0; dy < 2 && row * 2 + dy < image.height; ++dy) {
+        for (int dx = 0; dx < 2 && col * 2 + dx < image.width; ++dx) {
+          Pixels32 p = image.pixels[(row * 2 + dy) * image.stride + col * 2 + dx];
+          r += p.r;
+          g += p.g;
+          b += p.b;
+          n += 1;
+        }
       }
+      r /= n;
+      g /= n;
+      b /= n;
+      frame->data[1][row * frame->linesize[1] + col] = rgb_to_u(r, g, b);
+      frame->data[2][row * frame->linesize[2] + col] = rgb_to_v(r, g, b);
     }
+  }
+}
+
+void convert_image32_to_yuv444p(Image32 image, AVFrame *frame) {
+  for (int row = 0; row < image.height; ++row) {
+    const Pixels32 *pixels = image.pixels + row * image.stride;
+    rgba_to_y.run(frame->data[0] + row * frame->linesize[0], pixels, (size_t)image.width);
+    rgba_to_uv.run(frame->data[1] + row * frame->linesize[1], frame->data[2] + row * frame->linesize[2],
+                   pixels, (size_t)image.width);
+  }
+}
+
+void convert_image32_to_rgba(Image32 image, AVFrame *frame) {
+  for (int row = 0; row < image.height; ++row) {
+    memcpy(frame->data[0] + row * frame->linesize[0],
+           image.pixels + row * image.stride,
+           sizeof(Pixels32) * (size_t)image.width);
+  }
+}
 
-    //* Cb and Cr 
-    for (int y = 0; y < c->height / 2; y++) {
-      for (int x = 0; x < c->width / 2; x++) {
-        frame->data[1][y * frame->linesize[1] + x] = 128 + y + i * 2;
-        frame->data[2][y * frame->linesize[2] + x] = 64 + x + i * 5;
+bool is_supported_pix_fmt(AVPixelFormat pix_fmt) {
+  return pix_fmt == AV_PIX_FMT_YUV420P
+      || pix_fmt == AV_PIX_FMT_YUV444P
+      || pix_fmt == AV_PIX_FMT_RGBA;
+}
+
+void convert_image32_to_frame(Image32 image, AVFrame *frame) {
+  switch (frame->format) {
+  case AV_PIX_FMT_YUV420P: convert_image32_to_yuv420p(image, frame); break;
+  case AV_PIX_FMT_YUV444P: convert_image32_to_yuv444p(image, frame); break;
+  case AV_PIX_FMT_RGBA:    convert_image32_to_rgba(image, frame);    break;
+  default: assert(0 && "unreachable: pixel format is checked on the start up");
+  }
+}
+
+// * The frames of the pool as surfaces the renderer can draw into directly
+Image32 image32_from_frame(AVFrame *frame) {
+  assert(frame->format == AV_PIX_FMT_RGBA);
+  assert(frame->linesize[0] % (int)sizeof(Pixels32) == 0);
+  Image32 image = {
+    .height = frame->height,
+    .width = frame->width,
+    .pixels = (Pixels32 *)frame->data[0],
+    .stride = frame->linesize[0] / (int)sizeof(Pixels32)};
+  return image;
+}
+
+Yuv420p yuv420p_from_frame(AVFrame *frame) {
+  assert(frame->format == AV_PIX_FMT_YUV420P);
+  assert(frame->linesize[1] == frame->linesize[2]);
+  Yuv420p surface = {
+    .origin_x = 0,
+    .origin_y = 0,
+    .height = frame->height,
+    .width = frame->width,
+    .y = frame->data[0],
+    .u = frame->data[1],
+    .v = frame->data[2],
+    .y_stride = frame->linesize[0],
+    .uv_stride = frame->linesize[1]};
+  return surface;
+}
+
+Yuv444p yuv444p_from_frame(AVFrame *frame) {
+  assert(frame->format == AV_PIX_FMT_YUV444P);
+  assert(frame->linesize[0] == frame->linesize[1] && frame->linesize[1] == frame->linesize[2]);
+  Yuv444p surface = {
+    .origin_x = 0,
+    .origin_y = 0,
+    .height = frame->height,
+    .width = frame->width,
+    .y = frame->data[0],
+    .u = frame->data[1],
+    .v = frame->data[2],
+    .stride = frame->linesize[0]};
+  return surface;
+}
+
+void encoder_send(Encoder *encoder, AVFrame *frame, int64_t pts) {
+  frame->pts = pts;
+  encode(encoder, frame);
+  encoder->last_frame = frame;
+}
+
+// * Sends the last encoded picture once more without touching its pixels
+void encoder_repeat(Encoder *encoder, int64_t pts) {
+  assert(encoder->last_frame);
+  encoder_send(encoder, encoder->last_frame, pts);
+}
+
+void encoder_close(Encoder *encoder) {
+  //* flush the encoder
+  encode(encoder, nullptr);
+  avec(av_write_trailer(encoder->format));
+
+  if (!(encoder->format->oformat->flags & AVFMT_NOFILE)) {
+    avio_closep(&encoder->format->pb);
+  }
+  for (size_t i = 0; i < encoder->frames_count; ++i) {
+    memory_track_free(MEMORY_ENCODER, av_frame_bytes(encoder->frames[i]));
+    av_frame_free(&encoder->frames[i]);
+  }
+  free(encoder->frames);
+  encoder->frames = nullptr;
+  encoder->frames_count = 0;
+  encoder->frames_capacity = 0;
+  encoder->last_frame = nullptr;
+  av_packet_free(&encoder->packet);
+  avcodec_free_context(&encoder->context);
+  avformat_free_context(encoder->format);
+  encoder->format = nullptr;
+}
+
+// * Encodes the frames [begin, end) into the file in order on this thread.
+// * Returns how many of them were actually rendered.
+size_t encode_frames(Renderer *renderer, const Encoder_Config *config, const char *file_path,
+                     size_t begin, size_t end, bool dedup, bool vfr) {
+  Image32 surface = {
+      .height = VODUS_HEIGHT,
+      .width = VODUS_WIDTH,
+      .pixels = (Pixels32 *)malloc(sizeof(Pixels32) * VODUS_WIDTH * VODUS_HEIGHT),
+      .stride = VODUS_WIDTH};
+  assert(surface.pixels);
+  defer(free(surface.pixels));
+
+  Encoder encoder = {};
+  encoder_open(&encoder, config, file_path, VODUS_WIDTH, VODUS_HEIGHT);
+
+  size_t rendered_count = 0;
+  uint64_t previous_hash = 0;
+  for (size_t index = begin; index < end; ++index) {
+    uint64_t hash = scene_hash(scene_at_frame(index));
+    if (dedup && index > begin && hash == previous_hash) {
+      // * With VFR the previous frame just lasts longer. The last frame is
+      // * always sent, otherwise the trailing idle period would be lost.
+      if (!vfr || index + 1 == end) {
+        encoder_repeat(&encoder, (int64_t)index);
       }
+      continue;
+    }
+    previous_hash = hash;
+
+    // * The surface is picked by the pixel format of the encoder, the
+    // * frames of all the supported formats are rendered in place.
+    // * Anything else would go through the Image32 surface.
+    AVFrame *frame = encoder_acquire_frame(&encoder);
+    switch (frame->format) {
+    case AV_PIX_FMT_RGBA:
+      render_frame(renderer, image32_view(image32_from_frame(frame)), index);
+      break;
+    case AV_PIX_FMT_YUV420P:
+      render_frame(renderer, yuv420p_from_frame(frame), index);
+      break;
+    case AV_PIX_FMT_YUV444P:
+      render_frame(renderer, yuv444p_from_frame(frame), index);
+      break;
+    default:
+      render_frame(renderer, image32_view(surface), index);
+      convert_image32_to_frame(surface, frame);
     }
+    encoder_send(&encoder, frame, (int64_t)index);
+    rendered_count += 1;
+  }
 
-    frame->pts = i;
+  encoder_close(&encoder);
+  return rendered_count;
+}
 
-    //* encode the image 
-    encode(c, frame, pkt, f);
-  }
+#include "./vodus_cache.cpp"
+#include "./vodus_startup.cpp"
+#include "./vodus_preview.cpp"
+#include "./vodus_threads.cpp"
+#include "./vodus_scheduler.cpp"
+#include "./vodus_pipeline.cpp"
+#include "./vodus_live.cpp"
+#include "./vodus_chatlog.cpp"
+#include "./vodus_bench.cpp"
+#include "./vodus_batch.cpp"
 
-  //* flush the encoder */
-  encode(c, nullptr, pkt, f);
+// * ###################################################################
+// * main
+// * ###################################################################
 
+void usage(FILE *stream) {
+  fprintf(stream, "Usage: ./vodus [options] <text> <gif_image> <png_image> [font]\n");
+  fprintf(stream, "       ./vodus [options] --batch <jobs>\n");
+  fprintf(stream, "Options:\n");
+  fprintf(stream, "    --frames <begin> <end>  render only the frames in range [begin, end)\n");
+  fprintf(stream, "    --output <file>         encode the frames into a video file instead of output/*.png\n");
+  fprintf(stream, "    --archive <file>        append the frames into one indexed archive instead of output/*.png\n");
+  fprintf(stream, "    --archive-format <fmt>  png, qoi or raw frames in the archive (default: png)\n");
+  fprintf(stream, "    --bands <n>             composite every frame as n horizontal bands in parallel (default: 1)\n");
+  fprintf(stream, "    --output-threads <n>    PNG compression stages (default: the cores not taken by --bands)\n");
+  fprintf(stream, "    --pin                   pin the rendering and the compression workers to CPUs\n");
+  fprintf(stream, "    --font-size <px>        pixel size of the text (default: 64)\n");
+  fprintf(stream, "    --outline <px>          black outline of the given width around the text\n");
+  fprintf(stream, "    --shadow <px>           drop shadow of the text blurred and offset by the given amount\n");
+  fprintf(stream, "    --emote-height <px>     scale the png image to the given height (default: its own size)\n");
+  fprintf(stream, "    --fallback-font <file>  font for the characters missing in the main one, can be repeated\n");
+  fprintf(stream, "    --sdf                   draw the text from a signed distance field atlas\n");
+  fprintf(stream, "    --no-dedup              render every frame even if its scene did not change\n");
+  fprintf(stream, "    --live <source>         render the chat lines from source (- is stdin, else a unix socket) in real time, requires --archive\n");
+  fprintf(stream, "    --live-budget <ms>      drop the live frames not written within ms (default: %llu)\n", (unsigned long long)LIVE_DEFAULT_BUDGET_MS);
+  fprintf(stream, "    --batch <jobs>          encode every job of the list (<output> <text> <gif> <png> [font] separated by tabs) in one process\n");
+  fprintf(stream, "    --batch-workers <n>     jobs encoded at the same time (default: a job per core)\n");
+  fprintf(stream, "    --bench <chat.log>      replay the chat log like --live as fast as possible and report the frame times\n");
+  fprintf(stream, "    --preview <file>        quick Y4M preview of the layout, - is stdout, see --preview-*\n");
+  fprintf(stream, "    --preview-scale <n>     preview at 1/n of the resolution (default: %d)\n", PREVIEW_DEFAULT_SCALE);
+  fprintf(stream, "    --preview-stride <n>    preview only every n-th frame (default: %zu)\n", PREVIEW_DEFAULT_STRIDE);
+  fprintf(stream, "    --simd <level>          use SIMD kernels up to scalar, sse2, avx2 or avx512 (default: the best the CPU has)\n");
+  fprintf(stream, "    --list-kernels          print the variant every SIMD kernel uses and exit\n");
+  fprintf(stream, "    --check-kernels         compare every SIMD variant against the scalar one on random inputs and exit\n");
+  fprintf(stream, "    --no-io-uring           write the frames with plain write() even if io_uring is available\n");
+  fprintf(stream, "    --startup-cache <dir>   keep the rasterized glyphs, the shaped texts and the decoded emotes in dir for the next runs\n");
+  fprintf(stream, "    --memory-stats          print the memory of every subsystem and the peak resident set at the end\n");
+  fprintf(stream, "    --memory-limit <MiB>    make the renderers wait while the counted memory is over the limit\n");
+  fprintf(stream, "Encoder options (only with --output):\n");
+  fprintf(stream, "    --codec <name>          libavcodec encoder name (default: mpeg1video)\n");
+  fprintf(stream, "    --preset <name>         encoder preset, e.g. `veryfast` for libx264\n");
+  fprintf(stream, "    --crf <number>          constant rate factor, overrides --bitrate\n");
+  fprintf(stream, "    --bitrate <number>      bits per second (default: 400000)\n");
+  fprintf(stream, "    --gop <number>          distance between intra frames (default: 10)\n");
+  fprintf(stream, "    --b-frames <number>     max amount of B-frames in a row (default: 1)\n");
+  fprintf(stream, "    --pix-fmt <name>        yuv420p, yuv444p or rgba (default: yuv420p)\n");
+  fprintf(stream, "    --encoder-threads <n>   frame/slice threads of the encoder, 0 is auto (default: 0)\n");
+  fprintf(stream, "    --cache <dir>           keep the encoded segments in dir and re-encode only the changed ones\n");
+  fprintf(stream, "    --segment-frames <n>    frames in a cached segment (default: %zu)\n", SEGMENT_CACHE_DEFAULT_FRAMES);
+  fprintf(stream, "    --vfr                   drop unchanged frames instead of repeating them\n");
+}
 
-  /* Add sequence end code to have a real MPEG file.
-    It makes only sense because this tiny examples writes packets
-    directly. This is called "elementary stream" and only works for some
-    codecs. To create a valid file, you usually need to write packets
-    into a proper file format or protocol; see mux.c.
-  */
-  uint8_t endcode[] = {0, 0, 1, 0xb7};
-  if (codec->id == AV_CODEC_ID_MPEG1VIDEO || codec->id == AV_CODEC_ID_MPEG2VIDEO)
-    fwrite(endcode, 1, sizeof(endcode), f);
+// * The values are cast to the types of the options, so [min, max] has to
+// * fit into them
+long long parse_integer(const char *option, const char *arg, long long min, long long max) {
+  char *endptr = nullptr;
+  errno = 0;
+  long long result = strtoll(arg, &endptr, 10);
+  if (*arg == '\0' || *endptr != '\0' || errno == ERANGE || result < min || result > max) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: `%s` is not a valid value for %s, expected %lld..%lld\n", arg, option, min, max);
+    exit(1);
+  }
+  return result;
+}
 
-  return 0;
+// * Fetches the value of the option at argv[*i] and moves *i past it
+const char *option_value(int argc, char *argv[], int *i) {
+  if (*i + 1 >= argc) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: %s expects an argument\n", argv[*i]);
+    exit(1);
+  }
+  *i += 1;
+  return argv[*i];
 }
 
 int main(int argc, char *argv[]) {
-  if(argc < 4) {
-    fprintf(stderr, "Usage: ./vodus <text> <gif_image> <png_image> [font]\n");
+  uint64_t startup_begin = monotonic_ns();
+  const char *positional[4] = {};
+  int positional_count = 0;
+
+  size_t frames_begin = 0;
+  size_t frames_end = VODUS_FRAMES_COUNT;
+  const char *output_filepath = nullptr;
+  const char *archive_filepath = nullptr;
+  const char *cache_dir = nullptr;
+  const char *preview_filepath = nullptr;
+  int preview_scale = PREVIEW_DEFAULT_SCALE;
+  size_t preview_stride = PREVIEW_DEFAULT_STRIDE;
+  size_t segment_frames = SEGMENT_CACHE_DEFAULT_FRAMES;
+  const char *archive_format = nullptr;
+  Encoder_Config encoder_config = default_encoder_config();
+  bool dedup = true;
+  bool use_io_uring = true;
+  size_t bands_count = 1;
+  // * 0 is all the cores that are not rendering
+  size_t output_threads_option = 0;
+  bool pin = false;
+  Simd_Level simd_level = cpu_simd_level();
+  bool list_kernels = false;
+  bool check_kernels = false;
+  bool sdf = false;
+  int text_size = 64;
+  int outline = 0;
+  int shadow = 0;
+  int emote_height = 0;
+  const char *fallback_fonts[FONT_CHAIN_CAPACITY];
+  size_t fallback_fonts_count = 0;
+  bool vfr = false;
+  bool frames_given = false;
+  const char *live_source = nullptr;
+  uint64_t live_budget_ms = LIVE_DEFAULT_BUDGET_MS;
+  const char *bench_filepath = nullptr;
+  const char *batch_filepath = nullptr;
+  size_t batch_workers = 0;
+  bool memory_stats = false;
+  size_t memory_limit_mib = 0;
+  const char *startup_cache_dir = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--frames") == 0) {
+      if (i + 2 >= argc) {
+        usage(stderr);
+        fprintf(stderr, "ERROR: --frames expects two arguments\n");
+        exit(1);
+      }
+      frames_begin = (size_t)parse_integer("--frames", argv[++i], 0, INT_MAX);
+      frames_end = (size_t)parse_integer("--frames", argv[++i], 0, INT_MAX);
+      frames_given = true;
+    } else if (strcmp(argv[i], "--output") == 0) {
+      output_filepath = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--live") == 0) {
+      live_source = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--live-budget") == 0) {
+      live_budget_ms = (uint64_t)parse_integer("--live-budget", option_value(argc, argv, &i), 1, LIVE_MAX_BUDGET_MS);
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch_filepath = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--batch-workers") == 0) {
+      batch_workers = (size_t)parse_integer("--batch-workers", option_value(argc, argv, &i), 1, 4096);
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench_filepath = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--preview") == 0) {
+      preview_filepath = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--preview-scale") == 0) {
+      preview_scale = (int)parse_integer("--preview-scale", option_value(argc, argv, &i), 1, VODUS_HEIGHT / 2);
+    } else if (strcmp(argv[i], "--preview-stride") == 0) {
+      preview_stride = (size_t)parse_integer("--preview-stride", option_value(argc, argv, &i), 1, INT_MAX);
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      cache_dir = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--segment-frames") == 0) {
+      segment_frames = (size_t)parse_integer("--segment-frames", option_value(argc, argv, &i), 1, INT_MAX);
+    } else if (strcmp(argv[i], "--archive") == 0) {
+      archive_filepath = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--archive-format") == 0) {
+      archive_format = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--output-threads") == 0) {
+      output_threads_option = (size_t)parse_integer("--output-threads", option_value(argc, argv, &i), 1, (long long)OUTPUT_THREADS_CAPACITY);
+    } else if (strcmp(argv[i], "--pin") == 0) {
+      pin = true;
+    } else if (strcmp(argv[i], "--simd") == 0) {
+      const char *name = option_value(argc, argv, &i);
+      Simd_Level level;
+      if (!parse_simd_level(name, &level)) {
+        usage(stderr);
+        fprintf(stderr, "ERROR: unknown SIMD level %s\n", name);
+        exit(1);
+      }
+      // * a cap, never above what the CPU can do
+      simd_level = std::min(level, simd_level);
+    } else if (strcmp(argv[i], "--list-kernels") == 0) {
+      list_kernels = true;
+    } else if (strcmp(argv[i], "--check-kernels") == 0) {
+      check_kernels = true;
+    } else if (strcmp(argv[i], "--bands") == 0) {
+      bands_count = (size_t)parse_integer("--bands", option_value(argc, argv, &i), 1, (long long)BANDS_CAPACITY);
+    } else if (strcmp(argv[i], "--font-size") == 0) {
+      text_size = (int)parse_integer("--font-size", option_value(argc, argv, &i), 1, 4096);
+    } else if (strcmp(argv[i], "--outline") == 0) {
+      outline = (int)parse_integer("--outline", option_value(argc, argv, &i), 0, TEXT_EFFECT_MAX_RADIUS);
+    } else if (strcmp(argv[i], "--shadow") == 0) {
+      shadow = (int)parse_integer("--shadow", option_value(argc, argv, &i), 0, TEXT_EFFECT_MAX_RADIUS);
+    } else if (strcmp(argv[i], "--emote-height") == 0) {
+      emote_height = (int)parse_integer("--emote-height", option_value(argc, argv, &i), 1, 4096);
+    } else if (strcmp(argv[i], "--fallback-font") == 0) {
+      if (fallback_fonts_count + 1 >= FONT_CHAIN_CAPACITY) {
+        usage(stderr);
+        fprintf(stderr, "ERROR: at most %zu fallback fonts are supported\n", FONT_CHAIN_CAPACITY - 1);
+        exit(1);
+      }
+      fallback_fonts[fallback_fonts_count++] = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--sdf") == 0) {
+      sdf = true;
+    } else if (strcmp(argv[i], "--no-dedup") == 0) {
+      dedup = false;
+    } else if (strcmp(argv[i], "--no-io-uring") == 0) {
+      use_io_uring = false;
+    } else if (strcmp(argv[i], "--startup-cache") == 0) {
+      startup_cache_dir = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--memory-stats") == 0) {
+      memory_stats = true;
+    } else if (strcmp(argv[i], "--memory-limit") == 0) {
+      memory_limit_mib = (size_t)parse_integer("--memory-limit", option_value(argc, argv, &i), 1, (long long)(SIZE_MAX / (1024 * 1024)));
+    } else if (strcmp(argv[i], "--vfr") == 0) {
+      vfr = true;
+    } else if (strcmp(argv[i], "--codec") == 0) {
+      encoder_config.codec_name = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--preset") == 0) {
+      encoder_config.preset = option_value(argc, argv, &i);
+    } else if (strcmp(argv[i], "--crf") == 0) {
+      encoder_config.crf = (int)parse_integer("--crf", option_value(argc, argv, &i), 0, 63);
+    } else if (strcmp(argv[i], "--bitrate") == 0) {
+      encoder_config.bit_rate = parse_integer("--bitrate", option_value(argc, argv, &i), 1, LLONG_MAX);
+    } else if (strcmp(argv[i], "--gop") == 0) {
+      encoder_config.gop_size = (int)parse_integer("--gop", option_value(argc, argv, &i), 1, INT_MAX);
+    } else if (strcmp(argv[i], "--b-frames") == 0) {
+      encoder_config.max_b_frames = (int)parse_integer("--b-frames", option_value(argc, argv, &i), 0, 16);
+    } else if (strcmp(argv[i], "--pix-fmt") == 0) {
+      const char *name = option_value(argc, argv, &i);
+      encoder_config.pix_fmt = av_get_pix_fmt(name);
+      if (!is_supported_pix_fmt(encoder_config.pix_fmt)) {
+        usage(stderr);
+        fprintf(stderr, "ERROR: unsupported pixel format %s\n", name);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--encoder-threads") == 0) {
+      encoder_config.thread_count = (int)parse_integer("--encoder-threads", option_value(argc, argv, &i), 0, 1024);
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: unknown option %s\n", argv[i]);
+      exit(1);
+    } else if (positional_count < 4) {
+      positional[positional_count++] = argv[i];
+    } else {
+      usage(stderr);
+      fprintf(stderr, "ERROR: too many arguments\n");
+      exit(1);
+    }
+  }
+
+  kernels_select(simd_level);
+  if (list_kernels) {
+    kernels_print(stdout);
+    exit(0);
+  }
+  if (check_kernels) {
+    exit(kernels_check(stdout, simd_level) ? 0 : 1);
+  }
+
+  if (batch_filepath) {
+    if (positional_count > 0) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: --batch takes the inputs from the job list\n");
+      exit(1);
+    }
+    if (output_filepath || archive_filepath || preview_filepath || live_source || bench_filepath || cache_dir) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: --batch encodes every job into its own output and does not go with the other modes\n");
+      exit(1);
+    }
+  } else if(positional_count < 3) {
+    usage(stderr);
     exit(1);
   }
 
-  const char *text = argv[1];
-  const char *gif_filepath = argv[2];
-  const char *png_filepath = argv[3];
+  if ((output_filepath != nullptr) + (archive_filepath != nullptr) + (preview_filepath != nullptr) > 1) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: only one of --output, --archive and --preview can be used\n");
+    exit(1);
+  }
+  if (bench_filepath && (output_filepath || archive_filepath || preview_filepath || live_source)) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: --bench only renders, it does not go with the output options\n");
+    exit(1);
+  }
+  if (live_source && !archive_filepath) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: --live requires --archive, it fills the skipped frames with the previous ones\n");
+    exit(1);
+  }
+  if (sdf && (outline > 0 || shadow > 0)) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: --outline and --shadow are made from the glyph cache and do not work with --sdf\n");
+    exit(1);
+  }
+  if (sdf && fallback_fonts_count > 0) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: --sdf draws only the main font, --fallback-font does not work with it\n");
+    exit(1);
+  }
+  if (sdf && positional_count > 0 && !sdf_text_supported(positional[0])) {
+    usage(stderr);
+    fprintf(stderr, "ERROR: --sdf only has the printable ASCII characters, the text has others\n");
+    exit(1);
+  }
+  if (cache_dir) {
+    const char *extension = output_filepath ? strrchr(output_filepath, '.') : nullptr;
+    if (extension == nullptr || strcmp(extension, ".ts") != 0) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: --cache requires --output with a .ts file, the segments are concatenated byte by byte\n");
+      exit(1);
+    }
+  }
+  if (archive_format) {
+    if (!archive_filepath) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: --archive-format requires --archive\n");
+      exit(1);
+    }
+    if (!parse_archive_format(archive_format, &frame_format)) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: unknown archive format %s\n", archive_format);
+      exit(1);
+    }
+  }
+
+  if (live_source || bench_filepath) {
+    // * the chat decides how long it is, --frames only limits it
+    if (!frames_given) {
+      frames_begin = 0;
+      frames_end = 0;
+    } else if (frames_begin != 0) {
+      usage(stderr);
+      fprintf(stderr, "ERROR: --live and --bench always start at the frame 0\n");
+      exit(1);
+    }
+  } else if (frames_end > VODUS_FRAMES_COUNT) {
+    frames_end = VODUS_FRAMES_COUNT;
+  }
+  if (frames_begin >= frames_end && !((live_source || bench_filepath) && !frames_given)) {
+    fprintf(stderr, "ERROR: empty frame range [%zu, %zu)\n", frames_begin, frames_end);
+    exit(1);
+  }
+
+  // * before anything is allocated or any thread is started
+  memory_accounting_init(memory_limit_mib * 1024 * 1024, memory_stats);
+
+  if (batch_filepath) {
+    Batch_Config config = {};
+    if (FT_Init_FreeType(&config.library)) {
+      fprintf(stderr, "Could not initialize FreeType2\n");
+      exit(1);
+    }
+    config.fallback_fonts = fallback_fonts;
+    config.fallback_fonts_count = fallback_fonts_count;
+    config.text_size = text_size;
+    config.sdf = sdf;
+    config.effects = default_text_effects(outline, shadow);
+    config.emote_height = emote_height;
+    config.encoder_config = encoder_config;
+    config.frames_begin = frames_begin;
+    config.frames_end = frames_end;
+    config.dedup = dedup;
+    config.vfr = vfr;
+    config.workers = batch_workers;
+    config.startup_cache_dir = startup_cache_dir;
+    run_batch(&config, batch_filepath);
+
+    if (memory_stats) {
+      memory_report(stdout);
+    }
+    return 0;
+  }
+
+  FILE *preview_stream = nullptr;
+  if (preview_filepath) {
+    preview_stream = open_preview_stream(preview_filepath);
+    // * everything is drawn at the preview resolution right away
+    text_size = std::max(text_size / preview_scale, 1);
+    if (outline > 0) outline = std::max(outline / preview_scale, 1);
+    if (shadow > 0) shadow = std::max(shadow / preview_scale, 1);
+    if (emote_height > 0) emote_height = std::max(emote_height / preview_scale, 1);
+  }
+
+  const char *text = positional[0];
+  const char *gif_filepath = positional[1];
+  const char *png_filepath = positional[2];
   const char *font_face_file_path = FACE_FILE_PATH;
-  if (argc >= 5) {
-    font_face_file_path = argv[4];
+  if (positional_count >= 4) {
+    font_face_file_path = positional[3];
   }
 
   // * Freetype library initialization
   FT_Library  library;   /* handle to library     */
-  FT_Face     face;      /* handle to face object */
   auto error = FT_Init_FreeType(&library);
-  error = FT_New_Face(library, font_face_file_path, 0, &face);
   if(error) {
     fprintf(stderr, "Could not initialize FreeType2\n");
     exit(1);
   }
 
-  if (error == FT_Err_Unknown_File_Format) {
-    fprintf(stderr, "the %s could be opened and read, but it appears that its font format is unsupported\n", font_face_file_path);
-    exit(1);
+  // * the faces are opened when they are needed, see Font_Chain
+  Font_Chain fonts = {};
+  font_chain_push(&fonts, library, font_face_file_path);
+  for (size_t i = 0; i < fallback_fonts_count; ++i) {
+    font_chain_push(&fonts, library, fallback_fonts[i]);
   }
-  else if (error) {
-    fprintf(stderr, "the %s could be opened and read.\n", font_face_file_path);
-  }
-  printf("Loaded %s\n", font_face_file_path);
-  // printf("\tnum_glyphs = %ld\n", face->num_glyphs);
-
-  error = FT_Set_Pixel_Sizes(
-      face, /* handle to face object */
-      0,    /* pixel_width           */
-      64);  /* pixel_height          */
+  font_chain_set_pixel_size(&fonts, text_size);
 
-  if (error) {
-    fprintf(stderr, "could not set font size in pixels\n");
-    exit(1);
+  Sdf_Atlas sdf_atlas = {};
+  if (sdf) {
+    sdf_atlas_generate(&sdf_atlas, font_chain_face(&fonts, 0));
+    // * the atlas is generated at its own size
+    font_chain_set_pixel_size(&fonts, text_size);
   }
 
   // * Read gif file
@@ -566,69 +1893,181 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "could not read gif file: %s\n", gif_filepath);
   }
   DGifSlurp(gif_file);
-
-  float text_x = 0.0f;
-  float text_y = VODUS_HEIGHT;
-
-  const size_t VODUS_FPS = 100;
-  const float VODUS_DELTA_TIME = (1.0f / VODUS_FPS);
-  const float VODUS_DURATION = 10.0f;
-
-  // const float GIF_DURATION = 2.0f;
-  // float gif_dt = GIF_DURATION / gif_file->ImageCount;
-  // float t = 0.0f;
-
-  // * Loads the png file into Image32 structure
-  Image32 image32_png = load_image32_from_png(png_filepath);
-
-  // * Initialize queue_mutex
-  pthread_mutex_init(&queue_mutex, nullptr);
-
-  // * Initialze the threads with routine
-  for(int i = 0; i < VODUS_OUTPUT_THREADS_COUNT; ++i) {
-    pthread_create(&output_threads[i], nullptr, output_thread_routine, nullptr);
+  memory_track_alloc(MEMORY_GIF, gif_bytes(gif_file));
+
+  Renderer renderer = {};
+  Glyph_Cache glyphs = {};
+  glyphs.fonts = fonts;
+  Glyph_Atlas atlas = {};
+  if (startup_cache_dir && !sdf) {
+    atlas = glyph_atlas_load(&glyphs, startup_cache_dir);
+  }
+  Effect_Cache effects = {};
+  effects.effects = default_text_effects(outline, shadow);
+  Emote_Cache emotes = {};
+  renderer.glyphs = &glyphs;
+  renderer.effects = &effects;
+  renderer.emotes = &emotes;
+  renderer.sdf = sdf ? &sdf_atlas : nullptr;
+  renderer.text_size = text_size;
+  renderer.text = text;
+  renderer.gif_file = gif_file;
+  // * Loads the png file into Image32 structure, the preview scales it
+  // * down on its own so it does not go through the startup cache
+  renderer.png = load_emote_cached(preview_filepath ? nullptr : startup_cache_dir, png_filepath);
+  renderer.emote_height = emote_height;
+  renderer.emote_code = emote_code_of(png_filepath);
+  renderer.scale = 1;
+  if (preview_filepath) {
+    Image32 png = renderer.png;
+    renderer.png = image32_downscale(png, preview_scale);
+    free(png.pixels);
+    memory_track_free(MEMORY_EMOTES, sizeof(Pixels32) * (size_t)png.width * (size_t)png.height);
+    memory_track_alloc(MEMORY_EMOTES, sizeof(Pixels32) * (size_t)renderer.png.width * (size_t)renderer.png.height);
+    renderer.scale = preview_scale;
+    renderer.draft = true;
+  }
+  if (startup_cache_dir) {
+    if (!preview_filepath) {
+      load_scaled_emote_cached(startup_cache_dir, &emotes, &renderer.png, png_filepath, emote_height);
+    }
+    renderer_load_text(&renderer, text);
+    if (!sdf) {
+      shape_cache_keep(&glyphs.shapes, &glyphs.fonts, text);
+    }
+    printf("Started in %.3fs: %zu glyphs and %zu texts from %s\n",
+           (double)(monotonic_ns() - startup_begin) / 1e9, atlas.glyphs_count, atlas.texts_count, startup_cache_dir);
   }
 
-  while (text_y > 0.0f) {
-    // * Allocate the frame
-    Image32 surface = {
-        surface.height = VODUS_HEIGHT,
-        surface.width = VODUS_WIDTH,
-        surface.pixels = (Pixels32 *)malloc(sizeof(Pixels32) * VODUS_WIDTH * VODUS_HEIGHT)};
-
-    assert(surface.pixels);
-
-    // * Clean up the surface
-    fill_image32_with_color(surface, {50, 50, 50, 255});
-
-    // * Slap the text onto image32
-    Pixels32 color = {255, 0, 0, 255};
-    slap_text_onto_image32(surface, face, text, color, (int)text_x, (int)text_y);
+  // * The chat modes draw the gif as an animated emote
+  Gif_Timeline gif_timeline = {};
+  if (live_source || bench_filepath) {
+    gif_timeline = gif_timeline_build(gif_file, emote_height);
+    renderer.gif = &gif_timeline;
+    renderer.gif_code = emote_code_of(gif_filepath);
+    printf("Loaded %s: %zu frames in a %.2fs loop\n", gif_filepath, gif_timeline.count,
+           (double)gif_timeline.duration_ms / 1000.0);
+  }
 
-    // int gif_index = ((int)(t / gif_dt) % gif_file->ImageCount);
-    // assert(gif_file->ImageCount > 0);
-    // slap_onto_image32(surface,
-    //                   &gif_file->SavedImages[gif_index],
-    //                   gif_file->SColorMap,
-    //                   (int)text_x, (int)text_y);
+  // * Only the PNG and archive frames are compressed next to the rendering
+  bool png_pipeline = !preview_filepath && !output_filepath && !bench_filepath;
+  size_t output_threads_count = 0;
+  if (png_pipeline) {
+    size_t cores = hardware_threads();
+    output_threads_count = output_threads_option > 0
+      ? output_threads_option
+      : (cores > bands_count ? cores - bands_count : 1);
+    output_threads_count = std::min(output_threads_count, OUTPUT_THREADS_CAPACITY);
+  }
 
-    // * Slap png image onto surface
-    slap_onto_image32(surface, &image32_png, (int)text_x, (int)text_y);
+  // * The offline PNG frames are rendered whole by the render stages of the
+  // * pipeline, the other modes split every frame into the bands
+  bool offline_pipeline = png_pipeline && !live_source;
+  Band_Pool bands;
+  band_pool_init(&bands, offline_pipeline ? 1 : bands_count);
+  defer(band_pool_destroy(&bands));
+  renderer.bands = &bands;
+  if (pin && !offline_pipeline) {
+    pin_bands(&bands);
+  }
 
-    while (!enqueue(surface)) {}
+  if (bench_filepath) {
+    run_bench(&renderer, bench_filepath, frames_end);
+  } else if (preview_filepath) {
+    size_t rendered_count = render_preview(&renderer, preview_stream, preview_filepath,
+                                           frames_begin, frames_end, preview_stride);
+    fclose(preview_stream);
+    printf("Previewed every %zu frame of [%zu, %zu) at 1/%d resolution into %s, %zu of them rendered\n",
+           preview_stride, frames_begin, frames_end, preview_scale, preview_filepath, rendered_count);
+  } else if (output_filepath) {
+    if (cache_dir) {
+      Segment_Cache cache = {};
+      cache.dir = cache_dir;
+      cache.segment_frames = segment_frames;
+
+      uint64_t hash = fnv1a_value(FNV1A_OFFSET_BASIS, SEGMENT_CACHE_VERSION);
+      hash = fnv1a_value(hash, (uint64_t)VODUS_WIDTH);
+      hash = fnv1a_value(hash, (uint64_t)VODUS_HEIGHT);
+      hash = fnv1a_value(hash, (uint64_t)VODUS_FPS);
+      hash = fnv1a_string(hash, text);
+      hash = fnv1a_value(hash, text_size);
+      hash = fnv1a_value(hash, sdf);
+      hash = fnv1a_value(hash, outline);
+      hash = fnv1a_value(hash, shadow);
+      hash = fnv1a_value(hash, emote_height);
+      hash = fnv1a_value(hash, dedup);
+      hash = fnv1a_value(hash, vfr);
+      hash = fnv1a_file(hash, gif_filepath);
+      hash = fnv1a_file(hash, png_filepath);
+      hash = fnv1a_file(hash, font_face_file_path);
+      for (size_t i = 0; i < fallback_fonts_count; ++i) {
+        hash = fnv1a_file(hash, fallback_fonts[i]);
+      }
+      cache.inputs_hash = hash_encoder_config(hash, &encoder_config);
+
+      encode_frames_with_cache(&cache, &renderer, &encoder_config, output_filepath,
+                               frames_begin, frames_end, dedup, vfr);
+    } else {
+      // * Segment mode: frames are encoded in order on this thread
+      size_t rendered_count = encode_frames(&renderer, &encoder_config, output_filepath,
+                                            frames_begin, frames_end, dedup, vfr);
+      printf("Encoded frames [%zu, %zu) into %s, %zu of them rendered\n",
+             frames_begin, frames_end, output_filepath, rendered_count);
+    }
+  } else {
+    Archive_Writer archive = {};
+    if (archive_filepath) {
+      archive_writer_open(&archive, archive_filepath, frame_format,
+                          VODUS_WIDTH, VODUS_HEIGHT, (int)VODUS_FPS, frames_begin, frames_end);
+    }
+    frame_writer_start(&frame_writer, use_io_uring, archive_filepath ? &archive : nullptr);
+
+    bool interrupted = false;
+    Scheduler *scheduler = new Scheduler();
+    if (live_source) {
+      // * the main thread renders with the band pool, the other workers
+      // * only compress and take the CPUs after the bands
+      scheduler_start(scheduler, 1 + output_threads_count, false);
+      if (pin) {
+        for (size_t i = 1; i < scheduler->workers_count; ++i) {
+          pin_thread_to_cpu(scheduler->threads[i], bands.count - 1 + i);
+        }
+      }
+      frames_end = run_live(scheduler, &renderer, live_source, frames_end, live_budget_ms * 1000000ULL,
+                            output_threads_count);
+      scheduler_finish(scheduler);
+    } else {
+      // * every render stage renders whole frames, so --bands is their amount
+      scheduler_start(scheduler, std::min(bands_count + output_threads_count, SCHEDULER_WORKERS_CAPACITY), pin);
+      size_t rendered_count = render_frames_pipeline(scheduler, &renderer, frames_begin, frames_end,
+                                                     bands_count, output_threads_count, dedup, &interrupted);
+      scheduler_finish(scheduler);
+      printf("Rendered %zu frames of [%zu, %zu)%s\n", rendered_count, frames_begin, frames_end,
+             interrupted ? ", interrupted" : "");
+    }
+    delete scheduler;
 
-    // * get text_y position 
-    // TODO Understand this calculation
-    text_y -= (VODUS_HEIGHT / VODUS_DURATION) * VODUS_DELTA_TIME;
+    printf("Finished rendering waiting for the frame writer.\n");
+    frame_writer_finish(&frame_writer);
 
-    // t += VODUS_DELTA_TIME;
+    if (archive_filepath) {
+      // * the live frames after the last change were never appended
+      if (live_source && frames_end > 0) {
+        archive_writer_reserve(&archive, frames_end - 1);
+      }
+      // * the skipped duplicates get the entry of the previous frame
+      archive_writer_close(&archive);
+      printf("Archived frames [%zu, %zu) into %s\n", frames_begin, frames_end, archive_filepath);
+    } else if (dedup && !interrupted) {
+      link_duplicate_frames(frames_begin, frames_end);
+    }
   }
-  
-  stop_output_threads.store(true);
-  printf("Finished rendering waiting for the output thread.\n");
 
-  for (int i = 0; i < VODUS_OUTPUT_THREADS_COUNT; ++i) {
-    pthread_join(output_threads[i], nullptr);
+  if (startup_cache_dir && !sdf) {
+    glyph_atlas_save(&glyphs, &atlas, startup_cache_dir);
+  }
+  if (memory_stats) {
+    memory_report(stdout);
   }
 
   DGifCloseFile(gif_file, &error);
@@ -636,4 +2075,5 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-// * https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/encode_video.c
\ No newline at end of file
+// * https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/encode_video.c
+// * https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/mux.c
@@ -0,0 +1,157 @@
+// * ###################################################################
+// * Animated emotes
+// * ###################################################################
+
+// * A GIF is decoded into whole frames once, together with the moments
+// * they change: ends_ms is the prefix sum of the delays of the Graphics
+// * Control Extensions, so the frame shown at any time is one binary search
+// * away instead of assuming the frames are evenly spaced.
+// *
+// * The renderer resolves the current frame of the animated emote once per
+// * output frame (Animation_Phase) and every instance of the emote on that
+// * frame slaps the same image.
+
+// * Browsers show the delays under 20ms as 100ms and the GIFs are made
+// * for the browsers
+constexpr int GIF_MIN_DELAY_CS = 2;
+constexpr int GIF_DEFAULT_DELAY_CS = 10;
+
+struct Gif_Timeline {
+  size_t count;
+  // * frame i is shown during [ends_ms[i - 1], ends_ms[i]) of every loop
+  uint64_t *ends_ms;
+  uint64_t duration_ms;
+  // * composited onto the logical screen and scaled to the emote height,
+  // * image32_resample premultiplies, so the transparent pixels of the
+  // * canvas do not leave a dark fringe around the scaled frames
+  Image32 *frames;
+};
+
+// * Draws the image of the GIF onto the canvas, the transparent color
+// * keeps what the previous frames left there
+void gif_composite(Pixels32 *canvas, int width, int height, const SavedImage *image,
+                   const ColorMapObject *map, int transparent) {
+  const GifImageDesc *desc = &image->ImageDesc;
+  Pixels32 palette[256] = {};
+  for (int i = 0; i < std::min(map->ColorCount, 256); ++i) {
+    palette[i] = {map->Colors[i].Red, map->Colors[i].Green, map->Colors[i].Blue, 255};
+  }
+
+  int row_end = std::min(desc->Height, height - desc->Top);
+  int col_end = std::min(desc->Width, width - desc->Left);
+  for (int row = std::max(0, -desc->Top); row < row_end; ++row) {
+    const GifByteType *indices = image->RasterBits + row * desc->Width;
+    Pixels32 *dst = canvas + (row + desc->Top) * width + desc->Left;
+    for (int col = std::max(0, -desc->Left); col < col_end; ++col) {
+      if (indices[col] != transparent) {
+        dst[col] = palette[indices[col]];
+      }
+    }
+  }
+}
+
+void gif_clear_rect(Pixels32 *canvas, int width, int height, const GifImageDesc *desc) {
+  int row_end = std::min(desc->Top + desc->Height, height);
+  int col_begin = std::max(desc->Left, 0);
+  int col_end = std::min(desc->Left + desc->Width, width);
+  for (int row = std::max(desc->Top, 0); row < row_end; ++row) {
+    if (col_end > col_begin) {
+      memset(canvas + row * width + col_begin, 0, sizeof(Pixels32) * (size_t)(col_end - col_begin));
+    }
+  }
+}
+
+// * height <= 0 keeps the size of the logical screen
+Gif_Timeline gif_timeline_build(GifFileType *gif, int height) {
+  if (gif == nullptr || gif->ImageCount <= 0) {
+    fprintf(stderr, "ERROR: the gif has no frames\n");
+    exit(1);
+  }
+
+  // * some encoders leave the logical screen empty
+  int width = gif->SWidth;
+  int screen_height = gif->SHeight;
+  if (width <= 0 || screen_height <= 0) {
+    for (int i = 0; i < gif->ImageCount; ++i) {
+      const GifImageDesc *desc = &gif->SavedImages[i].ImageDesc;
+      width = std::max(width, desc->Left + desc->Width);
+      screen_height = std::max(screen_height, desc->Top + desc->Height);
+    }
+  }
+
+  Gif_Timeline timeline = {};
+  timeline.count = (size_t)gif->ImageCount;
+  timeline.ends_ms = (uint64_t *)malloc(sizeof(uint64_t) * timeline.count);
+  timeline.frames = (Image32 *)malloc(sizeof(Image32) * timeline.count);
+  Pixels32 *canvas = (Pixels32 *)calloc((size_t)width * (size_t)screen_height, sizeof(Pixels32));
+  Pixels32 *previous = (Pixels32 *)malloc(sizeof(Pixels32) * (size_t)width * (size_t)screen_height);
+  assert(timeline.ends_ms && timeline.frames && canvas && previous);
+  defer(free(canvas));
+  defer(free(previous));
+  size_t canvas_size = sizeof(Pixels32) * (size_t)width * (size_t)screen_height;
+
+  for (size_t i = 0; i < timeline.count; ++i) {
+    const SavedImage *image = &gif->SavedImages[i];
+    const ColorMapObject *map = image->ImageDesc.ColorMap ? image->ImageDesc.ColorMap : gif->SColorMap;
+    if (map == nullptr) {
+      fprintf(stderr, "ERROR: the frame %zu of the gif has no color map\n", i);
+      exit(1);
+    }
+
+    // * the frames without the extension are shown until the next one
+    // * with the default delay
+    GraphicsControlBlock gcb = {DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR};
+    DGifSavedExtensionToGCB(gif, (int)i, &gcb);
+
+    if (gcb.DisposalMode == DISPOSE_PREVIOUS) {
+      memcpy(previous, canvas, canvas_size);
+    }
+    gif_composite(canvas, width, screen_height, image, map, gcb.TransparentColor);
+
+    Image32 frame = {screen_height, width, (Pixels32 *)malloc(canvas_size), width};
+    assert(frame.pixels);
+    memcpy(frame.pixels, canvas, canvas_size);
+    if (height > 0 && height != screen_height) {
+      Image32 scaled = image32_resample(frame, emote_scaled_width(&frame, height), height);
+      free(frame.pixels);
+      frame = scaled;
+    }
+    timeline.frames[i] = frame;
+    memory_track_alloc(MEMORY_GIF, sizeof(Pixels32) * (size_t)frame.width * (size_t)frame.height);
+
+    if (gcb.DisposalMode == DISPOSE_BACKGROUND) {
+      gif_clear_rect(canvas, width, screen_height, &image->ImageDesc);
+    } else if (gcb.DisposalMode == DISPOSE_PREVIOUS) {
+      memcpy(canvas, previous, canvas_size);
+    }
+
+    int delay = gcb.DelayTime < GIF_MIN_DELAY_CS ? GIF_DEFAULT_DELAY_CS : gcb.DelayTime;
+    timeline.duration_ms += (uint64_t)delay * 10;
+    timeline.ends_ms[i] = timeline.duration_ms;
+  }
+  memory_track_alloc(MEMORY_GIF, (sizeof(uint64_t) + sizeof(Image32)) * timeline.count);
+
+  return timeline;
+}
+
+// * The frame shown at the time since the start of the animation
+size_t gif_timeline_index(const Gif_Timeline *timeline, uint64_t time_ms) {
+  uint64_t t = time_ms % timeline->duration_ms;
+  return (size_t)(std::upper_bound(timeline->ends_ms, timeline->ends_ms + timeline->count, t) - timeline->ends_ms);
+}
+
+// * The images of the animated emotes at one moment
+struct Animation_Phase {
+  // * nullptr when there is no animated emote
+  Image32 *gif;
+  size_t gif_index;
+};
+
+Animation_Phase animation_phase_at(Gif_Timeline *timeline, uint64_t time_ms) {
+  Animation_Phase phase = {};
+  if (timeline) {
+    phase.gif_index = gif_timeline_index(timeline, time_ms);
+    phase.gif = &timeline->frames[phase.gif_index];
+  }
+  return phase;
+}
@@ -0,0 +1,295 @@
+// * ###################################################################
+// * Frame archive
+// * ###################################################################
+
+// * All the frames of a render in one file instead of one file per frame.
+// * The frames are appended in the order they are finished and the index
+// * at the end of the file maps every frame to its bytes, so a reader
+// * mmaps the file and gets to any frame in O(1).
+// *
+// *   Archive_Header
+// *   frame bytes...            (PNG, QOI or raw RGBA, see Archive_Format)
+// *   Archive_Entry[frames_count]
+// *   Archive_Footer
+// *
+// * Duplicate frames share the entry of the frame they repeat, so they
+// * cost 16 bytes of the index. Everything is in the byte order of the
+// * machine that wrote the archive.
+// *
+// * Used by vodus itself and by the vodus-archive tool (archive.cpp), so it
+// * does not depend on anything else of vodus.
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+constexpr char ARCHIVE_MAGIC[8] = {'V', 'O', 'D', 'U', 'S', 'A', 'R', 'C'};
+constexpr uint32_t ARCHIVE_VERSION = 1;
+
+enum Archive_Format : uint32_t {
+  ARCHIVE_FORMAT_PNG = 0,
+  ARCHIVE_FORMAT_QOI,
+  // * width * height RGBA pixels without any header
+  ARCHIVE_FORMAT_RAW,
+  COUNT_ARCHIVE_FORMATS,
+};
+
+const char *archive_format_names[COUNT_ARCHIVE_FORMATS] = {"png", "qoi", "raw"};
+
+struct Archive_Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t format;
+  uint32_t width, height;
+  uint32_t fps;
+  uint32_t reserved;
+};
+
+struct Archive_Entry {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct Archive_Footer {
+  uint64_t index_offset;
+  uint64_t frames_begin;
+  uint64_t frames_count;
+  char magic[8];
+};
+
+static_assert(sizeof(Archive_Header) == 32, "the header is part of the file format");
+static_assert(sizeof(Archive_Entry) == 16, "the index is part of the file format");
+static_assert(sizeof(Archive_Footer) == 32, "the footer is part of the file format");
+
+bool parse_archive_format(const char *name, Archive_Format *format) {
+  for (uint32_t i = 0; i < COUNT_ARCHIVE_FORMATS; ++i) {
+    if (strcmp(name, archive_format_names[i]) == 0) {
+      *format = (Archive_Format)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// * Writes all of the iovecs, continuing after short writes
+void write_all_iov(int fd, struct iovec *iov, int iov_count, const char *file_path) {
+  while (iov_count > 0) {
+    ssize_t n = writev(fd, iov, iov_count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "could not write %s: %s\n", file_path, strerror(errno));
+      exit(1);
+    }
+
+    size_t written = (size_t)n;
+    while (iov_count > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov += 1;
+      iov_count -= 1;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+struct Archive_Writer {
+  const char *file_path;
+  int fd;
+  uint64_t offset;
+
+  uint64_t frames_begin;
+  uint64_t frames_count;
+  // * size == 0 until the frame is appended
+  Archive_Entry *entries;
+  uint64_t entries_capacity;
+};
+
+void archive_writer_open(Archive_Writer *writer, const char *file_path, Archive_Format format,
+                         int width, int height, int fps, size_t frames_begin, size_t frames_end) {
+  memset(writer, 0, sizeof(*writer));
+  writer->file_path = file_path;
+  writer->fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+
+  writer->frames_begin = frames_begin;
+  writer->frames_count = frames_end - frames_begin;
+  writer->entries_capacity = writer->frames_count > 256 ? writer->frames_count : 256;
+  writer->entries = (Archive_Entry *)calloc(writer->entries_capacity, sizeof(Archive_Entry));
+  assert(writer->entries);
+
+  Archive_Header header = {};
+  memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+  header.version = ARCHIVE_VERSION;
+  header.format = format;
+  header.width = (uint32_t)width;
+  header.height = (uint32_t)height;
+  header.fps = (uint32_t)fps;
+
+  struct iovec iov = {&header, sizeof(header)};
+  write_all_iov(writer->fd, &iov, 1, file_path);
+  writer->offset = sizeof(header);
+}
+
+constexpr int ARCHIVE_BATCH_CAPACITY = 64;
+
+// * The range grows when a frame past its end is appended, for the renders
+// * that do not know their length up front (live mode)
+void archive_writer_reserve(Archive_Writer *writer, uint64_t frame) {
+  if (frame < writer->frames_count) return;
+
+  if (frame >= writer->entries_capacity) {
+    uint64_t capacity = writer->entries_capacity;
+    while (capacity <= frame) capacity *= 2;
+    writer->entries = (Archive_Entry *)realloc(writer->entries, sizeof(Archive_Entry) * capacity);
+    assert(writer->entries);
+    memset(writer->entries + writer->entries_capacity, 0,
+           sizeof(Archive_Entry) * (capacity - writer->entries_capacity));
+    writer->entries_capacity = capacity;
+  }
+  writer->frames_count = frame + 1;
+}
+
+// * Appends the frames with one writev
+void archive_writer_append(Archive_Writer *writer, const size_t *indices,
+                           uint8_t *const *data, const size_t *sizes, size_t count) {
+  struct iovec iov[ARCHIVE_BATCH_CAPACITY];
+
+  for (size_t begin = 0; begin < count; begin += ARCHIVE_BATCH_CAPACITY) {
+    int iov_count = 0;
+    for (size_t i = begin; i < count && iov_count < ARCHIVE_BATCH_CAPACITY; ++i) {
+      assert(indices[i] >= writer->frames_begin);
+      archive_writer_reserve(writer, indices[i] - writer->frames_begin);
+      writer->entries[indices[i] - writer->frames_begin] = {writer->offset, sizes[i]};
+      writer->offset += sizes[i];
+      iov[iov_count++] = {data[i], sizes[i]};
+    }
+    write_all_iov(writer->fd, iov, iov_count, writer->file_path);
+  }
+}
+
+// * The frames that were never appended repeat the previous frame,
+// * the ones before the first appended frame repeat that one
+void archive_writer_close(Archive_Writer *writer) {
+  uint64_t first = 0;
+  while (first < writer->frames_count && writer->entries[first].size == 0) first += 1;
+  for (uint64_t i = 0; i < first && first < writer->frames_count; ++i) {
+    writer->entries[i] = writer->entries[first];
+  }
+
+  for (uint64_t i = 1; i < writer->frames_count; ++i) {
+    if (writer->entries[i].size == 0) {
+      writer->entries[i] = writer->entries[i - 1];
+    }
+  }
+
+  Archive_Footer footer = {};
+  footer.index_offset = writer->offset;
+  footer.frames_begin = writer->frames_begin;
+  footer.frames_count = writer->frames_count;
+  memcpy(footer.magic, ARCHIVE_MAGIC, sizeof(footer.magic));
+
+  struct iovec iov[2] = {
+    {writer->entries, sizeof(Archive_Entry) * writer->frames_count},
+    {&footer, sizeof(footer)},
+  };
+  write_all_iov(writer->fd, iov, 2, writer->file_path);
+
+  close(writer->fd);
+  free(writer->entries);
+  writer->fd = -1;
+  writer->entries = nullptr;
+}
+
+struct Archive {
+  const uint8_t *data;
+  size_t size;
+  const Archive_Header *header;
+  const Archive_Footer *footer;
+  const Archive_Entry *entries;
+};
+
+// * Maps the whole file, the frames are read straight from the mapping
+void archive_open(Archive *archive, const char *file_path) {
+  memset(archive, 0, sizeof(*archive));
+
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "could not stat %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  archive->size = (size_t)st.st_size;
+
+  if (archive->size < sizeof(Archive_Header) + sizeof(Archive_Footer)) {
+    fprintf(stderr, "%s is not a vodus archive\n", file_path);
+    exit(1);
+  }
+
+  void *data = mmap(nullptr, archive->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "could not mmap %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  archive->data = (const uint8_t *)data;
+
+  archive->header = (const Archive_Header *)archive->data;
+  archive->footer = (const Archive_Footer *)(archive->data + archive->size - sizeof(Archive_Footer));
+  if (memcmp(archive->header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0
+      || memcmp(archive->footer->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+    fprintf(stderr, "%s is not a vodus archive or was not finished\n", file_path);
+    exit(1);
+  }
+  if (archive->header->version != ARCHIVE_VERSION) {
+    fprintf(stderr, "%s has unsupported version %u\n", file_path, archive->header->version);
+    exit(1);
+  }
+  if (archive->header->format >= COUNT_ARCHIVE_FORMATS) {
+    fprintf(stderr, "%s has unknown frame format %u\n", file_path, archive->header->format);
+    exit(1);
+  }
+
+  // * the sum can not overflow once both parts are known to fit into the file
+  if (archive->footer->frames_count > archive->size / sizeof(Archive_Entry)
+      || archive->footer->index_offset > archive->size
+      || archive->footer->index_offset + archive->footer->frames_count * sizeof(Archive_Entry)
+         + sizeof(Archive_Footer) != archive->size) {
+    fprintf(stderr, "%s has a corrupted index\n", file_path);
+    exit(1);
+  }
+  archive->entries = (const Archive_Entry *)(archive->data + archive->footer->index_offset);
+}
+
+void archive_close(Archive *archive) {
+  munmap((void *)archive->data, archive->size);
+  memset(archive, 0, sizeof(*archive));
+}
+
+// * Returns nullptr if the frame is not in the archive
+const uint8_t *archive_frame(const Archive *archive, uint64_t index, size_t *size) {
+  if (index < archive->footer->frames_begin
+      || index - archive->footer->frames_begin >= archive->footer->frames_count) {
+    return nullptr;
+  }
+
+  const Archive_Entry *entry = &archive->entries[index - archive->footer->frames_begin];
+  if (entry->size == 0 || entry->offset > archive->footer->index_offset
+      || entry->size > archive->footer->index_offset - entry->offset) {
+    return nullptr;
+  }
+
+  *size = (size_t)entry->size;
+  return archive->data + entry->offset;
+}
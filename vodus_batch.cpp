@@ -0,0 +1,332 @@
+// * ###################################################################
+// * Batch mode
+// * ###################################################################
+
+// * Renders a list of jobs in one process. Every job is an ordinary
+// * --output render, but the inputs are loaded only once for all the jobs:
+// * a font (with its glyph, shape and effect caches) per font file, a gif
+// * per gif file, a png per png file and one emote cache for all of them.
+// *
+// * All the texts and the emotes of all the jobs are loaded upfront, after
+// * that the caches are only read, so the jobs are rendered on a pool of
+// * workers without any locking. Every worker takes the next job from the
+// * list until there are none left.
+// *
+// * The job list has one job per line, the fields are separated by tabs
+// * because the text may have spaces:
+// *
+// *   # comment
+// *   <output>\t<text>\t<gif_image>\t<png_image>[\t<font>]
+
+constexpr size_t BATCH_FIELDS_CAPACITY = 5;
+
+struct Batch_Font {
+  const char *path;
+  Glyph_Cache glyphs;
+  Effect_Cache effects;
+  Sdf_Atlas sdf;
+  Glyph_Atlas atlas;
+};
+
+struct Batch_Gif {
+  const char *path;
+  GifFileType *gif;
+};
+
+struct Batch_Png {
+  const char *path;
+  Image32 image;
+};
+
+struct Batch_Job {
+  const char *output;
+  const char *text;
+  Renderer renderer;
+
+  size_t rendered;
+  uint64_t ns;
+};
+
+struct Batch_Config {
+  FT_Library library;
+  // * added to the chain of every font
+  const char **fallback_fonts;
+  size_t fallback_fonts_count;
+  int text_size;
+  bool sdf;
+  Text_Effects effects;
+  int emote_height;
+
+  Encoder_Config encoder_config;
+  size_t frames_begin, frames_end;
+  bool dedup, vfr;
+  // * 0 is a worker per core
+  size_t workers;
+  // * nullptr is no startup cache
+  const char *startup_cache_dir;
+};
+
+struct Batch {
+  const Batch_Config *config;
+
+  // * the job list itself, the fields point into it
+  char *data;
+
+  Batch_Job *jobs;
+  size_t jobs_count;
+
+  // * few and looked up only while loading, so plain arrays
+  Batch_Font *fonts;
+  size_t fonts_count;
+  Batch_Gif *gifs;
+  size_t gifs_count;
+  Batch_Png *pngs;
+  size_t pngs_count;
+  Emote_Cache emotes;
+
+  std::atomic<size_t> next_job;
+};
+
+// * Splits the line in place, returns the amount of the fields
+size_t split_tabs(char *line, char **fields, size_t capacity) {
+  size_t count = 0;
+  while (count < capacity) {
+    fields[count++] = line;
+    char *tab = strchr(line, '\t');
+    if (tab == nullptr) break;
+    *tab = '\0';
+    line = tab + 1;
+  }
+  return count;
+}
+
+Batch_Font *batch_font(Batch *batch, const char *path) {
+  for (size_t i = 0; i < batch->fonts_count; ++i) {
+    if (strcmp(batch->fonts[i].path, path) == 0) return &batch->fonts[i];
+  }
+
+  const Batch_Config *config = batch->config;
+  Batch_Font *font = &batch->fonts[batch->fonts_count++];
+  memset(font, 0, sizeof(*font));
+  font->path = path;
+
+  Font_Chain *fonts = &font->glyphs.fonts;
+  font_chain_push(fonts, config->library, path);
+  for (size_t i = 0; i < config->fallback_fonts_count; ++i) {
+    font_chain_push(fonts, config->library, config->fallback_fonts[i]);
+  }
+  font_chain_set_pixel_size(fonts, config->text_size);
+  if (config->sdf) {
+    sdf_atlas_generate(&font->sdf, font_chain_face(fonts, 0));
+    font_chain_set_pixel_size(fonts, config->text_size);
+  } else if (config->startup_cache_dir) {
+    font->atlas = glyph_atlas_load(&font->glyphs, config->startup_cache_dir);
+  }
+  font->effects.effects = config->effects;
+  return font;
+}
+
+GifFileType *batch_gif(Batch *batch, const char *path) {
+  for (size_t i = 0; i < batch->gifs_count; ++i) {
+    if (strcmp(batch->gifs[i].path, path) == 0) return batch->gifs[i].gif;
+  }
+
+  int error = 0;
+  GifFileType *gif = DGifOpenFileName(path, &error);
+  if (gif == nullptr) {
+    fprintf(stderr, "could not read gif file: %s\n", path);
+    exit(1);
+  }
+  DGifSlurp(gif);
+  memory_track_alloc(MEMORY_GIF, gif_bytes(gif));
+  batch->gifs[batch->gifs_count++] = {path, gif};
+  return gif;
+}
+
+Image32 batch_png(Batch *batch, const char *path) {
+  for (size_t i = 0; i < batch->pngs_count; ++i) {
+    if (strcmp(batch->pngs[i].path, path) == 0) return batch->pngs[i].image;
+  }
+  const Batch_Config *config = batch->config;
+  Batch_Png *png = &batch->pngs[batch->pngs_count++];
+  png->path = path;
+  png->image = load_emote_cached(config->startup_cache_dir, path);
+  if (config->startup_cache_dir) {
+    load_scaled_emote_cached(config->startup_cache_dir, &batch->emotes, &png->image, path, config->emote_height);
+  }
+  return png->image;
+}
+
+void batch_load(Batch *batch, const char *file_path) {
+  FILE *f = fopen(file_path, "rb");
+  if (!f) {
+    fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size < 0) {
+    fprintf(stderr, "could not read %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  batch->data = (char *)malloc((size_t)size + 1);
+  assert(batch->data);
+  if (fread(batch->data, 1, (size_t)size, f) != (size_t)size) {
+    fprintf(stderr, "could not read %s\n", file_path);
+    exit(1);
+  }
+  batch->data[size] = '\0';
+  fclose(f);
+
+  // * every job may bring its own font, gif and png
+  size_t lines = 1;
+  for (long i = 0; i < size; ++i) lines += batch->data[i] == '\n';
+  batch->jobs = (Batch_Job *)calloc(lines, sizeof(Batch_Job));
+  batch->fonts = (Batch_Font *)calloc(lines, sizeof(Batch_Font));
+  batch->gifs = (Batch_Gif *)calloc(lines, sizeof(Batch_Gif));
+  batch->pngs = (Batch_Png *)calloc(lines, sizeof(Batch_Png));
+  assert(batch->jobs && batch->fonts && batch->gifs && batch->pngs);
+
+  const Batch_Config *config = batch->config;
+  size_t line_number = 0;
+  for (char *line = batch->data; line != nullptr;) {
+    char *end = strchr(line, '\n');
+    if (end) *end = '\0';
+    char *next = end ? end + 1 : nullptr;
+    line_number += 1;
+
+    size_t line_size = strlen(line);
+    while (line_size > 0 && line[line_size - 1] == '\r') line[--line_size] = '\0';
+    if (line_size == 0 || *line == '#') {
+      line = next;
+      continue;
+    }
+
+    char *fields[BATCH_FIELDS_CAPACITY];
+    size_t fields_count = split_tabs(line, fields, BATCH_FIELDS_CAPACITY);
+    if (fields_count < 4) {
+      fprintf(stderr, "%s:%zu: expected <output>, <text>, <gif_image>, <png_image> and optionally <font> separated by tabs\n",
+              file_path, line_number);
+      exit(1);
+    }
+
+    if (config->sdf && !sdf_text_supported(fields[1])) {
+      fprintf(stderr, "%s:%zu: --sdf only has the printable ASCII characters, the text has others\n",
+              file_path, line_number);
+      exit(1);
+    }
+
+    Batch_Font *font = batch_font(batch, fields_count >= 5 ? fields[4] : FACE_FILE_PATH);
+
+    Batch_Job *job = &batch->jobs[batch->jobs_count++];
+    job->output = fields[0];
+    job->text = fields[1];
+    job->renderer.glyphs = &font->glyphs;
+    job->renderer.effects = &font->effects;
+    job->renderer.sdf = config->sdf ? &font->sdf : nullptr;
+    job->renderer.text_size = config->text_size;
+    job->renderer.text = job->text;
+    job->renderer.gif_file = batch_gif(batch, fields[2]);
+    job->renderer.png = batch_png(batch, fields[3]);
+    job->renderer.emote_height = config->emote_height;
+    job->renderer.emotes = &batch->emotes;
+    job->renderer.emote_code = emote_code_of(fields[3]);
+    job->renderer.scale = 1;
+
+    // * the only time the caches are written to
+    renderer_load_text(&job->renderer, job->text);
+    if (config->startup_cache_dir && !config->sdf) {
+      shape_cache_keep(&font->glyphs.shapes, &font->glyphs.fonts, job->text);
+    }
+
+    line = next;
+  }
+}
+
+void *batch_worker_routine(void *arg) {
+  Batch *batch = (Batch *)arg;
+  const Batch_Config *config = batch->config;
+
+  for (;;) {
+    size_t index = batch->next_job.fetch_add(1);
+    if (index >= batch->jobs_count) break;
+    Batch_Job *job = &batch->jobs[index];
+
+    uint64_t begin = monotonic_ns();
+    job->rendered = encode_frames(&job->renderer, &config->encoder_config, job->output,
+                                  config->frames_begin, config->frames_end, config->dedup, config->vfr);
+    job->ns = monotonic_ns() - begin;
+    printf("Job %zu: encoded %s\n", index, job->output);
+  }
+  return nullptr;
+}
+
+void run_batch(const Batch_Config *config, const char *file_path) {
+  Batch *batch = new Batch();
+  batch->config = config;
+
+  uint64_t load_begin = monotonic_ns();
+  batch_load(batch, file_path);
+  uint64_t load_ns = monotonic_ns() - load_begin;
+  if (batch->jobs_count == 0) {
+    fprintf(stderr, "ERROR: no jobs in %s\n", file_path);
+    exit(1);
+  }
+
+  size_t cores = hardware_threads();
+  size_t workers_count = config->workers > 0 ? config->workers : cores;
+  workers_count = std::min(workers_count, batch->jobs_count);
+
+  // * the cores that are left over when there are fewer jobs than cores go
+  // * to the encoders
+  Batch_Config worker_config = *config;
+  if (worker_config.encoder_config.thread_count == 0) {
+    worker_config.encoder_config.thread_count = (int)std::max(cores / workers_count, (size_t)1);
+  }
+  batch->config = &worker_config;
+
+  printf("Loaded %zu jobs in %.2fs: %zu fonts, %zu gifs, %zu pngs; rendering on %zu workers\n",
+         batch->jobs_count, (double)load_ns / 1e9, batch->fonts_count, batch->gifs_count, batch->pngs_count,
+         workers_count);
+
+  uint64_t begin = monotonic_ns();
+  pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * workers_count);
+  assert(workers);
+  for (size_t i = 0; i < workers_count; ++i) {
+    pthread_create(&workers[i], nullptr, batch_worker_routine, batch);
+  }
+  for (size_t i = 0; i < workers_count; ++i) {
+    pthread_join(workers[i], nullptr);
+  }
+  free(workers);
+  uint64_t ns = monotonic_ns() - begin;
+
+  size_t frames = config->frames_end - config->frames_begin;
+  size_t rendered = 0;
+  printf("Batch:\n");
+  printf("    %-6s %-32s %8s %8s %8s %10s\n", "job", "output", "frames", "rendered", "seconds", "frames/s");
+  for (size_t i = 0; i < batch->jobs_count; ++i) {
+    const Batch_Job *job = &batch->jobs[i];
+    rendered += job->rendered;
+    printf("    %-6zu %-32s %8zu %8zu %8.2f %10.1f\n", i, job->output, frames, job->rendered,
+           (double)job->ns / 1e9, job->ns > 0 ? (double)frames * 1e9 / (double)job->ns : 0.0);
+  }
+  printf("    %zu jobs, %zu frames, %zu rendered in %.2fs, %.1f frames/s\n",
+         batch->jobs_count, frames * batch->jobs_count, rendered, (double)ns / 1e9,
+         (double)(frames * batch->jobs_count) * 1e9 / (double)std::max(ns, (uint64_t)1));
+
+  for (size_t i = 0; i < batch->gifs_count; ++i) {
+    int error = 0;
+    DGifCloseFile(batch->gifs[i].gif, &error);
+  }
+  if (config->startup_cache_dir && !config->sdf) {
+    for (size_t i = 0; i < batch->fonts_count; ++i) {
+      glyph_atlas_save(&batch->fonts[i].glyphs, &batch->fonts[i].atlas, config->startup_cache_dir);
+    }
+  }
+
+  // * the fonts, the caches and the pngs live until the exit like in the
+  // * other modes
+  delete batch;
+}
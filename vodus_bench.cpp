@@ -0,0 +1,174 @@
+// * ###################################################################
+// * Benchmark mode
+// * ###################################################################
+
+// * Replays a chat log (see vodus_chatlog.cpp) through the renderer of the
+// * live mode as fast as possible. The ticks go at VODUS_FPS of the chat
+// * time, every tick with new messages or a new frame of the animated
+// * emote renders a frame and the other ticks are skipped, like in the
+// * live mode. The frames are thrown away, only the rendering is measured.
+// *
+// * Every rendered frame is put into a bucket by the chat density of its
+// * second, so the report shows how the frame times and the memory change
+// * with the amount of messages per second.
+
+constexpr size_t BENCH_DENSITY_BUCKETS = 24;
+
+// * 0, 1, 2-3, 4-7, ... messages per second
+size_t bench_density_bucket(size_t messages) {
+  size_t bucket = 0;
+  while (messages > 0 && bucket + 1 < BENCH_DENSITY_BUCKETS) {
+    messages >>= 1;
+    bucket += 1;
+  }
+  return bucket;
+}
+
+struct Bench_Bucket {
+  size_t seconds;
+  size_t frames;
+  // * frame times in ns, sorted for the percentiles at the end
+  uint64_t *times;
+  size_t capacity;
+  uint64_t total_ns;
+  // * the maximum at the end of the seconds of the bucket
+  int64_t counted_peak;
+  size_t rss_peak;
+};
+
+void bench_bucket_push(Bench_Bucket *bucket, uint64_t ns) {
+  if (bucket->frames >= bucket->capacity) {
+    bucket->capacity = bucket->capacity == 0 ? 256 : bucket->capacity * 2;
+    bucket->times = (uint64_t *)realloc(bucket->times, sizeof(uint64_t) * bucket->capacity);
+    assert(bucket->times);
+  }
+  bucket->times[bucket->frames++] = ns;
+  bucket->total_ns += ns;
+}
+
+// * times has to be sorted
+double percentile_ms(const uint64_t *times, size_t count, double p) {
+  if (count == 0) return 0.0;
+  size_t index = std::min((size_t)(p * (double)count), count - 1);
+  return (double)times[index] / 1e6;
+}
+
+void bench_print_row(const char *label, const Bench_Bucket *bucket) {
+  double fps = bucket->total_ns > 0 ? (double)bucket->frames * 1e9 / (double)bucket->total_ns : 0.0;
+  printf("    %-12s %8zu %8zu %10.1f %8.2f %8.2f %8.2f %8.2f %12.1f %12.1f\n",
+         label, bucket->seconds, bucket->frames, fps,
+         percentile_ms(bucket->times, bucket->frames, 0.50),
+         percentile_ms(bucket->times, bucket->frames, 0.90),
+         percentile_ms(bucket->times, bucket->frames, 0.99),
+         percentile_ms(bucket->times, bucket->frames, 1.00),
+         mib(bucket->counted_peak), mib((int64_t)bucket->rss_peak));
+}
+
+// * Samples the memory into the bucket of the chat second that just ended
+void bench_end_second(Bench_Bucket *bucket) {
+  bucket->seconds += 1;
+  bucket->counted_peak = std::max(bucket->counted_peak, memory.live.load());
+  bucket->rss_peak = std::max(bucket->rss_peak, memory_rss());
+}
+
+// * frames_end of 0 is until the last message
+void run_bench(Renderer *renderer, const char *log_filepath, size_t frames_end) {
+  Chat_Log log;
+  chat_log_load(&log, log_filepath);
+  memory_track_alloc(MEMORY_CHAT, log.data_size + sizeof(Chat_Log_Message) * log.capacity);
+  if (log.count == 0) {
+    fprintf(stderr, "ERROR: no messages in %s\n", log_filepath);
+    exit(1);
+  }
+
+  const uint64_t last_ms = log.messages[log.count - 1].time_ms;
+  size_t ticks = (size_t)((last_ms * VODUS_FPS + 999) / 1000) + 1;
+  if (frames_end != 0) ticks = std::min(ticks, frames_end);
+  size_t seconds = (ticks + VODUS_FPS - 1) / VODUS_FPS;
+
+  // * messages in every second of the chat
+  size_t *density = (size_t *)calloc(seconds, sizeof(size_t));
+  assert(density);
+  defer(free(density));
+  for (size_t i = 0; i < log.count && log.messages[i].time_ms / 1000 < seconds; ++i) {
+    density[log.messages[i].time_ms / 1000] += 1;
+  }
+
+  Bench_Bucket buckets[BENCH_DENSITY_BUCKETS] = {};
+  Bench_Bucket total = {};
+
+  Image32 surface = {
+      .height = VODUS_HEIGHT,
+      .width = VODUS_WIDTH,
+      .pixels = frame_pixels_alloc(),
+      .stride = VODUS_WIDTH};
+  defer(frame_pixels_free(surface.pixels));
+
+  Live_Chat chat = {};
+  size_t next = 0;
+  size_t previous_gif_index = 0;
+  size_t sweep_at = 0;
+  uint64_t start = monotonic_ns();
+  for (size_t tick = 0; tick < ticks; ++tick) {
+    uint64_t tick_ms = tick * 1000 / VODUS_FPS;
+    size_t second = tick / VODUS_FPS;
+    Bench_Bucket *bucket = &buckets[bench_density_bucket(density[second])];
+
+    size_t arrived = 0;
+    while (next < log.count && log.messages[next].time_ms <= tick_ms) {
+      live_chat_push(&chat, strdup(log.messages[next].text));
+      next += 1;
+      arrived += 1;
+    }
+
+    Animation_Phase phase = animation_phase_at(renderer->gif, tick_ms);
+    bool animated = live_chat_animated(renderer, &chat) && phase.gif_index != previous_gif_index;
+    previous_gif_index = phase.gif_index;
+
+    if (tick == 0 || arrived > 0 || animated) {
+      uint64_t begin = monotonic_ns();
+      render_live_chat(renderer, image32_view(surface), &chat, phase);
+      // * the sweeps are a part of the steady state, like in the live mode
+      live_chat_sweep(renderer, &chat, &sweep_at);
+      uint64_t ns = monotonic_ns() - begin;
+      bench_bucket_push(bucket, ns);
+      bench_bucket_push(&total, ns);
+    }
+
+    if ((tick + 1) % VODUS_FPS == 0 || tick + 1 == ticks) {
+      bench_end_second(bucket);
+      bench_end_second(&total);
+    }
+  }
+  uint64_t wall_ns = monotonic_ns() - start;
+
+  printf("Bench: %zu messages over %.1fs of chat, %zu of %zu ticks rendered in %.2fs, %.1fx real time\n",
+         next, (double)ticks / VODUS_FPS, total.frames, ticks, (double)wall_ns / 1e9,
+         (double)ticks / VODUS_FPS / ((double)wall_ns / 1e9));
+  printf("    %-12s %8s %8s %10s %8s %8s %8s %8s %12s %12s\n",
+         "messages/s", "seconds", "frames", "frames/s", "p50 ms", "p90 ms", "p99 ms", "max ms",
+         "counted MiB", "resident MiB");
+  for (size_t i = 0; i < BENCH_DENSITY_BUCKETS; ++i) {
+    Bench_Bucket *bucket = &buckets[i];
+    if (bucket->seconds == 0) continue;
+    std::sort(bucket->times, bucket->times + bucket->frames);
+
+    char label[32];
+    if (i <= 1) {
+      snprintf(label, sizeof(label), "%zu", i);
+    } else {
+      snprintf(label, sizeof(label), "%zu-%zu", (size_t)1 << (i - 1), ((size_t)1 << i) - 1);
+    }
+    bench_print_row(label, bucket);
+    free(bucket->times);
+  }
+  std::sort(total.times, total.times + total.frames);
+  bench_print_row("all", &total);
+  free(total.times);
+
+  for (size_t i = 0; i < chat.count; ++i) {
+    free(chat.messages[(chat.begin + i) % LIVE_MESSAGES_CAPACITY]);
+  }
+  memory_track_free(MEMORY_CHAT, log.data_size + sizeof(Chat_Log_Message) * log.capacity);
+  chat_log_free(&log);
+}
@@ -0,0 +1,169 @@
+// * ###################################################################
+// * Segment cache
+// * ###################################################################
+
+// * The frames are encoded in fixed-length segments and every encoded
+// * segment is kept in the cache directory under the hash of everything
+// * that affects it: the input files, the text and layout options, the
+// * encoder options and the scenes of its frames. A re-render after an edit
+// * only encodes the segments whose hash changed and glues the rest from
+// * the cache, so the output has to be a container that can be
+// * concatenated byte by byte (MPEG-TS).
+// *
+// * Bump SEGMENT_CACHE_VERSION whenever the renderer starts drawing the same
+// * inputs differently, the old segments become unreachable then.
+
+#include <sys/stat.h>
+
+constexpr uint64_t SEGMENT_CACHE_VERSION = 3;
+constexpr size_t SEGMENT_CACHE_DEFAULT_FRAMES = 10 * VODUS_FPS;
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+constexpr uint64_t FNV1A_OFFSET_BASIS = 14695981039346656037ULL;
+
+// * The terminator is hashed too, so "ab" + "c" differs from "a" + "bc".
+// * nullptr hashes like an empty string with a different terminator.
+uint64_t fnv1a_string(uint64_t hash, const char *s) {
+  if (s == nullptr) {
+    uint8_t none = 0xff;
+    return fnv1a(hash, &none, 1);
+  }
+  return fnv1a(hash, s, strlen(s) + 1);
+}
+
+template <typename T>
+uint64_t fnv1a_value(uint64_t hash, T value) {
+  return fnv1a(hash, &value, sizeof(value));
+}
+
+uint64_t fnv1a_file(uint64_t hash, const char *file_path) {
+  FILE *f = fopen(file_path, "rb");
+  if (!f) {
+    fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  defer(fclose(f));
+
+  uint8_t buffer[64 * 1024];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    hash = fnv1a(hash, buffer, n);
+  }
+  if (ferror(f)) {
+    fprintf(stderr, "could not read %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  return hash;
+}
+
+uint64_t hash_encoder_config(uint64_t hash, const Encoder_Config *config) {
+  hash = fnv1a_string(hash, config->codec_name);
+  hash = fnv1a_string(hash, config->preset);
+  hash = fnv1a_value(hash, config->crf);
+  hash = fnv1a_value(hash, config->bit_rate);
+  hash = fnv1a_value(hash, config->gop_size);
+  hash = fnv1a_value(hash, config->max_b_frames);
+  hash = fnv1a_value(hash, (int)config->pix_fmt);
+  // * slice threads change the bitstream
+  hash = fnv1a_value(hash, config->thread_count);
+  return hash;
+}
+
+struct Segment_Cache {
+  const char *dir;
+  size_t segment_frames;
+  // * everything that is the same for all the segments
+  uint64_t inputs_hash;
+};
+
+// * The range is part of the key because the timestamps of the packets are
+// * the frame indices
+uint64_t segment_hash(const Segment_Cache *cache, size_t begin, size_t end) {
+  uint64_t hash = cache->inputs_hash;
+  hash = fnv1a_value(hash, (uint64_t)begin);
+  hash = fnv1a_value(hash, (uint64_t)end);
+  for (size_t index = begin; index < end; ++index) {
+    hash = fnv1a_value(hash, scene_hash(scene_at_frame(index)));
+  }
+  return hash;
+}
+
+void append_file(int output_fd, const char *output_path, const char *file_path) {
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  defer(close(fd));
+
+  uint8_t buffer[64 * 1024];
+  for (;;) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "could not read %s: %s\n", file_path, strerror(errno));
+      exit(1);
+    }
+    if (n == 0) break;
+
+    struct iovec iov = {buffer, (size_t)n};
+    write_all_iov(output_fd, &iov, 1, output_path);
+  }
+}
+
+// * Encodes [begin, end) into output_path reusing the cached segments
+void encode_frames_with_cache(Segment_Cache *cache, Renderer *renderer, const Encoder_Config *config,
+                              const char *output_path, size_t begin, size_t end, bool dedup, bool vfr) {
+  if (mkdir(cache->dir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", cache->dir, strerror(errno));
+    exit(1);
+  }
+
+  int output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (output_fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", output_path, strerror(errno));
+    exit(1);
+  }
+  defer(close(output_fd));
+
+  constexpr size_t FILE_PATH_CAPA = 4096;
+  char segment_path[FILE_PATH_CAPA];
+  char temp_path[FILE_PATH_CAPA];
+
+  size_t segments_count = 0;
+  size_t reused_count = 0;
+  size_t rendered_count = 0;
+
+  for (size_t segment_begin = begin; segment_begin < end; segment_begin += cache->segment_frames) {
+    size_t segment_end = std::min(segment_begin + cache->segment_frames, end);
+    uint64_t hash = segment_hash(cache, segment_begin, segment_end);
+    snprintf(segment_path, FILE_PATH_CAPA, "%s/%016llx.ts", cache->dir, (unsigned long long)hash);
+
+    if (access(segment_path, R_OK) == 0) {
+      reused_count += 1;
+    } else {
+      // * encoded next to the final name and renamed, so an interrupted
+      // * render never leaves a broken segment in the cache
+      snprintf(temp_path, FILE_PATH_CAPA, "%s/%016llx.%d.tmp.ts", cache->dir, (unsigned long long)hash, (int)getpid());
+      rendered_count += encode_frames(renderer, config, temp_path, segment_begin, segment_end, dedup, vfr);
+      if (rename(temp_path, segment_path) < 0) {
+        fprintf(stderr, "could not rename %s to %s: %s\n", temp_path, segment_path, strerror(errno));
+        exit(1);
+      }
+    }
+
+    append_file(output_fd, output_path, segment_path);
+    segments_count += 1;
+  }
+
+  printf("Encoded frames [%zu, %zu) into %s, %zu of %zu segments reused from %s, %zu frames rendered\n",
+         begin, end, output_path, reused_count, segments_count, cache->dir, rendered_count);
+}
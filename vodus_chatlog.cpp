@@ -0,0 +1,106 @@
+// * ###################################################################
+// * Chat log
+// * ###################################################################
+
+// * A recorded chat: one message per line, prefixed with the time it was
+// * sent in milliseconds since the start of the stream.
+// *
+// *   # comment
+// *   1250 first message
+// *   1310 second message
+// *
+// * The times never go back. Written by the vodus-chatgen tool (chatgen.cpp)
+// * and replayed by `vodus --bench`, so it does not depend on anything else
+// * of vodus.
+
+#include <stdint.h>
+
+struct Chat_Log_Message {
+  uint64_t time_ms;
+  // * NUL terminated inside of Chat_Log::data
+  const char *text;
+};
+
+struct Chat_Log {
+  char *data;
+  size_t data_size;
+
+  size_t count;
+  size_t capacity;
+  Chat_Log_Message *messages;
+};
+
+void chat_log_write_message(FILE *stream, uint64_t time_ms, const char *text) {
+  fprintf(stream, "%llu %s\n", (unsigned long long)time_ms, text);
+}
+
+// * The whole file stays in memory, the texts point into it
+void chat_log_load(Chat_Log *log, const char *file_path) {
+  memset(log, 0, sizeof(*log));
+
+  FILE *f = fopen(file_path, "rb");
+  if (!f) {
+    fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size < 0) {
+    fprintf(stderr, "could not read %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+
+  log->data_size = (size_t)size;
+  log->data = (char *)malloc(log->data_size + 1);
+  assert(log->data);
+  if (fread(log->data, 1, log->data_size, f) != log->data_size) {
+    fprintf(stderr, "could not read %s\n", file_path);
+    exit(1);
+  }
+  log->data[log->data_size] = '\0';
+  fclose(f);
+
+  size_t line_number = 0;
+  uint64_t previous_time = 0;
+  for (char *line = log->data; line < log->data + log->data_size;) {
+    char *end = (char *)memchr(line, '\n', (size_t)(log->data + log->data_size - line));
+    if (end == nullptr) end = log->data + log->data_size;
+    char *next = end + 1;
+    line_number += 1;
+
+    while (end > line && end[-1] == '\r') end -= 1;
+    *end = '\0';
+    if (line == end || *line == '#') {
+      line = next;
+      continue;
+    }
+
+    char *text = nullptr;
+    errno = 0;
+    unsigned long long time_ms = strtoull(line, &text, 10);
+    if (errno != 0 || text == line || *text != ' ' || (uint64_t)time_ms < previous_time) {
+      fprintf(stderr, "%s:%zu: expected `<milliseconds> <message>` with the times going forward\n",
+              file_path, line_number);
+      exit(1);
+    }
+    previous_time = (uint64_t)time_ms;
+    text += 1;
+
+    if (*text != '\0') {
+      if (log->count >= log->capacity) {
+        log->capacity = log->capacity == 0 ? 1024 : log->capacity * 2;
+        log->messages = (Chat_Log_Message *)realloc(log->messages, sizeof(Chat_Log_Message) * log->capacity);
+        assert(log->messages);
+      }
+      log->messages[log->count++] = {(uint64_t)time_ms, text};
+    }
+    line = next;
+  }
+}
+
+void chat_log_free(Chat_Log *log) {
+  free(log->messages);
+  free(log->data);
+  memset(log, 0, sizeof(*log));
+}
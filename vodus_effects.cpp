@@ -0,0 +1,313 @@
+// * ###################################################################
+// * Text effects
+// * ###################################################################
+
+// * Outline and drop shadow that keep the text readable over whatever is
+// * under it. Both are made from the coverage of the whole text: the
+// * outline is the coverage dilated by a square of the outline radius and
+// * the shadow is the outline (or the coverage without one) blurred by two
+// * box filters, which is close enough to a Gaussian. Both filters are
+// * separable and run on whole rows with the SIMD kernels.
+// *
+// * The effects are made once per text and kept as coverage masks in the
+// * Effect_Cache, so a frame only slaps the shadow, the outline and then the
+// * glyphs on top of them.
+
+// * how much of the shadow color the fully covered shadow pixels get
+constexpr uint32_t SHADOW_OPACITY = 192;
+// * the sums of the box filter are 16 bit, 255 * (2 * radius + 1) has to
+// * fit into them
+constexpr int TEXT_EFFECT_MAX_RADIUS = 64;
+
+struct Text_Effects {
+  // * in pixels, 0 turns the effect off
+  int outline;
+  int shadow;
+  // * where the shadow is relative to the text
+  int shadow_offset;
+  Pixels32 outline_color;
+  Pixels32 shadow_color;
+};
+
+// * Black outline and shadow, the shadow is offset by its own radius
+Text_Effects default_text_effects(int outline, int shadow) {
+  Text_Effects effects = {};
+  effects.outline = outline;
+  effects.shadow = shadow;
+  effects.shadow_offset = shadow;
+  effects.outline_color = {0, 0, 0, 255};
+  effects.shadow_color = {0, 0, 0, 255};
+  return effects;
+}
+
+bool text_effects_enabled(const Text_Effects *effects) {
+  return effects->outline > 0 || effects->shadow > 0;
+}
+
+// * The effects of one text
+struct Text_Sprite {
+  // * the key: copy of the text and the pixel size it was rendered at
+  char *text;
+  size_t text_size;
+  int pixel_size;
+  uint64_t hash;
+
+  // * top left corner of both masks relative to the pen position the
+  // * text starts at, like the positions for_each_glyph reports
+  int x, y;
+  Mask outline;
+  Mask shadow;
+};
+
+// * Open addressing hash table of the sprites by text, the effects are
+// * the same for all of them
+struct Effect_Cache {
+  Text_Effects effects;
+
+  size_t capacity;
+  size_t count;
+  Text_Sprite *entries;
+};
+
+FT_Bitmap coverage_bitmap_alloc(int width, int height) {
+  FT_Bitmap bitmap = {};
+  bitmap.rows = (unsigned int)height;
+  bitmap.width = (unsigned int)width;
+  bitmap.pitch = width;
+  bitmap.num_grays = 256;
+  bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+  bitmap.buffer = (unsigned char *)calloc(std::max((size_t)width * (size_t)height, (size_t)1), 1);
+  assert(bitmap.buffer);
+  return bitmap;
+}
+
+// * The filters below skip the radius wide border of the bitmap, so the
+// * content has to stay that far from the edges after the filter.
+
+// * Max over a square of 2 * radius + 1 pixels
+FT_Bitmap coverage_dilate(const FT_Bitmap *src, int radius) {
+  int width = (int)src->width;
+  int height = (int)src->rows;
+  int inner = width - 2 * radius;
+
+  FT_Bitmap rows = coverage_bitmap_alloc(width, height);
+  defer(free(rows.buffer));
+  for (int row = 0; row < height; ++row) {
+    for (int k = 0; k <= 2 * radius; ++k) {
+      max_plane.run(rows.buffer + row * width + radius, src->buffer + row * width + k, (size_t)inner);
+    }
+  }
+
+  FT_Bitmap result = coverage_bitmap_alloc(width, height);
+  for (int row = radius; row < height - radius; ++row) {
+    for (int k = -radius; k <= radius; ++k) {
+      max_plane.run(result.buffer + row * width, rows.buffer + (row + k) * width, (size_t)width);
+    }
+  }
+  return result;
+}
+
+// * Mean over a square of 2 * radius + 1 pixels, the result is scaled by
+// * opacity / 255
+FT_Bitmap coverage_box_blur(const FT_Bitmap *src, int radius, uint32_t opacity) {
+  assert(radius > 0);
+  int width = (int)src->width;
+  int height = (int)src->rows;
+  int inner = width - 2 * radius;
+  uint32_t n = (uint32_t)(2 * radius + 1);
+  assert(radius <= TEXT_EFFECT_MAX_RADIUS);
+
+  // * rounded up, so the full coverage stays full
+  uint16_t reciprocal = (uint16_t)((65536 + n - 1) / n);
+  uint16_t scaled_reciprocal = (uint16_t)((65536 * opacity + 255 * n - 1) / (255 * n));
+
+  uint16_t *sum = (uint16_t *)malloc(sizeof(uint16_t) * (size_t)width);
+  assert(sum);
+  defer(free(sum));
+
+  FT_Bitmap rows = coverage_bitmap_alloc(width, height);
+  defer(free(rows.buffer));
+  for (int row = 0; row < height; ++row) {
+    memset(sum, 0, sizeof(uint16_t) * (size_t)inner);
+    for (int k = 0; k <= 2 * radius; ++k) {
+      accumulate_plane.run(sum, src->buffer + row * width + k, (size_t)inner);
+    }
+    divide_plane.run(rows.buffer + row * width + radius, sum, (size_t)inner, reciprocal);
+  }
+
+  FT_Bitmap result = coverage_bitmap_alloc(width, height);
+  for (int row = radius; row < height - radius; ++row) {
+    memset(sum, 0, sizeof(uint16_t) * (size_t)width);
+    for (int k = -radius; k <= radius; ++k) {
+      accumulate_plane.run(sum, rows.buffer + (row + k) * width, (size_t)width);
+    }
+    divide_plane.run(result.buffer + row * width, sum, (size_t)width, scaled_reciprocal);
+  }
+  return result;
+}
+
+void text_sprite_render(Text_Sprite *sprite, Glyph_Cache *glyphs, const Text_Effects *effects) {
+  // * bounding box of the glyphs
+  int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+  for_each_glyph(glyphs, sprite->text, 0, 0, [&](Mask *mask, int x, int y) {
+    if (mask->bitmap.width == 0 || mask->bitmap.rows == 0) return;
+    x0 = std::min(x0, x);
+    y0 = std::min(y0, y);
+    x1 = std::max(x1, x + (int)mask->bitmap.width);
+    y1 = std::max(y1, y + (int)mask->bitmap.rows);
+  });
+  if (x0 >= x1) {
+    x0 = x1 = y0 = y1 = 0;
+  }
+
+  // * every filter grows the content by its radius and skips a border of
+  // * its radius, so twice the radius of all of them
+  int pad = 2 * (effects->outline + 2 * effects->shadow);
+  int width = x1 - x0 + 2 * pad;
+  int height = y1 - y0 + 2 * pad;
+  sprite->x = x0 - pad;
+  sprite->y = y0 - pad;
+
+  FT_Bitmap coverage = coverage_bitmap_alloc(width, height);
+  defer(free(coverage.buffer));
+  for_each_glyph(glyphs, sprite->text, -sprite->x, -sprite->y, [&](Mask *mask, int x, int y) {
+    for (unsigned int row = 0; row < mask->bitmap.rows; ++row) {
+      max_plane.run(coverage.buffer + (y + (int)row) * width + x,
+                    mask->bitmap.buffer + (int)row * mask->bitmap.pitch,
+                    mask->bitmap.width);
+    }
+  });
+
+  FT_Bitmap outline = effects->outline > 0
+    ? coverage_dilate(&coverage, effects->outline)
+    : coverage_bitmap_alloc(0, 0);
+  FT_Bitmap shadow = coverage_bitmap_alloc(0, 0);
+  if (effects->shadow > 0) {
+    FT_Bitmap *source = effects->outline > 0 ? &outline : &coverage;
+    FT_Bitmap blurred = coverage_box_blur(source, effects->shadow, 255);
+    defer(free(blurred.buffer));
+    free(shadow.buffer);
+    shadow = coverage_box_blur(&blurred, effects->shadow, SHADOW_OPACITY);
+  }
+
+  sprite->outline = mask_from_bitmap(outline);
+  sprite->shadow = mask_from_bitmap(shadow);
+}
+
+Text_Sprite *effect_cache_find_slot(Text_Sprite *entries, size_t capacity,
+                                    const char *text, size_t size, int pixel_size, uint64_t hash) {
+  for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+    Text_Sprite *entry = &entries[i];
+    if (entry->text == nullptr) {
+      return entry;
+    }
+    if (entry->hash == hash
+        && entry->pixel_size == pixel_size
+        && entry->text_size == size
+        && memcmp(entry->text, text, size) == 0) {
+      return entry;
+    }
+  }
+}
+
+void effect_cache_grow(Effect_Cache *cache) {
+  size_t capacity = cache->capacity == 0 ? 64 : cache->capacity * 2;
+  Text_Sprite *entries = (Text_Sprite *)calloc(capacity, sizeof(Text_Sprite));
+  assert(entries);
+  memory_track_alloc(MEMORY_GLYPHS, capacity * sizeof(Text_Sprite));
+
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    Text_Sprite *entry = &cache->entries[i];
+    if (entry->text) {
+      *effect_cache_find_slot(entries, capacity, entry->text, entry->text_size, entry->pixel_size, entry->hash) = *entry;
+    }
+  }
+
+  free(cache->entries);
+  memory_track_free(MEMORY_GLYPHS, cache->capacity * sizeof(Text_Sprite));
+  cache->entries = entries;
+  cache->capacity = capacity;
+}
+
+// * Not thread-safe when the text is not in the cache yet
+Text_Sprite *effect_cache_get(Effect_Cache *cache, Glyph_Cache *glyphs, const char *text) {
+  size_t size = strlen(text);
+  int pixel_size = glyphs->fonts.pixel_size;
+  uint64_t hash = hash_text(text, size, pixel_size);
+
+  if (cache->capacity > 0) {
+    Text_Sprite *entry = effect_cache_find_slot(cache->entries, cache->capacity, text, size, pixel_size, hash);
+    if (entry->text) {
+      return entry;
+    }
+  }
+
+  // * keep the load factor under 50%
+  if ((cache->count + 1) * 2 > cache->capacity) {
+    effect_cache_grow(cache);
+  }
+
+  Text_Sprite *entry = effect_cache_find_slot(cache->entries, cache->capacity, text, size, pixel_size, hash);
+  entry->text = strdup(text);
+  assert(entry->text);
+  entry->text_size = size;
+  entry->pixel_size = pixel_size;
+  entry->hash = hash;
+  text_sprite_render(entry, glyphs, &cache->effects);
+  memory_track_alloc(MEMORY_GLYPHS, size + 1 + mask_bytes(&entry->outline) + mask_bytes(&entry->shadow));
+  cache->count += 1;
+
+  return entry;
+}
+
+// * Drops the sprites of everything but the texts, see shape_cache_retain
+void effect_cache_retain(Effect_Cache *cache, int pixel_size, const char *const *texts, const uint64_t *hashes, size_t count) {
+  if (cache->capacity == 0) return;
+  Text_Sprite *entries = (Text_Sprite *)calloc(cache->capacity, sizeof(Text_Sprite));
+  assert(entries);
+
+  size_t retained = 0;
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    Text_Sprite *entry = &cache->entries[i];
+    if (entry->text == nullptr) continue;
+    if (entry->pixel_size == pixel_size && text_in(entry->text, entry->text_size, entry->hash, texts, hashes, count)) {
+      *effect_cache_find_slot(entries, cache->capacity, entry->text, entry->text_size, entry->pixel_size, entry->hash) = *entry;
+      retained += 1;
+    } else {
+      memory_track_free(MEMORY_GLYPHS, entry->text_size + 1 + mask_bytes(&entry->outline) + mask_bytes(&entry->shadow));
+      free(entry->text);
+      mask_free(&entry->outline);
+      mask_free(&entry->shadow);
+    }
+  }
+
+  free(cache->entries);
+  cache->entries = entries;
+  cache->count = retained;
+}
+
+// * The effects go under the text, so these are called before the text is
+// * slapped at the same position
+void slap_text_effects_onto_image32(Image32_View surface, Effect_Cache *cache, Glyph_Cache *glyphs, const char *text, int x, int y) {
+  if (!text_effects_enabled(&cache->effects)) return;
+  Text_Sprite *sprite = effect_cache_get(cache, glyphs, text);
+  int offset = cache->effects.shadow_offset;
+  slap_onto_image32(surface, &sprite->shadow, cache->effects.shadow_color, x + sprite->x + offset, y + sprite->y + offset);
+  slap_onto_image32(surface, &sprite->outline, cache->effects.outline_color, x + sprite->x, y + sprite->y);
+}
+
+void slap_text_effects_onto_yuv420p(Yuv420p surface, Effect_Cache *cache, Glyph_Cache *glyphs, const char *text, int x, int y) {
+  if (!text_effects_enabled(&cache->effects)) return;
+  Text_Sprite *sprite = effect_cache_get(cache, glyphs, text);
+  int offset = cache->effects.shadow_offset;
+  slap_onto_yuv420p(surface, &sprite->shadow, cache->effects.shadow_color, x + sprite->x + offset, y + sprite->y + offset);
+  slap_onto_yuv420p(surface, &sprite->outline, cache->effects.outline_color, x + sprite->x, y + sprite->y);
+}
+
+void slap_text_effects_onto_yuv444p(Yuv444p surface, Effect_Cache *cache, Glyph_Cache *glyphs, const char *text, int x, int y) {
+  if (!text_effects_enabled(&cache->effects)) return;
+  Text_Sprite *sprite = effect_cache_get(cache, glyphs, text);
+  int offset = cache->effects.shadow_offset;
+  slap_onto_yuv444p(surface, &sprite->shadow, cache->effects.shadow_color, x + sprite->x + offset, y + sprite->y + offset);
+  slap_onto_yuv444p(surface, &sprite->outline, cache->effects.outline_color, x + sprite->x, y + sprite->y);
+}
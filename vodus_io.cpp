@@ -0,0 +1,473 @@
+// * ###################################################################
+// * Frame writer
+// * ###################################################################
+
+// * The compress stages only compress the frames to memory. The files are
+// * created and written by a single I/O thread that takes the compressed
+// * frames in batches, so the disk latency never stalls the compression
+// * and thousands of small writes turn into a few submissions.
+// *
+// * With io_uring (Linux, built with -DVODUS_IO_URING) every frame of a
+// * batch is an openat -> write -> close chain on a direct descriptor and
+// * the whole batch is one io_uring_submit. Everywhere else, or when the
+// * kernel says no, the batch is written with plain open/write/close.
+// * With an archive (vodus_archive.cpp) the batch is one writev instead.
+
+#ifdef VODUS_IO_URING
+#include <liburing.h>
+#endif
+
+#include <fcntl.h>
+
+constexpr size_t IO_QUEUE_CAPACITY = 256;
+constexpr size_t IO_BATCH_CAPACITY = 64;
+constexpr size_t IO_FILE_PATH_CAPA = 256;
+
+struct Encoded_Frame {
+  size_t index;
+  uint8_t *data;
+  size_t size;
+};
+
+// * Compresses the image into a malloc-ed buffer
+Encoded_Frame encode_image32_as_png(Image32 image32, size_t index) {
+  png_image pimage;
+  memset(&pimage, 0, sizeof(png_image));
+  pimage.opaque = NULL;
+  pimage.width = (png_uint_32)image32.width;
+  pimage.height = (png_uint_32)image32.height;
+  pimage.version = PNG_IMAGE_VERSION;
+  pimage.format = PNG_FORMAT_RGBA;
+
+  png_alloc_size_t size = PNG_IMAGE_PNG_SIZE_MAX(pimage);
+  uint8_t *data = (uint8_t *)malloc(size);
+  assert(data);
+
+  int convert_to_8bit = 0;
+  png_int_32 row_stride = image32.stride * 4;
+  if (!png_image_write_to_memory(&pimage, data, &size, convert_to_8bit, image32.pixels, row_stride, nullptr)) {
+    fprintf(stderr, "could not compress frame %zu: %s\n", index, pimage.message);
+    exit(1);
+  }
+
+  // * give back the rest of the worst case estimate
+  uint8_t *shrunk = (uint8_t *)realloc(data, size);
+  Encoded_Frame frame = {index, shrunk ? shrunk : data, size};
+  return frame;
+}
+
+// * https://qoiformat.org/qoi-specification.pdf
+// * A few times faster to encode than PNG at a slightly bigger size
+
+constexpr uint8_t QOI_OP_INDEX = 0x00;
+constexpr uint8_t QOI_OP_DIFF = 0x40;
+constexpr uint8_t QOI_OP_LUMA = 0x80;
+constexpr uint8_t QOI_OP_RUN = 0xc0;
+constexpr uint8_t QOI_OP_RGB = 0xfe;
+constexpr uint8_t QOI_OP_RGBA = 0xff;
+
+void qoi_write_u32(uint8_t *data, size_t *size, uint32_t x) {
+  data[(*size)++] = (uint8_t)(x >> 24);
+  data[(*size)++] = (uint8_t)(x >> 16);
+  data[(*size)++] = (uint8_t)(x >> 8);
+  data[(*size)++] = (uint8_t)x;
+}
+
+Encoded_Frame encode_image32_as_qoi(Image32 image32, size_t index) {
+  // * header + the worst case of QOI_OP_RGBA for every pixel + the end marker
+  size_t capacity = 14 + (size_t)image32.width * (size_t)image32.height * 5 + 8;
+  uint8_t *data = (uint8_t *)malloc(capacity);
+  assert(data);
+
+  size_t size = 0;
+  memcpy(data, "qoif", 4);
+  size += 4;
+  qoi_write_u32(data, &size, (uint32_t)image32.width);
+  qoi_write_u32(data, &size, (uint32_t)image32.height);
+  data[size++] = 4; // * channels
+  data[size++] = 0; // * sRGB with linear alpha
+
+  Pixels32 seen[64] = {};
+  Pixels32 prev = {0, 0, 0, 255};
+  int run = 0;
+
+  for (int y = 0; y < image32.height; ++y) {
+    for (int x = 0; x < image32.width; ++x) {
+      Pixels32 pixel = image32.pixels[y * image32.stride + x];
+
+      if (memcmp(&pixel, &prev, sizeof(pixel)) == 0) {
+        run += 1;
+        if (run == 62) {
+          data[size++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run > 0) {
+        data[size++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+        run = 0;
+      }
+
+      int hash = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+      if (memcmp(&seen[hash], &pixel, sizeof(pixel)) == 0) {
+        data[size++] = (uint8_t)(QOI_OP_INDEX | hash);
+      } else {
+        seen[hash] = pixel;
+
+        if (pixel.a == prev.a) {
+          int8_t dr = (int8_t)(pixel.r - prev.r);
+          int8_t dg = (int8_t)(pixel.g - prev.g);
+          int8_t db = (int8_t)(pixel.b - prev.b);
+          int8_t dr_dg = (int8_t)(dr - dg);
+          int8_t db_dg = (int8_t)(db - dg);
+
+          if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+            data[size++] = (uint8_t)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+          } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+            data[size++] = (uint8_t)(QOI_OP_LUMA | (dg + 32));
+            data[size++] = (uint8_t)((dr_dg + 8) << 4 | (db_dg + 8));
+          } else {
+            data[size++] = QOI_OP_RGB;
+            data[size++] = pixel.r;
+            data[size++] = pixel.g;
+            data[size++] = pixel.b;
+          }
+        } else {
+          data[size++] = QOI_OP_RGBA;
+          data[size++] = pixel.r;
+          data[size++] = pixel.g;
+          data[size++] = pixel.b;
+          data[size++] = pixel.a;
+        }
+      }
+
+      prev = pixel;
+    }
+  }
+
+  if (run > 0) {
+    data[size++] = (uint8_t)(QOI_OP_RUN | (run - 1));
+  }
+  memcpy(data + size, "\0\0\0\0\0\0\0\1", 8);
+  size += 8;
+
+  uint8_t *shrunk = (uint8_t *)realloc(data, size);
+  Encoded_Frame frame = {index, shrunk ? shrunk : data, size};
+  return frame;
+}
+
+Encoded_Frame encode_image32_as_raw(Image32 image32, size_t index) {
+  size_t row_size = sizeof(Pixels32) * (size_t)image32.width;
+  size_t size = row_size * (size_t)image32.height;
+  uint8_t *data = (uint8_t *)malloc(size);
+  assert(data);
+
+  for (int y = 0; y < image32.height; ++y) {
+    memcpy(data + row_size * (size_t)y, image32.pixels + y * image32.stride, row_size);
+  }
+
+  Encoded_Frame frame = {index, data, size};
+  return frame;
+}
+
+// * The result is counted as MEMORY_COMPRESSED until the frame writer
+// * frees it
+Encoded_Frame encode_image32(Image32 image32, size_t index, Archive_Format format) {
+  Encoded_Frame frame = {};
+  switch (format) {
+  case ARCHIVE_FORMAT_PNG: frame = encode_image32_as_png(image32, index); break;
+  case ARCHIVE_FORMAT_QOI: frame = encode_image32_as_qoi(image32, index); break;
+  case ARCHIVE_FORMAT_RAW: frame = encode_image32_as_raw(image32, index); break;
+  default:
+    assert(0 && "unreachable: format is checked on the start up");
+    exit(1);
+  }
+  memory_track_alloc(MEMORY_COMPRESSED, frame.size);
+  return frame;
+}
+
+struct Io_Queue {
+  Encoded_Frame frames[IO_QUEUE_CAPACITY];
+  size_t begin;
+  size_t size;
+  bool closed;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+void io_queue_init(Io_Queue *queue) {
+  memset(queue, 0, sizeof(*queue));
+  pthread_mutex_init(&queue->mutex, nullptr);
+  pthread_cond_init(&queue->not_empty, nullptr);
+  pthread_cond_init(&queue->not_full, nullptr);
+}
+
+// * Blocks while the I/O thread is behind
+void io_queue_push(Io_Queue *queue, Encoded_Frame frame) {
+  pthread_mutex_lock(&queue->mutex);
+  defer(pthread_mutex_unlock(&queue->mutex));
+
+  while (queue->size >= IO_QUEUE_CAPACITY) {
+    pthread_cond_wait(&queue->not_full, &queue->mutex);
+  }
+  queue->frames[(queue->begin + queue->size) % IO_QUEUE_CAPACITY] = frame;
+  queue->size += 1;
+  pthread_cond_signal(&queue->not_empty);
+}
+
+// * No more frames are coming, the I/O thread finishes after the last batch
+void io_queue_close(Io_Queue *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  queue->closed = true;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+// * Waits for at least one frame and takes everything available up to
+// * capacity. Returns 0 only when the queue is closed and drained.
+size_t io_queue_pop_batch(Io_Queue *queue, Encoded_Frame *batch, size_t capacity) {
+  pthread_mutex_lock(&queue->mutex);
+  defer(pthread_mutex_unlock(&queue->mutex));
+
+  while (queue->size == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->not_empty, &queue->mutex);
+  }
+
+  size_t count = 0;
+  while (queue->size > 0 && count < capacity) {
+    batch[count++] = queue->frames[queue->begin];
+    queue->begin = (queue->begin + 1) % IO_QUEUE_CAPACITY;
+    queue->size -= 1;
+  }
+  pthread_cond_broadcast(&queue->not_full);
+  return count;
+}
+
+void frame_file_path(char *file_path, size_t index) {
+  snprintf(file_path, IO_FILE_PATH_CAPA, "output/frame-%05zu.png", index);
+}
+
+void write_batch_with_syscalls(Encoded_Frame *batch, size_t count) {
+  char file_path[IO_FILE_PATH_CAPA];
+
+  for (size_t i = 0; i < count; ++i) {
+    frame_file_path(file_path, batch[i].index);
+    int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+      exit(1);
+    }
+
+    size_t written = 0;
+    while (written < batch[i].size) {
+      ssize_t n = write(fd, batch[i].data + written, batch[i].size - written);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        fprintf(stderr, "could not write %s: %s\n", file_path, strerror(errno));
+        exit(1);
+      }
+      written += (size_t)n;
+    }
+
+    close(fd);
+  }
+}
+
+#ifdef VODUS_IO_URING
+
+// * user_data of the completions: frame in the batch * 3 + the operation
+enum Io_Op {
+  IO_OP_OPEN = 0,
+  IO_OP_WRITE,
+  IO_OP_CLOSE,
+  COUNT_IO_OPS,
+};
+
+struct Io_Ring {
+  bool enabled;
+  struct io_uring ring;
+  char file_paths[IO_BATCH_CAPACITY][IO_FILE_PATH_CAPA];
+};
+
+void io_ring_init(Io_Ring *ring) {
+  memset(ring, 0, sizeof(*ring));
+
+  int ret = io_uring_queue_init(IO_BATCH_CAPACITY * COUNT_IO_OPS, &ring->ring, 0);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring is not available (%s), falling back to write()\n", strerror(-ret));
+    return;
+  }
+
+  // * one direct descriptor slot per frame of the batch
+  int files[IO_BATCH_CAPACITY];
+  for (size_t i = 0; i < IO_BATCH_CAPACITY; ++i) files[i] = -1;
+  ret = io_uring_register_files(&ring->ring, files, IO_BATCH_CAPACITY);
+  if (ret < 0) {
+    fprintf(stderr, "could not register io_uring files (%s), falling back to write()\n", strerror(-ret));
+    io_uring_queue_exit(&ring->ring);
+    return;
+  }
+
+  ring->enabled = true;
+}
+
+void io_ring_destroy(Io_Ring *ring) {
+  if (ring->enabled) {
+    io_uring_queue_exit(&ring->ring);
+    ring->enabled = false;
+  }
+}
+
+// * Returns false if the kernel does not support the operations, the batch
+// * is not written then
+bool write_batch_with_io_uring(Io_Ring *ring, Encoded_Frame *batch, size_t count) {
+  assert(count <= IO_BATCH_CAPACITY);
+
+  for (size_t i = 0; i < count; ++i) {
+    frame_file_path(ring->file_paths[i], batch[i].index);
+    unsigned slot = (unsigned)i;
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+    io_uring_prep_openat_direct(sqe, AT_FDCWD, ring->file_paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644, slot);
+    sqe->flags |= IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, i * COUNT_IO_OPS + IO_OP_OPEN);
+
+    sqe = io_uring_get_sqe(&ring->ring);
+    io_uring_prep_write(sqe, (int)slot, batch[i].data, (unsigned)batch[i].size, 0);
+    sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    io_uring_sqe_set_data64(sqe, i * COUNT_IO_OPS + IO_OP_WRITE);
+
+    sqe = io_uring_get_sqe(&ring->ring);
+    io_uring_prep_close_direct(sqe, slot);
+    io_uring_sqe_set_data64(sqe, i * COUNT_IO_OPS + IO_OP_CLOSE);
+  }
+
+  unsigned expected = (unsigned)(count * COUNT_IO_OPS);
+  int ret = io_uring_submit_and_wait(&ring->ring, expected);
+  if (ret < 0) {
+    fprintf(stderr, "could not submit to io_uring: %s\n", strerror(-ret));
+    exit(1);
+  }
+
+  bool unsupported = false;
+  for (unsigned i = 0; i < expected; ++i) {
+    struct io_uring_cqe *cqe = nullptr;
+    ret = io_uring_wait_cqe(&ring->ring, &cqe);
+    if (ret < 0) {
+      fprintf(stderr, "could not wait for io_uring: %s\n", strerror(-ret));
+      exit(1);
+    }
+
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    size_t frame = (size_t)(data / COUNT_IO_OPS);
+    Io_Op op = (Io_Op)(data % COUNT_IO_OPS);
+    int res = cqe->res;
+    io_uring_cqe_seen(&ring->ring, cqe);
+
+    if (res == -EINVAL || res == -EOPNOTSUPP || res == -EBADF) {
+      // * old kernel without direct descriptors
+      unsupported = true;
+    } else if (res == -ECANCELED) {
+      // * the rest of a failed chain, the failure itself is reported
+    } else if (res < 0) {
+      fprintf(stderr, "could not write %s: %s\n", ring->file_paths[frame], strerror(-res));
+      exit(1);
+    } else if (op == IO_OP_WRITE && (size_t)res != batch[frame].size) {
+      fprintf(stderr, "could not write %s: short write\n", ring->file_paths[frame]);
+      exit(1);
+    }
+  }
+
+  if (unsupported) {
+    fprintf(stderr, "io_uring does not support direct descriptors, falling back to write()\n");
+    io_ring_destroy(ring);
+    return false;
+  }
+  return true;
+}
+
+#endif // VODUS_IO_URING
+
+struct Frame_Writer {
+  Io_Queue queue;
+  pthread_t thread;
+  bool use_io_uring;
+  // * appends the frames here instead of output/*.png if not nullptr
+  Archive_Writer *archive;
+  size_t batches_count;
+  size_t frames_count;
+};
+
+void write_batch_to_archive(Archive_Writer *archive, Encoded_Frame *batch, size_t count) {
+  size_t indices[IO_BATCH_CAPACITY];
+  uint8_t *data[IO_BATCH_CAPACITY];
+  size_t sizes[IO_BATCH_CAPACITY];
+  for (size_t i = 0; i < count; ++i) {
+    indices[i] = batch[i].index;
+    data[i] = batch[i].data;
+    sizes[i] = batch[i].size;
+  }
+  archive_writer_append(archive, indices, data, sizes, count);
+}
+
+void *frame_writer_routine(void *arg) {
+  Frame_Writer *writer = (Frame_Writer *)arg;
+  Encoded_Frame batch[IO_BATCH_CAPACITY];
+
+#ifdef VODUS_IO_URING
+  Io_Ring ring;
+  if (writer->use_io_uring && writer->archive == nullptr) {
+    io_ring_init(&ring);
+  } else {
+    memset(&ring, 0, sizeof(ring));
+  }
+  defer(io_ring_destroy(&ring));
+#endif
+
+  for (;;) {
+    size_t count = io_queue_pop_batch(&writer->queue, batch, IO_BATCH_CAPACITY);
+    if (count == 0) {
+      return nullptr;
+    }
+
+    bool written = false;
+    if (writer->archive) {
+      write_batch_to_archive(writer->archive, batch, count);
+      written = true;
+    }
+#ifdef VODUS_IO_URING
+    if (!written && ring.enabled) {
+      written = write_batch_with_io_uring(&ring, batch, count);
+    }
+#endif
+    if (!written) {
+      write_batch_with_syscalls(batch, count);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      free(batch[i].data);
+      memory_track_free(MEMORY_COMPRESSED, batch[i].size);
+    }
+    writer->batches_count += 1;
+    writer->frames_count += count;
+  }
+}
+
+void frame_writer_start(Frame_Writer *writer, bool use_io_uring, Archive_Writer *archive) {
+  io_queue_init(&writer->queue);
+  writer->use_io_uring = use_io_uring;
+  writer->archive = archive;
+  writer->batches_count = 0;
+  writer->frames_count = 0;
+  pthread_create(&writer->thread, nullptr, frame_writer_routine, writer);
+}
+
+// * Writes everything that is still queued and stops the I/O thread
+void frame_writer_finish(Frame_Writer *writer) {
+  io_queue_close(&writer->queue);
+  pthread_join(writer->thread, nullptr);
+  printf("Wrote %zu frames in %zu batches\n", writer->frames_count, writer->batches_count);
+}
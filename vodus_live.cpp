@@ -0,0 +1,455 @@
+// * ###################################################################
+// * Live mode
+// * ###################################################################
+
+// * Follows a chat that is happening right now instead of rendering fixed
+// * inputs. Every line that comes from stdin or from a client of the local
+// * socket is a chat message. Frames are produced on a wall clock schedule
+// * at VODUS_FPS:
+// *
+// * - all the messages that arrived since the previous frame land in the
+// *   next frame together (coalescing),
+// * - a frame whose chat did not change is not rendered at all, the
+// *   archive repeats the previous frame in its place, unless the animated
+// *   emote on it moved to its next image,
+// * - when rendering falls behind, the ticks that are already in the past
+// *   are skipped instead of being rendered late (missed deadlines),
+// * - a frame that waited in the channel longer than the latency budget is
+// *   dropped by the compress stages (see Channel::deadline).
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+constexpr size_t LIVE_MESSAGES_CAPACITY = 64;
+constexpr uint64_t LIVE_DEFAULT_BUDGET_MS = 500;
+// * an hour, the budget is turned into nanoseconds
+constexpr long long LIVE_MAX_BUDGET_MS = 3600000;
+constexpr uint64_t LIVE_STATS_PERIOD_NS = 5000000000ULL;
+// * the channel holds no more than a budget of frames, the older ones
+// * expire anyway
+constexpr size_t LIVE_FRAMES_CAPACITY = 1024;
+// * the text caches are swept no earlier than at this many entries
+constexpr size_t LIVE_SWEEP_MIN_TEXTS = 4 * LIVE_MESSAGES_CAPACITY;
+
+struct Chat_Event {
+  char *text;
+  uint64_t arrival;
+};
+
+// * Filled by the reader thread, drained by the renderer on every tick
+struct Chat_Inbox {
+  pthread_mutex_t mutex;
+  Chat_Event *events;
+  size_t count;
+  size_t capacity;
+  // * the source is exhausted (EOF of stdin)
+  bool closed;
+};
+
+void chat_inbox_push(Chat_Inbox *inbox, const char *text, size_t size) {
+  Chat_Event event = {};
+  event.text = (char *)malloc(size + 1);
+  assert(event.text);
+  memcpy(event.text, text, size);
+  event.text[size] = '\0';
+  event.arrival = monotonic_ns();
+
+  pthread_mutex_lock(&inbox->mutex);
+  defer(pthread_mutex_unlock(&inbox->mutex));
+
+  if (inbox->count >= inbox->capacity) {
+    inbox->capacity = inbox->capacity == 0 ? 64 : inbox->capacity * 2;
+    inbox->events = (Chat_Event *)realloc(inbox->events, sizeof(Chat_Event) * inbox->capacity);
+    assert(inbox->events);
+  }
+  inbox->events[inbox->count++] = event;
+}
+
+void chat_inbox_close(Chat_Inbox *inbox) {
+  pthread_mutex_lock(&inbox->mutex);
+  inbox->closed = true;
+  pthread_mutex_unlock(&inbox->mutex);
+}
+
+// * Moves the pending events into events (which has to hold capacity of
+// * them) and returns how many. The rest stays for the next tick.
+size_t chat_inbox_take(Chat_Inbox *inbox, Chat_Event *events, size_t capacity, bool *closed) {
+  pthread_mutex_lock(&inbox->mutex);
+  defer(pthread_mutex_unlock(&inbox->mutex));
+
+  size_t count = std::min(inbox->count, capacity);
+  memcpy(events, inbox->events, sizeof(Chat_Event) * count);
+  memmove(inbox->events, inbox->events + count, sizeof(Chat_Event) * (inbox->count - count));
+  inbox->count -= count;
+  *closed = inbox->closed && inbox->count == 0;
+  return count;
+}
+
+// * Every line is a message, empty lines are ignored
+void read_chat_lines(Chat_Inbox *inbox, int fd) {
+  FILE *stream = fdopen(fd, "r");
+  if (!stream) {
+    fprintf(stderr, "could not read the chat: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  char *line = nullptr;
+  size_t line_capacity = 0;
+  ssize_t size;
+  while ((size = getline(&line, &line_capacity, stream)) >= 0) {
+    while (size > 0 && (line[size - 1] == '\n' || line[size - 1] == '\r')) size -= 1;
+    if (size > 0) {
+      chat_inbox_push(inbox, line, (size_t)size);
+    }
+  }
+
+  free(line);
+  fclose(stream);
+}
+
+struct Live_Source {
+  Chat_Inbox *inbox;
+  // * "-" is stdin, anything else is the path of a unix socket to listen on
+  const char *path;
+};
+
+void *live_reader_routine(void *arg) {
+  Live_Source *source = (Live_Source *)arg;
+
+  if (strcmp(source->path, "-") == 0) {
+    read_chat_lines(source->inbox, STDIN_FILENO);
+    chat_inbox_close(source->inbox);
+    return nullptr;
+  }
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    fprintf(stderr, "could not create a socket: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(source->path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path %s is too long\n", source->path);
+    exit(1);
+  }
+  strcpy(address.sun_path, source->path);
+  unlink(source->path);
+
+  if (bind(server, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(server, 1) < 0) {
+    fprintf(stderr, "could not listen on %s: %s\n", source->path, strerror(errno));
+    exit(1);
+  }
+  printf("Listening for the chat on %s\n", source->path);
+
+  // * The clients come one after another, `nc -U <path>` is enough.
+  // * The socket never runs dry, the live mode is stopped by SIGINT or --frames.
+  for (;;) {
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "could not accept on %s: %s\n", source->path, strerror(errno));
+      exit(1);
+    }
+    read_chat_lines(source->inbox, client);
+  }
+}
+
+struct Live_Chat {
+  // * ring of the latest messages, the newest one is at the bottom
+  char *messages[LIVE_MESSAGES_CAPACITY];
+  size_t begin;
+  size_t count;
+};
+
+void live_chat_push(Live_Chat *chat, char *text) {
+  if (chat->count == LIVE_MESSAGES_CAPACITY) {
+    free(chat->messages[chat->begin]);
+    chat->begin = (chat->begin + 1) % LIVE_MESSAGES_CAPACITY;
+    chat->count -= 1;
+  }
+  chat->messages[(chat->begin + chat->count) % LIVE_MESSAGES_CAPACITY] = text;
+  chat->count += 1;
+}
+
+// * i == 0 is the newest message
+const char *live_chat_message(const Live_Chat *chat, size_t i) {
+  return chat->messages[(chat->begin + chat->count - 1 - i) % LIVE_MESSAGES_CAPACITY];
+}
+
+// * The shaped texts and the effect sprites of the messages that scrolled
+// * out of the chat are dropped once the caches hold twice as many texts as
+// * after the previous sweep, so an endless chat keeps them bounded and the
+// * sweeps cost O(1) per message. Called between the frames, when nothing
+// * reads the caches.
+void live_chat_sweep(Renderer *renderer, const Live_Chat *chat, size_t *sweep_at) {
+  Shape_Cache *shapes = &renderer->glyphs->shapes;
+  Effect_Cache *effects = renderer->effects;
+  if (std::max(shapes->count, effects->count) < std::max(*sweep_at, LIVE_SWEEP_MIN_TEXTS)) return;
+
+  int pixel_size = renderer->glyphs->fonts.pixel_size;
+  const char *texts[LIVE_MESSAGES_CAPACITY];
+  uint64_t hashes[LIVE_MESSAGES_CAPACITY];
+  for (size_t i = 0; i < chat->count; ++i) {
+    texts[i] = live_chat_message(chat, i);
+    hashes[i] = hash_text(texts[i], strlen(texts[i]), pixel_size);
+  }
+  shape_cache_retain(shapes, pixel_size, texts, hashes, chat->count);
+  effect_cache_retain(effects, pixel_size, texts, hashes, chat->count);
+  *sweep_at = 2 * std::max(shapes->count, effects->count);
+}
+
+// * Whether the code is one of the space separated words of the text
+bool chat_message_has_emote(const char *text, const char *code) {
+  if (code == nullptr) return false;
+  size_t size = strlen(code);
+  for (const char *word = strstr(text, code); word; word = strstr(word + 1, code)) {
+    if ((word == text || word[-1] == ' ') && (word[size] == '\0' || word[size] == ' ')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// * The newest messages that fit onto the frame
+size_t live_chat_visible(const Renderer *renderer, const Live_Chat *chat) {
+  int line_height = renderer->text_size * 5 / 4;
+  int first_y = VODUS_HEIGHT - renderer->text_size / 2;
+  size_t lines = first_y > 0 ? (size_t)((first_y - 1) / line_height) + 1 : 0;
+  return std::min(chat->count, lines);
+}
+
+// * Whether any message on the frame shows the animated emote, only then
+// * the frames change without new messages
+bool live_chat_animated(const Renderer *renderer, const Live_Chat *chat) {
+  if (renderer->gif == nullptr) return false;
+  size_t visible = live_chat_visible(renderer, chat);
+  for (size_t i = 0; i < visible; ++i) {
+    if (chat_message_has_emote(live_chat_message(chat, i), renderer->gif_code)) return true;
+  }
+  return false;
+}
+
+// * The animated emote is taken from the phase, so all its instances on the
+// * frame show the same image without looking it up again
+void render_live_chat_scene(Renderer *renderer, Image32_View surface, const Live_Chat *chat, Animation_Phase phase) {
+  fill_image32_with_color(surface, {50, 50, 50, 255});
+
+  Pixels32 color = {255, 0, 0, 255};
+  int line_height = renderer->text_size * 5 / 4;
+  int y = VODUS_HEIGHT - renderer->text_size / 2;
+  size_t visible = live_chat_visible(renderer, chat);
+  for (size_t i = 0; i < visible; ++i, y -= line_height) {
+    const char *text = live_chat_message(chat, i);
+
+    // * the emotes stand on the baseline, the text goes after them
+    int x = 0;
+    if (chat_message_has_emote(text, renderer->emote_code)) {
+      Image32 *emote = renderer_emote(renderer);
+      slap_onto_image32(surface, emote, x, y - emote->height);
+      x += emote->width + renderer->text_size / 4;
+    }
+    if (phase.gif && chat_message_has_emote(text, renderer->gif_code)) {
+      slap_onto_image32(surface, phase.gif, x, y - phase.gif->height);
+      x += phase.gif->width + renderer->text_size / 4;
+    }
+
+    if (renderer->sdf) {
+      slap_sdf_text_onto_image32(surface, renderer->sdf, text, renderer->text_size, color, x, y);
+    } else {
+      slap_text_effects_onto_image32(surface, renderer->effects, renderer->glyphs, text, x, y);
+      slap_text_onto_image32(surface, renderer->glyphs, text, color, x, y);
+    }
+  }
+}
+
+void render_live_chat(Renderer *renderer, Image32_View surface, const Live_Chat *chat, Animation_Phase phase) {
+  if (renderer->bands == nullptr || renderer->bands->count <= 1) {
+    render_live_chat_scene(renderer, surface, chat, phase);
+    return;
+  }
+
+  // * The bands only read the glyph, shape and effect caches
+  for (size_t i = 0; i < chat->count; ++i) {
+    renderer_load_text(renderer, live_chat_message(chat, i));
+  }
+  band_pool_run(renderer->bands, [&](size_t band, size_t count) {
+    render_live_chat_scene(renderer, band_of(surface, band, count), chat, phase);
+  });
+}
+
+struct Live_Stats {
+  size_t ticks;
+  size_t rendered;
+  // * ticks without any change of the chat
+  size_t coalesced;
+  // * ticks skipped because the renderer was late
+  size_t missed;
+
+  size_t events;
+  uint64_t latency_sum;
+  uint64_t latency_max;
+
+  size_t queue_depth_sum;
+  size_t queue_depth_max;
+};
+
+// * expired is the amount over the whole run
+void live_stats_print(const Live_Stats *stats, const char *prefix, size_t expired) {
+  double latency_avg = stats->events > 0 ? (double)stats->latency_sum / (double)stats->events / 1e6 : 0.0;
+  double queue_depth_avg = stats->ticks > 0 ? (double)stats->queue_depth_sum / (double)stats->ticks : 0.0;
+  printf("%s: %zu ticks, %zu rendered, %zu unchanged, %zu missed deadlines, %zu expired in the channel; "
+         "%zu events, event to frame avg %.2fms max %.2fms; channel depth avg %.1f max %zu\n",
+         prefix, stats->ticks, stats->rendered, stats->coalesced, stats->missed, expired,
+         stats->events, latency_avg, (double)stats->latency_max / 1e6,
+         queue_depth_avg, stats->queue_depth_max);
+}
+
+void live_stats_merge(Live_Stats *total, const Live_Stats *stats) {
+  total->ticks += stats->ticks;
+  total->rendered += stats->rendered;
+  total->coalesced += stats->coalesced;
+  total->missed += stats->missed;
+  total->events += stats->events;
+  total->latency_sum += stats->latency_sum;
+  total->latency_max = std::max(total->latency_max, stats->latency_max);
+  total->queue_depth_sum += stats->queue_depth_sum;
+  total->queue_depth_max = std::max(total->queue_depth_max, stats->queue_depth_max);
+}
+
+std::atomic<bool> live_interrupted(false);
+
+void live_interrupt_handler(int) {
+  live_interrupted.store(true);
+}
+
+// * Renders the frames on the main thread (the worker 0 of the scheduler)
+// * for the compress stages until the source is exhausted, SIGINT or
+// * frames_end (if it is not 0). Returns the index after the last tick.
+size_t run_live(Scheduler *scheduler, Renderer *renderer, const char *source_path, size_t frames_end,
+                uint64_t budget_ns, size_t compress_stages_count) {
+  // * The reader may be blocked in accept() or read() forever and keeps
+  // * pushing into the inbox after the return, so both of them are never
+  // * freed
+  Chat_Inbox *inbox = new Chat_Inbox();
+  pthread_mutex_init(&inbox->mutex, nullptr);
+
+  Live_Source *source = new Live_Source{inbox, source_path};
+  pthread_t reader;
+  pthread_create(&reader, nullptr, live_reader_routine, source);
+  pthread_detach(reader);
+
+  signal(SIGINT, live_interrupt_handler);
+
+  Live_Chat chat = {};
+  // * stats of the current report period and of the whole run
+  Live_Stats stats = {};
+  Live_Stats total = {};
+  Chat_Event events[LIVE_MESSAGES_CAPACITY];
+
+  const uint64_t period = 1000000000ULL / VODUS_FPS;
+
+  // * the live loop is the only sender and never waits for the channel
+  Channel<Frame> frames;
+  size_t capacity = (size_t)std::min(budget_ns / period + 1, (uint64_t)LIVE_FRAMES_CAPACITY);
+  channel_init(&frames, scheduler, capacity, 1, drop_frame);
+  frames.deadline = frame_deadline;
+  for (size_t i = 0; i < compress_stages_count; ++i) {
+    pipeline_spawn(scheduler, compress_stage(&frames));
+  }
+
+  const uint64_t start = monotonic_ns();
+  uint64_t last_report = start;
+
+  size_t tick = 0;
+  size_t previous_gif_index = 0;
+  size_t sweep_at = 0;
+  for (;;) {
+    uint64_t tick_time = start + tick * period;
+    struct timespec wake_up = {(time_t)(tick_time / 1000000000ULL), (long)(tick_time % 1000000000ULL)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_up, nullptr) == EINTR) {
+      if (live_interrupted.load()) break;
+    }
+
+    bool closed = false;
+    size_t events_count = chat_inbox_take(inbox, events, LIVE_MESSAGES_CAPACITY, &closed);
+    for (size_t i = 0; i < events_count; ++i) {
+      // * the chat owns the text from now on
+      live_chat_push(&chat, events[i].text);
+    }
+
+    // * the animation runs on the time of the ticks, not the wall clock,
+    // * so the frames do not depend on how late they are rendered
+    Animation_Phase phase = animation_phase_at(renderer->gif, tick * 1000 / VODUS_FPS);
+    bool animated = live_chat_animated(renderer, &chat) && phase.gif_index != previous_gif_index;
+    previous_gif_index = phase.gif_index;
+
+    stats.ticks += 1;
+    if (tick == 0 || events_count > 0 || animated) {
+      // * time spent here shows up as missed deadlines
+      memory_wait_for_room(sizeof(Pixels32) * VODUS_WIDTH * VODUS_HEIGHT);
+      Image32 surface = {
+          .height = VODUS_HEIGHT,
+          .width = VODUS_WIDTH,
+          .pixels = frame_pixels_alloc(),
+          .stride = VODUS_WIDTH};
+      render_live_chat(renderer, image32_view(surface), &chat, phase);
+
+      uint64_t rendered = monotonic_ns();
+      for (size_t i = 0; i < events_count; ++i) {
+        uint64_t latency = rendered - events[i].arrival;
+        stats.latency_sum += latency;
+        stats.latency_max = std::max(stats.latency_max, latency);
+      }
+      stats.events += events_count;
+      stats.rendered += 1;
+
+      channel_push_or_drop_oldest(&frames, Frame{tick, surface, tick_time + budget_ns});
+      live_chat_sweep(renderer, &chat, &sweep_at);
+    } else {
+      stats.coalesced += 1;
+    }
+
+    size_t depth = channel_size(&frames);
+    stats.queue_depth_sum += depth;
+    stats.queue_depth_max = std::max(stats.queue_depth_max, depth);
+
+    if (closed || live_interrupted.load() || (frames_end != 0 && tick + 1 >= frames_end)) {
+      break;
+    }
+
+    // * The ticks that are already over are not worth rendering anymore,
+    // * the next frame shows everything they would have shown
+    uint64_t now = monotonic_ns();
+    size_t next = tick + 1;
+    size_t due = (size_t)((now - start) / period);
+    if (due > next) {
+      stats.missed += due - next;
+      next = std::min(due, frames_end != 0 ? frames_end - 1 : due);
+    }
+    tick = next;
+
+    if (now - last_report >= LIVE_STATS_PERIOD_NS) {
+      live_stats_print(&stats, "Live", channel_expired_count(&frames));
+      live_stats_merge(&total, &stats);
+      stats = {};
+      last_report = now;
+    }
+  }
+
+  signal(SIGINT, SIG_DFL);
+
+  // * the compress stages take what is left, the main thread helps them
+  channel_sender_done(&frames);
+  scheduler_wait_jobs(scheduler, 1);
+  live_stats_merge(&total, &stats);
+  live_stats_print(&total, "Live total", channel_expired_count(&frames));
+  channel_destroy(&frames);
+
+  for (size_t i = 0; i < chat.count; ++i) {
+    free(chat.messages[(chat.begin + i) % LIVE_MESSAGES_CAPACITY]);
+  }
+  return tick + 1;
+}
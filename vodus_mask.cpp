@@ -0,0 +1,124 @@
+// * ###################################################################
+// * Run length encoded coverage masks
+// * ###################################################################
+
+// * A rasterized glyph is mostly pixels with no coverage around the
+// * outline and fully covered pixels inside of it, only the antialiased
+// * edges are in between. The cached glyphs carry their coverage split into
+// * runs of those three kinds per row, so slapping them skips the empty
+// * runs, stores the color into the solid ones and blends only the edges.
+// * Both shortcuts give exactly what the blend gives for the coverage of 0
+// * and 255, so the output does not change.
+
+enum Mask_Run_Kind : uint8_t {
+  MASK_RUN_SKIP = 0,
+  MASK_RUN_SOLID,
+  MASK_RUN_PARTIAL,
+};
+
+struct Mask_Run {
+  Mask_Run_Kind kind;
+  uint16_t length;
+};
+
+struct Mask {
+  // * the coverage itself, read by the partial runs
+  FT_Bitmap bitmap;
+  // * the runs of row r are runs[row_runs[r]..row_runs[r + 1])
+  uint32_t *row_runs;
+  Mask_Run *runs;
+};
+
+Mask_Run_Kind mask_run_kind(uint8_t coverage) {
+  if (coverage == 0) return MASK_RUN_SKIP;
+  if (coverage == 255) return MASK_RUN_SOLID;
+  return MASK_RUN_PARTIAL;
+}
+
+// * Takes the ownership of the bitmap buffer
+Mask mask_from_bitmap(FT_Bitmap bitmap) {
+  assert(bitmap.pixel_mode == FT_PIXEL_MODE_GRAY);
+  assert(bitmap.num_grays == 256);
+
+  Mask mask = {};
+  mask.bitmap = bitmap;
+  mask.row_runs = (uint32_t *)malloc(sizeof(uint32_t) * (bitmap.rows + 1));
+  assert(mask.row_runs);
+
+  // * at most one run per pixel
+  size_t capacity = std::max((size_t)bitmap.rows * bitmap.width, (size_t)1);
+  mask.runs = (Mask_Run *)malloc(sizeof(Mask_Run) * capacity);
+  assert(mask.runs);
+
+  uint32_t count = 0;
+  for (unsigned int row = 0; row < bitmap.rows; ++row) {
+    mask.row_runs[row] = count;
+    const uint8_t *coverage = bitmap.buffer + row * bitmap.pitch;
+    for (unsigned int col = 0; col < bitmap.width;) {
+      Mask_Run run = {mask_run_kind(coverage[col]), 0};
+      while (col < bitmap.width && run.length < UINT16_MAX && mask_run_kind(coverage[col]) == run.kind) {
+        col += 1;
+        run.length += 1;
+      }
+      mask.runs[count++] = run;
+    }
+  }
+  mask.row_runs[bitmap.rows] = count;
+
+  // * the runs are read on every frame, the spare capacity is not
+  mask.runs = (Mask_Run *)realloc(mask.runs, sizeof(Mask_Run) * std::max(count, (uint32_t)1));
+  assert(mask.runs);
+
+  return mask;
+}
+
+size_t mask_bytes(const Mask *mask) {
+  size_t size = (size_t)mask->bitmap.pitch * mask->bitmap.rows;
+  return size + sizeof(uint32_t) * (mask->bitmap.rows + 1) + sizeof(Mask_Run) * mask->row_runs[mask->bitmap.rows];
+}
+
+void mask_free(Mask *mask) {
+  free(mask->bitmap.buffer);
+  free(mask->row_runs);
+  free(mask->runs);
+  *mask = {};
+}
+
+// * Calls f(kind, col, count) for the runs of the row clipped to
+// * [col_begin, col_end). The skip runs are not reported.
+template <typename F>
+void for_each_mask_run(Mask *mask, int row, int col_begin, int col_end, F f) {
+  int col = 0;
+  for (uint32_t i = mask->row_runs[row]; i < mask->row_runs[row + 1] && col < col_end; ++i) {
+    Mask_Run run = mask->runs[i];
+    int begin = std::max(col, col_begin);
+    int end = std::min(col + (int)run.length, col_end);
+    if (run.kind != MASK_RUN_SKIP && begin < end) {
+      f(run.kind, begin, (size_t)(end - begin));
+    }
+    col += run.length;
+  }
+}
+
+// * Slap coverage mask onto Image32
+void slap_onto_image32(Image32_View dest, Mask *src, Pixels32 color, int x, int y) {
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = std::max(0, -y);
+  int row_end = std::min((int)src->bitmap.rows, dest.height - y);
+  int col_begin = std::max(0, -x);
+  int col_end = std::min((int)src->bitmap.width, dest.width - x);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    Pixels32 *line = dest.pixels + (row + y) * dest.stride + x;
+    const uint8_t *coverage = src->bitmap.buffer + row * src->bitmap.pitch;
+    for_each_mask_run(src, row, col_begin, col_end, [&](Mask_Run_Kind kind, int col, size_t count) {
+      if (kind == MASK_RUN_SOLID) {
+        fill_pixels32.run(line + col, count, color);
+      } else {
+        blend_pixels32.run(line + col, coverage + col, count, color);
+      }
+    });
+  }
+}
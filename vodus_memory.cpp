@@ -0,0 +1,217 @@
+// * ###################################################################
+// * Memory accounting
+// * ###################################################################
+
+// * The big allocations are counted per subsystem: bytes alive right now,
+// * the peak of them and the bytes allocated over the whole run. That is
+// * enough to see which one grows during a long render, the small buffers
+// * are not counted.
+// *
+// * --memory-stats samples the resident set of the process in the
+// * background and prints everything at the end of the run.
+// * --memory-limit makes the producers of the frames wait while the counted
+// * memory is over the limit and there are frames in flight that are going
+// * to be freed, instead of queueing more of them. The stages of the PNG
+// * pipeline never wait, their channel is sized by the limit instead.
+
+#include <sys/resource.h>
+
+enum Memory_Subsystem {
+  // * rendered frames waiting for the compression
+  MEMORY_FRAMES = 0,
+  // * compressed frames waiting for the frame writer
+  MEMORY_COMPRESSED,
+  // * glyph, shape and effect caches
+  MEMORY_GLYPHS,
+  // * the png and its scaled versions
+  MEMORY_EMOTES,
+  // * what DGifSlurp decoded
+  MEMORY_GIF,
+  // * frames of the libavcodec encoder
+  MEMORY_ENCODER,
+  // * the chat log replayed by --bench
+  MEMORY_CHAT,
+  COUNT_MEMORY_SUBSYSTEMS,
+};
+
+const char *memory_subsystem_names[COUNT_MEMORY_SUBSYSTEMS] = {
+  "frames", "compressed", "glyphs", "emotes", "gif", "encoder", "chat",
+};
+
+struct Memory_Counters {
+  std::atomic<int64_t> live;
+  std::atomic<int64_t> peak;
+  std::atomic<uint64_t> allocated;
+  std::atomic<uint64_t> allocations;
+};
+
+constexpr uint64_t MEMORY_SAMPLE_PERIOD_MS = 100;
+
+struct Memory_Accounting {
+  Memory_Counters subsystems[COUNT_MEMORY_SUBSYSTEMS];
+  std::atomic<int64_t> live;
+  std::atomic<int64_t> peak;
+
+  // * 0 is no limit
+  size_t limit;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // * how often and how long the producers waited for the limit
+  std::atomic<size_t> waits;
+  std::atomic<uint64_t> wait_ns;
+
+  // * resident set of the process sampled by the sampler thread
+  bool sampling;
+  pthread_t sampler;
+  std::atomic<bool> stop_sampling;
+  std::atomic<size_t> rss_peak;
+  size_t rss_samples;
+};
+
+Memory_Accounting memory = {};
+
+void atomic_max(std::atomic<int64_t> *peak, int64_t value) {
+  int64_t current = peak->load();
+  while (value > current && !peak->compare_exchange_weak(current, value)) {}
+}
+
+void memory_track_alloc(Memory_Subsystem subsystem, size_t size) {
+  Memory_Counters *counters = &memory.subsystems[subsystem];
+  atomic_max(&counters->peak, counters->live.fetch_add((int64_t)size) + (int64_t)size);
+  counters->allocated.fetch_add(size);
+  counters->allocations.fetch_add(1);
+  atomic_max(&memory.peak, memory.live.fetch_add((int64_t)size) + (int64_t)size);
+}
+
+void memory_track_free(Memory_Subsystem subsystem, size_t size) {
+  memory.subsystems[subsystem].live.fetch_sub((int64_t)size);
+  memory.live.fetch_sub((int64_t)size);
+
+  // * under the mutex, so a producer that just found the memory over the
+  // * limit is either already waiting or sees the new value
+  if (memory.limit > 0) {
+    pthread_mutex_lock(&memory.mutex);
+    pthread_cond_broadcast(&memory.cond);
+    pthread_mutex_unlock(&memory.mutex);
+  }
+}
+
+// * Only the frames in flight are ever freed during the run, without them
+// * waiting would never end
+bool memory_over_limit(size_t size) {
+  int64_t in_flight = memory.subsystems[MEMORY_FRAMES].live.load()
+                    + memory.subsystems[MEMORY_COMPRESSED].live.load();
+  return memory.live.load() + (int64_t)size > (int64_t)memory.limit && in_flight > 0;
+}
+
+// * Called by the producers before they allocate a new frame
+void memory_wait_for_room(size_t size) {
+  if (memory.limit == 0) return;
+
+  pthread_mutex_lock(&memory.mutex);
+  defer(pthread_mutex_unlock(&memory.mutex));
+  if (!memory_over_limit(size)) return;
+
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while (memory_over_limit(size)) {
+    pthread_cond_wait(&memory.cond, &memory.mutex);
+  }
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  memory.waits.fetch_add(1);
+  memory.wait_ns.fetch_add((uint64_t)((end.tv_sec - begin.tv_sec) * 1000000000LL + (end.tv_nsec - begin.tv_nsec)));
+}
+
+// * The pixels of a whole frame, counted as MEMORY_FRAMES
+Pixels32 *frame_pixels_alloc() {
+  memory_track_alloc(MEMORY_FRAMES, sizeof(Pixels32) * VODUS_WIDTH * VODUS_HEIGHT);
+  return new Pixels32[VODUS_WIDTH * VODUS_HEIGHT];
+}
+
+void frame_pixels_free(Pixels32 *pixels) {
+  delete[] pixels;
+  memory_track_free(MEMORY_FRAMES, sizeof(Pixels32) * VODUS_WIDTH * VODUS_HEIGHT);
+}
+
+// * giflib does not tell, so it is the decoded rasters and color maps
+size_t gif_bytes(const GifFileType *gif) {
+  if (gif == nullptr) return 0;
+  size_t size = sizeof(SavedImage) * (size_t)gif->ImageCount;
+  for (int i = 0; i < gif->ImageCount; ++i) {
+    const SavedImage *image = &gif->SavedImages[i];
+    size += (size_t)image->ImageDesc.Width * (size_t)image->ImageDesc.Height;
+    if (image->ImageDesc.ColorMap) {
+      size += sizeof(GifColorType) * (size_t)image->ImageDesc.ColorMap->ColorCount;
+    }
+  }
+  return size;
+}
+
+// * 0 when there is no /proc
+size_t memory_rss() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) return 0;
+  defer(fclose(f));
+
+  unsigned long size = 0, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) return 0;
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void *memory_sampler_routine(void *) {
+  while (!memory.stop_sampling.load()) {
+    size_t rss = memory_rss();
+    if (rss > memory.rss_peak.load()) memory.rss_peak.store(rss);
+    memory.rss_samples += 1;
+
+    struct timespec period = {0, (long)(MEMORY_SAMPLE_PERIOD_MS * 1000000)};
+    nanosleep(&period, nullptr);
+  }
+  return nullptr;
+}
+
+void memory_accounting_init(size_t limit, bool sampling) {
+  memory.limit = limit;
+  pthread_mutex_init(&memory.mutex, nullptr);
+  pthread_cond_init(&memory.cond, nullptr);
+
+  memory.sampling = sampling;
+  if (sampling) {
+    pthread_create(&memory.sampler, nullptr, memory_sampler_routine, nullptr);
+  }
+}
+
+double mib(int64_t bytes) {
+  return (double)bytes / (1024.0 * 1024.0);
+}
+
+void memory_report(FILE *stream) {
+  if (memory.sampling) {
+    memory.stop_sampling.store(true);
+    pthread_join(memory.sampler, nullptr);
+    memory.sampling = false;
+  }
+
+  fprintf(stream, "Memory:\n");
+  fprintf(stream, "    %-12s %10s %10s %12s %12s\n", "subsystem", "live MiB", "peak MiB", "total MiB", "allocations");
+  for (size_t i = 0; i < COUNT_MEMORY_SUBSYSTEMS; ++i) {
+    Memory_Counters *counters = &memory.subsystems[i];
+    fprintf(stream, "    %-12s %10.2f %10.2f %12.2f %12zu\n", memory_subsystem_names[i],
+            mib(counters->live.load()), mib(counters->peak.load()),
+            mib((int64_t)counters->allocated.load()), (size_t)counters->allocations.load());
+  }
+  fprintf(stream, "    counted peak %.1f MiB", mib(memory.peak.load()));
+  if (memory.limit > 0) {
+    fprintf(stream, ", limit %.1f MiB, producers waited %zu times for %.2fs",
+            mib((int64_t)memory.limit), memory.waits.load(), (double)memory.wait_ns.load() / 1e9);
+  }
+  fprintf(stream, "\n");
+
+  // * ru_maxrss is in kilobytes on Linux
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stream, "    resident peak %.1f MiB sampled (%zu samples), %.1f MiB by the kernel\n",
+          mib((int64_t)memory.rss_peak.load()), memory.rss_samples, mib((int64_t)usage.ru_maxrss * 1024));
+}
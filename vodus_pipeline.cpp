@@ -0,0 +1,528 @@
+// * ###################################################################
+// * Coroutine pipeline
+// * ###################################################################
+
+// * A stage is a coroutine that receives from one channel and sends into
+// * the next one. The channels are bounded: a stage that sends into a full
+// * channel is suspended until the next stage takes something out of it
+// * (backpressure), a stage that receives from an empty one is suspended
+// * until something arrives. A suspended stage does not occupy a thread,
+// * the stages are resumed as tasks on the work-stealing scheduler, so any
+// * amount of stages share its workers.
+// *
+// *   render x n --> Channel<Frame> --> compress x m --> frame writer
+// *
+// * This is how the PNG and archive frames are made. In the live mode the
+// * render stages are replaced by the wall clock loop of run_live, which
+// * never waits for the channel: a full channel drops its oldest frame
+// * instead (channel_push_or_drop_oldest), and the receivers drop the
+// * frames that are past their deadline (Channel::deadline).
+// *
+// * Draining: a channel knows how many stages send into it and closes when
+// * the last of them returns, the receivers get what is left and then
+// * false. Cancelling: every send and receive returns false right away and
+// * the items left in the channel are dropped.
+
+#include <coroutine>
+#include <signal.h>
+
+struct Pipeline_Stage {
+  struct promise_type;
+  std::coroutine_handle<promise_type> handle;
+
+  // * Destroys the finished coroutine and tells the scheduler
+  struct Final_Awaiter {
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type {
+    Scheduler *scheduler;
+    // * resumes the coroutine, pushed whenever it can continue
+    Task task;
+
+    Pipeline_Stage get_return_object() {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    // * nothing runs until pipeline_spawn
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    Final_Awaiter final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {
+      fprintf(stderr, "unhandled exception in a pipeline stage\n");
+      abort();
+    }
+  };
+};
+
+void Pipeline_Stage::Final_Awaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+  Scheduler *scheduler = handle.promise().scheduler;
+  handle.destroy();
+  scheduler_job_done(scheduler);
+}
+
+void pipeline_stage_resume(Task *task, size_t worker) {
+  (void)worker;
+  std::coroutine_handle<Pipeline_Stage::promise_type>::from_address(task->context).resume();
+}
+
+// * The scheduler waits for the stage like for any other job
+void pipeline_spawn(Scheduler *scheduler, Pipeline_Stage stage) {
+  Pipeline_Stage::promise_type *promise = &stage.handle.promise();
+  promise->scheduler = scheduler;
+  promise->task.run = pipeline_stage_resume;
+  promise->task.context = stage.handle.address();
+  promise->task.pending.store(0);
+  promise->task.successor = nullptr;
+
+  scheduler_job_started(scheduler);
+  scheduler_push(scheduler, scheduler_current_worker, &promise->task);
+}
+
+template <typename T>
+struct Channel_Waiter {
+  // * the value being sent or where the received one goes
+  T *value;
+  bool ok;
+  Task *task;
+  Channel_Waiter *next;
+};
+
+template <typename T>
+struct Channel_Waiters {
+  Channel_Waiter<T> *first;
+  Channel_Waiter<T> *last;
+};
+
+template <typename T>
+void channel_waiters_push(Channel_Waiters<T> *waiters, Channel_Waiter<T> *waiter) {
+  waiter->next = nullptr;
+  if (waiters->last) {
+    waiters->last->next = waiter;
+  } else {
+    waiters->first = waiter;
+  }
+  waiters->last = waiter;
+}
+
+template <typename T>
+Channel_Waiter<T> *channel_waiters_pop(Channel_Waiters<T> *waiters) {
+  Channel_Waiter<T> *waiter = waiters->first;
+  if (waiter) {
+    waiters->first = waiter->next;
+    if (waiters->first == nullptr) waiters->last = nullptr;
+  }
+  return waiter;
+}
+
+template <typename T>
+struct Channel {
+  Scheduler *scheduler;
+  pthread_mutex_t mutex;
+
+  T *items;
+  size_t capacity;
+  size_t begin;
+  size_t size;
+
+  // * the channel closes when the last sender is done
+  size_t senders_count;
+  bool closed;
+  bool cancelled;
+
+  // * suspended on a full and on an empty channel
+  Channel_Waiters<T> senders;
+  Channel_Waiters<T> receivers;
+
+  // * frees the items left in a cancelled channel and the expired ones
+  void (*drop)(T value);
+  // * CLOCK_MONOTONIC nanoseconds after which the receivers drop the item
+  // * instead of taking it, 0 is never. nullptr if the items do not expire.
+  uint64_t (*deadline)(const T *value);
+  // * the items dropped by the deadline or to make room
+  size_t expired_count;
+};
+
+template <typename T>
+void channel_init(Channel<T> *channel, Scheduler *scheduler, size_t capacity,
+                  size_t senders_count, void (*drop)(T value)) {
+  assert(capacity > 0);
+  assert(senders_count > 0);
+
+  memset((void *)channel, 0, sizeof(*channel));
+  channel->scheduler = scheduler;
+  pthread_mutex_init(&channel->mutex, nullptr);
+  channel->items = (T *)malloc(sizeof(T) * capacity);
+  assert(channel->items);
+  channel->capacity = capacity;
+  channel->senders_count = senders_count;
+  channel->drop = drop;
+}
+
+// * The items waiting in the channel
+template <typename T>
+size_t channel_size(Channel<T> *channel) {
+  pthread_mutex_lock(&channel->mutex);
+  defer(pthread_mutex_unlock(&channel->mutex));
+  return channel->size;
+}
+
+template <typename T>
+size_t channel_expired_count(Channel<T> *channel) {
+  pthread_mutex_lock(&channel->mutex);
+  defer(pthread_mutex_unlock(&channel->mutex));
+  return channel->expired_count;
+}
+
+// * *now is read once per receive, only when an item has a deadline
+template <typename T>
+bool channel_expired(Channel<T> *channel, const T *value, uint64_t *now) {
+  if (channel->deadline == nullptr) return false;
+  uint64_t deadline = channel->deadline(value);
+  if (deadline == 0) return false;
+  if (*now == 0) *now = monotonic_ns();
+  return *now > deadline;
+}
+
+template <typename T>
+void channel_destroy(Channel<T> *channel) {
+  for (size_t i = 0; i < channel->size; ++i) {
+    if (channel->drop) channel->drop(channel->items[(channel->begin + i) % channel->capacity]);
+  }
+  free(channel->items);
+  pthread_mutex_destroy(&channel->mutex);
+}
+
+// * The waiter lives in the frame of its coroutine, which may be gone as
+// * soon as it is pushed
+template <typename T>
+void channel_wake(Channel<T> *channel, Channel_Waiter<T> *waiter) {
+  while (waiter) {
+    Channel_Waiter<T> *next = waiter->next;
+    scheduler_push(channel->scheduler, scheduler_current_worker, waiter->task);
+    waiter = next;
+  }
+}
+
+template <typename T>
+void channel_sender_done(Channel<T> *channel) {
+  pthread_mutex_lock(&channel->mutex);
+  assert(channel->senders_count > 0);
+  channel->senders_count -= 1;
+  Channel_Waiter<T> *woken = nullptr;
+  if (channel->senders_count == 0) {
+    channel->closed = true;
+    // * there are receivers waiting only if nothing is left
+    woken = channel->receivers.first;
+    channel->receivers = {};
+  }
+  pthread_mutex_unlock(&channel->mutex);
+
+  for (Channel_Waiter<T> *waiter = woken; waiter; waiter = waiter->next) waiter->ok = false;
+  channel_wake(channel, woken);
+}
+
+template <typename T>
+void channel_cancel(Channel<T> *channel) {
+  pthread_mutex_lock(&channel->mutex);
+  channel->cancelled = true;
+  Channel_Waiter<T> *senders = channel->senders.first;
+  Channel_Waiter<T> *receivers = channel->receivers.first;
+  channel->senders = {};
+  channel->receivers = {};
+  pthread_mutex_unlock(&channel->mutex);
+
+  for (Channel_Waiter<T> *waiter = senders; waiter; waiter = waiter->next) waiter->ok = false;
+  for (Channel_Waiter<T> *waiter = receivers; waiter; waiter = waiter->next) waiter->ok = false;
+  channel_wake(channel, senders);
+  channel_wake(channel, receivers);
+}
+
+// * co_await channel_send(channel, value) is false if the channel was
+// * cancelled, the value stays with the sender then
+template <typename T>
+struct Channel_Send {
+  Channel<T> *channel;
+  T value;
+  Channel_Waiter<T> waiter;
+
+  bool await_ready() { return false; }
+
+  bool await_suspend(std::coroutine_handle<Pipeline_Stage::promise_type> handle) {
+    waiter = {&value, false, &handle.promise().task, nullptr};
+
+    pthread_mutex_lock(&channel->mutex);
+    assert(!channel->closed);
+    if (channel->cancelled) {
+      pthread_mutex_unlock(&channel->mutex);
+      return false;
+    }
+
+    Channel_Waiter<T> *receiver = channel_waiters_pop(&channel->receivers);
+    if (receiver) {
+      *receiver->value = value;
+      receiver->ok = true;
+      receiver->next = nullptr;
+      pthread_mutex_unlock(&channel->mutex);
+      waiter.ok = true;
+      channel_wake(channel, receiver);
+      return false;
+    }
+
+    if (channel->size < channel->capacity) {
+      channel->items[(channel->begin + channel->size) % channel->capacity] = value;
+      channel->size += 1;
+      pthread_mutex_unlock(&channel->mutex);
+      waiter.ok = true;
+      return false;
+    }
+
+    // * full, the receiver that makes room takes the value
+    channel_waiters_push(&channel->senders, &waiter);
+    pthread_mutex_unlock(&channel->mutex);
+    return true;
+  }
+
+  bool await_resume() { return waiter.ok; }
+};
+
+template <typename T>
+Channel_Send<T> channel_send(Channel<T> *channel, T value) {
+  return {channel, value, {}};
+}
+
+// * Sends from a thread that is not a stage and must never wait (the live
+// * mode). When the channel is full the oldest item makes room for the
+// * new one, it is the closest one to its deadline anyway. Returns false
+// * if an item was dropped.
+template <typename T>
+bool channel_push_or_drop_oldest(Channel<T> *channel, T value) {
+  pthread_mutex_lock(&channel->mutex);
+  assert(!channel->closed);
+  if (channel->cancelled) {
+    pthread_mutex_unlock(&channel->mutex);
+    channel->drop(value);
+    return false;
+  }
+
+  Channel_Waiter<T> *receiver = channel_waiters_pop(&channel->receivers);
+  if (receiver) {
+    *receiver->value = value;
+    receiver->ok = true;
+    receiver->next = nullptr;
+    pthread_mutex_unlock(&channel->mutex);
+    channel_wake(channel, receiver);
+    return true;
+  }
+
+  bool dropped = channel->size >= channel->capacity;
+  T oldest = {};
+  if (dropped) {
+    oldest = channel->items[channel->begin];
+    channel->begin = (channel->begin + 1) % channel->capacity;
+    channel->size -= 1;
+    channel->expired_count += 1;
+  }
+  channel->items[(channel->begin + channel->size) % channel->capacity] = value;
+  channel->size += 1;
+  pthread_mutex_unlock(&channel->mutex);
+
+  if (dropped) channel->drop(oldest);
+  return !dropped;
+}
+
+// * co_await channel_receive(channel, &value) is false when the channel is
+// * closed and empty or cancelled
+template <typename T>
+struct Channel_Receive {
+  Channel<T> *channel;
+  Channel_Waiter<T> waiter;
+
+  bool await_ready() { return false; }
+
+  bool await_suspend(std::coroutine_handle<Pipeline_Stage::promise_type> handle) {
+    waiter.ok = false;
+    waiter.task = &handle.promise().task;
+
+    pthread_mutex_lock(&channel->mutex);
+    if (channel->cancelled) {
+      pthread_mutex_unlock(&channel->mutex);
+      return false;
+    }
+
+    // * the expired items are dropped on the way to the first live one
+    Channel_Waiter<T> *woken = nullptr;
+    uint64_t now = 0;
+    while (channel->size > 0 && !waiter.ok) {
+      T value = channel->items[channel->begin];
+      channel->begin = (channel->begin + 1) % channel->capacity;
+      channel->size -= 1;
+
+      // * the room goes to the sender waiting the longest
+      Channel_Waiter<T> *sender = channel_waiters_pop(&channel->senders);
+      if (sender) {
+        channel->items[(channel->begin + channel->size) % channel->capacity] = *sender->value;
+        channel->size += 1;
+        sender->ok = true;
+        sender->next = woken;
+        woken = sender;
+      }
+
+      if (channel_expired(channel, &value, &now)) {
+        channel->drop(value);
+        channel->expired_count += 1;
+        continue;
+      }
+      *waiter.value = value;
+      waiter.ok = true;
+    }
+
+    if (waiter.ok || channel->closed) {
+      pthread_mutex_unlock(&channel->mutex);
+      channel_wake(channel, woken);
+      return false;
+    }
+
+    channel_waiters_push(&channel->receivers, &waiter);
+    pthread_mutex_unlock(&channel->mutex);
+    channel_wake(channel, woken);
+    return true;
+  }
+
+  bool await_resume() { return waiter.ok; }
+};
+
+template <typename T>
+Channel_Receive<T> channel_receive(Channel<T> *channel, T *value) {
+  return {channel, {value, false, nullptr, nullptr}};
+}
+
+// * The first Ctrl-C stops rendering and drains the frames that are
+// * already rendered, the second one drops them too
+volatile sig_atomic_t pipeline_interrupts = 0;
+
+void pipeline_interrupt_handler(int signum) {
+  (void)signum;
+  pipeline_interrupts = pipeline_interrupts + 1;
+}
+
+struct Png_Pipeline {
+  Renderer *renderer;
+  size_t begin;
+  size_t end;
+  bool dedup;
+
+  // * the render stages take the frames from here in any order, the frame
+  // * writer puts them in place by the index
+  std::atomic<size_t> next_index;
+  std::atomic<size_t> rendered_count;
+
+  Channel<Frame> frames;
+};
+
+void drop_frame(Frame frame) {
+  frame_pixels_free(frame.image.pixels);
+}
+
+uint64_t frame_deadline(const Frame *frame) {
+  return frame->deadline;
+}
+
+Pipeline_Stage render_stage(Png_Pipeline *pipeline) {
+  for (;;) {
+    size_t index = pipeline->next_index.fetch_add(1);
+    if (index >= pipeline->end || pipeline_interrupts > 0) break;
+
+    // * the scene hashes make every frame independent, so the duplicates are
+    // * known without the previous frame
+    if (pipeline->dedup && index > pipeline->begin
+        && scene_hash(scene_at_frame(index)) == scene_hash(scene_at_frame(index - 1))) {
+      continue;
+    }
+
+    // * The stages are not waiting for --memory-limit, that would block
+    // * the worker under them. The frames in flight are bounded by the
+    // * capacity of the channel instead, see render_frames_pipeline.
+    Image32 surface = {
+      .height = VODUS_HEIGHT,
+      .width = VODUS_WIDTH,
+      .pixels = frame_pixels_alloc(),
+      .stride = VODUS_WIDTH};
+    render_frame(pipeline->renderer, image32_view(surface), index);
+    pipeline->rendered_count.fetch_add(1);
+
+    if (!co_await channel_send(&pipeline->frames, Frame{index, surface, 0})) {
+      frame_pixels_free(surface.pixels);
+      break;
+    }
+  }
+  channel_sender_done(&pipeline->frames);
+}
+
+// * Also the receiving end of the live mode
+Pipeline_Stage compress_stage(Channel<Frame> *frames) {
+  Frame frame;
+  while (co_await channel_receive(frames, &frame)) {
+    if (pipeline_interrupts > 1) {
+      frame_pixels_free(frame.image.pixels);
+      channel_cancel(frames);
+      break;
+    }
+
+    Encoded_Frame encoded = encode_image32(frame.image, frame.index, frame_format);
+    frame_pixels_free(frame.image.pixels);
+    io_queue_push(&frame_writer.queue, encoded);
+  }
+}
+
+// * The offline PNG pipeline as coroutine stages on the scheduler.
+// * Returns how many frames were rendered, sets interrupted on Ctrl-C.
+size_t render_frames_pipeline(Scheduler *scheduler, Renderer *renderer, size_t begin, size_t end,
+                              size_t render_stages_count, size_t compress_stages_count,
+                              bool dedup, bool *interrupted) {
+  // * The render stages run at the same time and only read the glyph,
+  // * shape and effect caches
+  renderer_load_text(renderer, renderer->text);
+
+  Png_Pipeline *pipeline = new Png_Pipeline;
+  pipeline->renderer = renderer;
+  pipeline->begin = begin;
+  pipeline->end = end;
+  pipeline->dedup = dedup;
+  pipeline->next_index.store(begin);
+  pipeline->rendered_count.store(0);
+
+  // * Every stage holds a frame of its own next to the ones in the channel,
+  // * so --memory-limit leaves the channel the rest of the limit
+  size_t capacity = 2 * compress_stages_count;
+  if (memory.limit > 0) {
+    size_t frames_limit = memory.limit / (sizeof(Pixels32) * VODUS_WIDTH * VODUS_HEIGHT);
+    size_t stages_count = render_stages_count + compress_stages_count;
+    capacity = std::min(capacity, frames_limit > stages_count ? frames_limit - stages_count : 1);
+  }
+  channel_init(&pipeline->frames, scheduler, capacity, render_stages_count, drop_frame);
+
+  pipeline_interrupts = 0;
+  struct sigaction action = {};
+  struct sigaction previous_action = {};
+  action.sa_handler = pipeline_interrupt_handler;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, &previous_action);
+
+  for (size_t i = 0; i < render_stages_count; ++i) {
+    pipeline_spawn(scheduler, render_stage(pipeline));
+  }
+  for (size_t i = 0; i < compress_stages_count; ++i) {
+    pipeline_spawn(scheduler, compress_stage(&pipeline->frames));
+  }
+  scheduler_wait_jobs(scheduler, 1);
+
+  sigaction(SIGINT, &previous_action, nullptr);
+  *interrupted = pipeline_interrupts > 0;
+
+  size_t rendered_count = pipeline->rendered_count.load();
+  channel_destroy(&pipeline->frames);
+  delete pipeline;
+  return rendered_count;
+}
@@ -0,0 +1,130 @@
+// * ###################################################################
+// * Planar YUV 4:4:4
+// * ###################################################################
+
+// * The surface for the yuv444p encoder frames. Like Yuv420p it is
+// * composited directly into the planes of the frame, but every pixel has
+// * its own chroma sample, so every primitive is the same 8 bit operation
+// * on three planes of the same size: the text is blend_plane per plane and
+// * the images are rgba_to_y/rgba_to_uv per row. Nothing is interleaved and
+// * nothing is converted after the frame is drawn.
+// * The planes come from av_frame_get_buffer, aligned for the SIMD kernels.
+struct Yuv444p {
+  int origin_x, origin_y;
+  int height, width;
+  uint8_t *y, *u, *v;
+  // * the same for all the planes
+  int stride;
+};
+
+// * Horizontal band [y, y + height) of the surface
+Yuv444p yuv444p_band(Yuv444p surface, int y, int height) {
+  assert(y >= surface.origin_y);
+  assert(y + height <= surface.origin_y + surface.height);
+
+  int rows = y - surface.origin_y;
+  Yuv444p band = surface;
+  band.origin_y = y;
+  band.height = height;
+  band.y += rows * surface.stride;
+  band.u += rows * surface.stride;
+  band.v += rows * surface.stride;
+  return band;
+}
+
+void fill_yuv444p_with_color(Yuv444p surface, Pixels32 color) {
+  uint8_t y = rgb_to_y(color.r, color.g, color.b);
+  uint8_t u = rgb_to_u(color.r, color.g, color.b);
+  uint8_t v = rgb_to_v(color.r, color.g, color.b);
+
+  for (int row = 0; row < surface.height; ++row) {
+    memset(surface.y + row * surface.stride, y, (size_t)surface.width);
+    memset(surface.u + row * surface.stride, u, (size_t)surface.width);
+    memset(surface.v + row * surface.stride, v, (size_t)surface.width);
+  }
+}
+
+// * Slap FreeType bitmap onto Yuv444p
+void slap_onto_yuv444p(Yuv444p dest, FT_Bitmap *src, Pixels32 color, int x, int y) {
+  assert(src->pixel_mode == FT_PIXEL_MODE_GRAY);
+  assert(src->num_grays == 256);
+
+  uint8_t color_y = rgb_to_y(color.r, color.g, color.b);
+  uint8_t color_u = rgb_to_u(color.r, color.g, color.b);
+  uint8_t color_v = rgb_to_v(color.r, color.g, color.b);
+
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + (int)src->rows, dest.height);
+  int col_begin = x < 0 ? 0 : x;
+  int col_end = std::min(x + (int)src->width, dest.width);
+  if (col_begin >= col_end) return;
+
+  for (int row = row_begin; row < row_end; ++row) {
+    const uint8_t *coverage = src->buffer + (row - y) * src->pitch - x + col_begin;
+    int offset = row * dest.stride + col_begin;
+    size_t count = (size_t)(col_end - col_begin);
+    blend_plane.run(dest.y + offset, coverage, count, color_y);
+    blend_plane.run(dest.u + offset, coverage, count, color_u);
+    blend_plane.run(dest.v + offset, coverage, count, color_v);
+  }
+}
+
+// * Slap coverage mask onto Yuv444p
+void slap_onto_yuv444p(Yuv444p dest, Mask *src, Pixels32 color, int x, int y) {
+  uint8_t color_y = rgb_to_y(color.r, color.g, color.b);
+  uint8_t color_u = rgb_to_u(color.r, color.g, color.b);
+  uint8_t color_v = rgb_to_v(color.r, color.g, color.b);
+
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = std::max(0, -y);
+  int row_end = std::min((int)src->bitmap.rows, dest.height - y);
+  int col_begin = std::max(0, -x);
+  int col_end = std::min((int)src->bitmap.width, dest.width - x);
+
+  for (int row = row_begin; row < row_end; ++row) {
+    int offset = (row + y) * dest.stride + x;
+    const uint8_t *coverage = src->bitmap.buffer + row * src->bitmap.pitch;
+    for_each_mask_run(src, row, col_begin, col_end, [&](Mask_Run_Kind kind, int col, size_t count) {
+      if (kind == MASK_RUN_SOLID) {
+        memset(dest.y + offset + col, color_y, count);
+        memset(dest.u + offset + col, color_u, count);
+        memset(dest.v + offset + col, color_v, count);
+      } else {
+        blend_plane.run(dest.y + offset + col, coverage + col, count, color_y);
+        blend_plane.run(dest.u + offset + col, coverage + col, count, color_u);
+        blend_plane.run(dest.v + offset + col, coverage + col, count, color_v);
+      }
+    });
+  }
+}
+
+// * Slap image32 onto Yuv444p
+void slap_onto_yuv444p(Yuv444p dest, Image32 *src, int x, int y) {
+  x -= dest.origin_x;
+  y -= dest.origin_y;
+
+  int row_begin = y < 0 ? 0 : y;
+  int row_end = std::min(y + src->height, dest.height);
+  int col_begin = x < 0 ? 0 : x;
+  int col_end = std::min(x + src->width, dest.width);
+  if (col_begin >= col_end) return;
+
+  for (int row = row_begin; row < row_end; ++row) {
+    const Pixels32 *pixels = src->pixels + (row - y) * src->stride - x + col_begin;
+    int offset = row * dest.stride + col_begin;
+    size_t count = (size_t)(col_end - col_begin);
+    rgba_to_y.run(dest.y + offset, pixels, count);
+    rgba_to_uv.run(dest.u + offset, dest.v + offset, pixels, count);
+  }
+}
+
+void slap_text_onto_yuv444p(Yuv444p surface, Glyph_Cache *cache, const char *text, Pixels32 color, int x, int y) {
+  for_each_glyph(cache, text, x, y, [&](Mask *mask, int glyph_x, int glyph_y) {
+    slap_onto_yuv444p(surface, mask, color, glyph_x, glyph_y);
+  });
+}
@@ -0,0 +1,128 @@
+// * ###################################################################
+// * Preview
+// * ###################################################################
+
+// * A quick look at the layout instead of the real render: the scenes are
+// * rendered at 1/scale of the resolution with the draft text, only every
+// * stride-th frame, and streamed as uncompressed YUV4MPEG2 so nothing is
+// * spent on compression. Y4M plays with `ffplay`/`mpv` straight from a pipe
+// * and any encoder takes it on stdin:
+// *
+// *   ./vodus --preview - ... | ffmpeg -i - -preset ultrafast preview.mp4
+// *
+// * https://wiki.multimedia.cx/index.php/YUV4MPEG2
+
+constexpr int PREVIEW_DEFAULT_SCALE = 4;
+constexpr size_t PREVIEW_DEFAULT_STRIDE = 4;
+
+// * Box filter, every pixel of the result is the average of factor x factor
+// * pixels of the source
+Image32 image32_downscale(Image32 src, int factor) {
+  Image32 result = {
+    .height = std::max(src.height / factor, 1),
+    .width = std::max(src.width / factor, 1),
+    .pixels = nullptr,
+    .stride = 0};
+  result.stride = result.width;
+  result.pixels = (Pixels32 *)malloc(sizeof(Pixels32) * (size_t)result.width * (size_t)result.height);
+  assert(result.pixels);
+
+  for (int row = 0; row < result.height; ++row) {
+    for (int col = 0; col < result.width; ++col) {
+      int r = 0, g = 0, b = 0, a = 0, n = 0;
+      for (int dy = row * factor; dy < std::min((row + 1) * factor, src.height); ++dy) {
+        for (int dx = col * factor; dx < std::min((col + 1) * factor, src.width); ++dx) {
+          Pixels32 p = src.pixels[dy * src.stride + dx];
+          r += p.r;
+          g += p.g;
+          b += p.b;
+          a += p.a;
+          n += 1;
+        }
+      }
+      result.pixels[row * result.stride + col] = {
+        (uint8_t)(r / n), (uint8_t)(g / n), (uint8_t)(b / n), (uint8_t)(a / n)};
+    }
+  }
+
+  return result;
+}
+
+void write_or_die(const void *data, size_t size, FILE *stream, const char *file_path) {
+  if (fwrite(data, 1, size, stream) != size) {
+    fprintf(stderr, "could not write %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+}
+
+// * "-" is stdout. Then everything vodus prints goes to stderr from now on,
+// * so call it before printing anything.
+FILE *open_preview_stream(const char *file_path) {
+  if (strcmp(file_path, "-") != 0) {
+    FILE *stream = fopen(file_path, "wb");
+    if (!stream) {
+      fprintf(stderr, "could not open %s: %s\n", file_path, strerror(errno));
+      exit(1);
+    }
+    return stream;
+  }
+
+  int fd = dup(STDOUT_FILENO);
+  if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+    fprintf(stderr, "could not redirect stdout: %s\n", strerror(errno));
+    exit(1);
+  }
+  FILE *stream = fdopen(fd, "wb");
+  assert(stream);
+  return stream;
+}
+
+// * Renders every stride-th frame of [begin, end) into the stream.
+// * The renderer has to be set up for the scale already.
+// * Returns how many of the frames were actually rendered.
+size_t render_preview(Renderer *renderer, FILE *stream, const char *file_path, size_t begin, size_t end, size_t stride) {
+  int scale = std::max(renderer->scale, 1);
+  // * 4:2:0 wants even dimensions
+  int width = (VODUS_WIDTH / scale) & ~1;
+  int height = (VODUS_HEIGHT / scale) & ~1;
+
+  // * 601 limited range like the rest of the YUV output.
+  // * Every stride-th frame is shown for stride frame durations.
+  fprintf(stream, "YUV4MPEG2 W%d H%d F%zu:%zu Ip A1:1 C420mpeg2 XCOLORRANGE=LIMITED\n",
+          width, height, VODUS_FPS, stride);
+
+  size_t y_size = (size_t)width * (size_t)height;
+  size_t uv_size = (size_t)(width / 2) * (size_t)(height / 2);
+  uint8_t *planes = (uint8_t *)malloc(y_size + 2 * uv_size);
+  assert(planes);
+  defer(free(planes));
+
+  Yuv420p surface = {
+    .origin_x = 0,
+    .origin_y = 0,
+    .height = height,
+    .width = width,
+    .y = planes,
+    .u = planes + y_size,
+    .v = planes + y_size + uv_size,
+    .y_stride = width,
+    .uv_stride = width / 2};
+
+  size_t rendered_count = 0;
+  uint64_t previous_hash = 0;
+  for (size_t index = begin; index < end; index += stride) {
+    // * unchanged scenes just write the previous planes again
+    uint64_t hash = scene_hash(scene_at_frame(index));
+    if (index == begin || hash != previous_hash) {
+      render_frame(renderer, surface, index);
+      rendered_count += 1;
+      previous_hash = hash;
+    }
+
+    const char frame_header[] = "FRAME\n";
+    write_or_die(frame_header, sizeof(frame_header) - 1, stream, file_path);
+    write_or_die(planes, y_size + 2 * uv_size, stream, file_path);
+  }
+
+  return rendered_count;
+}
@@ -0,0 +1,189 @@
+// * ###################################################################
+// * Emote resampling
+// * ###################################################################
+
+// * Area averaging: every pixel of the result is the average of the source
+// * area it covers, with the partially covered source pixels weighted by
+// * how much of them is covered. It does not alias when shrinking and it
+// * does not ring like Lanczos on the hard edges of the emotes.
+// *
+// * The filter is separable. One pass resamples the rows of an image by
+// * accumulating whole weighted source rows (weigh_pixels32) and rounding
+// * them into the result row (resolve_pixels32). The columns are resampled
+// * by the same pass on the transposed image.
+// *
+// * Both passes run on premultiplied pixels, so the color of the fully
+// * transparent pixels (often black) does not bleed into the edges of the
+// * emote. The result is straight RGBA again like the rest of the images.
+
+// * Weights of the source pixels [*first, *first + count) for the result
+// * pixel `index`. They add up to exactly 1 << RESAMPLE_WEIGHT_BITS, so an
+// * opaque area stays opaque.
+size_t resample_weights(int index, int src_size, int dst_size, int *first, uint32_t *weights, size_t capacity) {
+  double scale = (double)src_size / (double)dst_size;
+  double begin = index * scale;
+  double end = std::min((index + 1) * scale, (double)src_size);
+
+  *first = (int)begin;
+  int last = std::min((int)ceil(end), src_size);
+
+  constexpr uint32_t one = 1u << RESAMPLE_WEIGHT_BITS;
+  uint32_t total = 0;
+  size_t count = 0;
+  for (int i = *first; i < last; ++i) {
+    assert(count < capacity);
+    double covered = std::min(end, (double)(i + 1)) - std::max(begin, (double)i);
+    uint32_t weight = (uint32_t)std::lround(covered / (end - begin) * one);
+    weight = std::min(weight, one - total);
+    weights[count++] = weight;
+    total += weight;
+  }
+  weights[count - 1] += one - total;
+  return count;
+}
+
+// * Resamples the image to the given amount of rows
+Image32 image32_resample_rows(Image32 src, int height) {
+  Image32 result = {
+    .height = height,
+    .width = src.width,
+    .pixels = (Pixels32 *)malloc(sizeof(Pixels32) * (size_t)src.width * (size_t)height),
+    .stride = src.width};
+  assert(result.pixels);
+
+  uint32_t *acc = (uint32_t *)malloc(sizeof(uint32_t) * 4 * (size_t)src.width);
+  assert(acc);
+  defer(free(acc));
+
+  // * a result pixel covers at most ceil(scale) + 1 source pixels
+  size_t capacity = (size_t)(src.height / height) + 2;
+  uint32_t *weights = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+  assert(weights);
+  defer(free(weights));
+
+  for (int row = 0; row < height; ++row) {
+    int first = 0;
+    size_t count = resample_weights(row, src.height, height, &first, weights, capacity);
+    memset(acc, 0, sizeof(uint32_t) * 4 * (size_t)src.width);
+    for (size_t k = 0; k < count; ++k) {
+      if (weights[k] == 0) continue;
+      weigh_pixels32.run(acc, src.pixels + (first + (int)k) * src.stride, (size_t)src.width, weights[k]);
+    }
+    resolve_pixels32.run(result.pixels + row * result.stride, acc, (size_t)src.width);
+  }
+
+  return result;
+}
+
+Image32 image32_transpose(Image32 src) {
+  Image32 result = {
+    .height = src.width,
+    .width = src.height,
+    .pixels = (Pixels32 *)malloc(sizeof(Pixels32) * (size_t)src.width * (size_t)src.height),
+    .stride = src.height};
+  assert(result.pixels);
+
+  for (int row = 0; row < src.height; ++row) {
+    for (int col = 0; col < src.width; ++col) {
+      result.pixels[col * result.stride + row] = src.pixels[row * src.stride + col];
+    }
+  }
+  return result;
+}
+
+// * dst may be src
+void premultiply_pixels32(Pixels32 *dst, const Pixels32 *src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    Pixels32 p = src[i];
+    dst[i] = {(uint8_t)((p.r * p.a + 127) / 255), (uint8_t)((p.g * p.a + 127) / 255),
+              (uint8_t)((p.b * p.a + 127) / 255), p.a};
+  }
+}
+
+void unpremultiply_pixels32(Pixels32 *pixels, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    Pixels32 p = pixels[i];
+    if (p.a == 0) {
+      pixels[i] = {0, 0, 0, 0};
+      continue;
+    }
+    int half = p.a / 2;
+    pixels[i] = {(uint8_t)std::min((p.r * 255 + half) / p.a, 255), (uint8_t)std::min((p.g * 255 + half) / p.a, 255),
+                 (uint8_t)std::min((p.b * 255 + half) / p.a, 255), p.a};
+  }
+}
+
+Image32 image32_resample(Image32 src, int width, int height) {
+  assert(width > 0 && height > 0);
+
+  Image32 premultiplied = {src.height, src.width,
+                           (Pixels32 *)malloc(sizeof(Pixels32) * (size_t)src.width * (size_t)src.height), src.width};
+  assert(premultiplied.pixels);
+  defer(free(premultiplied.pixels));
+  for (int row = 0; row < src.height; ++row) {
+    premultiply_pixels32(premultiplied.pixels + row * premultiplied.stride, src.pixels + row * src.stride, (size_t)src.width);
+  }
+
+  Image32 rows = image32_resample_rows(premultiplied, height);
+  defer(free(rows.pixels));
+  Image32 transposed = image32_transpose(rows);
+  defer(free(transposed.pixels));
+  Image32 columns = image32_resample_rows(transposed, width);
+  defer(free(columns.pixels));
+  Image32 result = image32_transpose(columns);
+  unpremultiply_pixels32(result.pixels, (size_t)result.width * (size_t)result.height);
+  return result;
+}
+
+// * The emotes resampled to the sizes they are drawn at. There are only a
+// * few emotes and sizes, so it is a plain array.
+struct Scaled_Emote {
+  // * the key: the pixels of the source image and the height
+  const Pixels32 *source;
+  int height;
+  Image32 image;
+};
+
+struct Emote_Cache {
+  size_t count;
+  size_t capacity;
+  Scaled_Emote *entries;
+};
+
+// * Adds the already scaled image of src without looking for it first
+Image32 *emote_cache_put(Emote_Cache *cache, Image32 *src, int height, Image32 image) {
+  if (cache->count >= cache->capacity) {
+    cache->capacity = cache->capacity == 0 ? 16 : cache->capacity * 2;
+    cache->entries = (Scaled_Emote *)realloc(cache->entries, sizeof(Scaled_Emote) * cache->capacity);
+    assert(cache->entries);
+  }
+
+  Scaled_Emote *entry = &cache->entries[cache->count++];
+  entry->source = src->pixels;
+  entry->height = height;
+  entry->image = image;
+  return &entry->image;
+}
+
+int emote_scaled_width(const Image32 *src, int height) {
+  return std::max((int)std::lround((double)src->width * height / src->height), 1);
+}
+
+// * The emote keeps its aspect ratio. height <= 0 is the native size.
+// * Not thread-safe when the size is not in the cache yet.
+Image32 *emote_cache_get(Emote_Cache *cache, Image32 *src, int height) {
+  if (height <= 0 || height == src->height) {
+    return src;
+  }
+
+  for (size_t i = 0; i < cache->count; ++i) {
+    Scaled_Emote *entry = &cache->entries[i];
+    if (entry->source == src->pixels && entry->height == height) {
+      return &entry->image;
+    }
+  }
+
+  int width = emote_scaled_width(src, height);
+  memory_track_alloc(MEMORY_EMOTES, sizeof(Pixels32) * (size_t)width * (size_t)height);
+  return emote_cache_put(cache, src, height, image32_resample(*src, width, height));
+}
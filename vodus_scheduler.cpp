@@ -0,0 +1,265 @@
+// * ###################################################################
+// * Work-stealing scheduler
+// * ###################################################################
+
+// * Instead of a fixed set of threads per stage every worker runs whatever
+// * is ready. The stages of the PNG pipeline are the tasks here (see
+// * vodus_pipeline.cpp), a stage is pushed again whenever it can continue.
+// *
+// * Every worker has its own deque. New tasks go to the bottom of the deque
+// * of the worker that made them ready and the worker takes them from the
+// * bottom again, so the compression of a frame usually runs right after
+// * its rendering on the same core while the pixels are still in its cache.
+// * An idle worker steals from the top of somebody else's deque, the oldest
+// * task there, so the stage that is behind gets the idle cores.
+// *
+// * The main thread is the worker 0. It helps with the tasks while it waits
+// * for the jobs. The files are still written by the frame writer thread,
+// * that one batches them.
+
+struct Task {
+  void (*run)(Task *task, size_t worker);
+  void *context;
+  // * the task is ready when it reaches 0
+  std::atomic<size_t> pending;
+  // * gets one pending less when the task is done, nullptr if none
+  Task *successor;
+};
+
+struct Task_Deque {
+  pthread_mutex_t mutex;
+  Task **tasks;
+  size_t capacity;
+  size_t begin;
+  size_t size;
+};
+
+constexpr size_t TASK_DEQUE_INITIAL_CAPACITY = 64;
+
+void task_deque_init(Task_Deque *deque) {
+  memset(deque, 0, sizeof(*deque));
+  pthread_mutex_init(&deque->mutex, nullptr);
+  deque->capacity = TASK_DEQUE_INITIAL_CAPACITY;
+  deque->tasks = (Task **)malloc(sizeof(Task *) * deque->capacity);
+  assert(deque->tasks);
+}
+
+void task_deque_destroy(Task_Deque *deque) {
+  free(deque->tasks);
+  pthread_mutex_destroy(&deque->mutex);
+}
+
+void task_deque_push_bottom(Task_Deque *deque, Task *task) {
+  pthread_mutex_lock(&deque->mutex);
+  defer(pthread_mutex_unlock(&deque->mutex));
+
+  if (deque->size >= deque->capacity) {
+    size_t capacity = deque->capacity * 2;
+    Task **tasks = (Task **)malloc(sizeof(Task *) * capacity);
+    assert(tasks);
+    for (size_t i = 0; i < deque->size; ++i) {
+      tasks[i] = deque->tasks[(deque->begin + i) % deque->capacity];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+    deque->begin = 0;
+  }
+  deque->tasks[(deque->begin + deque->size) % deque->capacity] = task;
+  deque->size += 1;
+}
+
+// * The owner takes the newest task
+Task *task_deque_pop_bottom(Task_Deque *deque) {
+  pthread_mutex_lock(&deque->mutex);
+  defer(pthread_mutex_unlock(&deque->mutex));
+
+  if (deque->size == 0) return nullptr;
+  deque->size -= 1;
+  return deque->tasks[(deque->begin + deque->size) % deque->capacity];
+}
+
+// * The thieves take the oldest one
+Task *task_deque_steal_top(Task_Deque *deque) {
+  pthread_mutex_lock(&deque->mutex);
+  defer(pthread_mutex_unlock(&deque->mutex));
+
+  if (deque->size == 0) return nullptr;
+  Task *task = deque->tasks[deque->begin];
+  deque->begin = (deque->begin + 1) % deque->capacity;
+  deque->size -= 1;
+  return task;
+}
+
+constexpr size_t SCHEDULER_WORKERS_CAPACITY = BANDS_CAPACITY + OUTPUT_THREADS_CAPACITY;
+
+struct Scheduler;
+
+struct Scheduler_Worker {
+  Scheduler *scheduler;
+  size_t id;
+  Task_Deque deque;
+  size_t executed_count;
+  size_t stolen_count;
+};
+
+struct Scheduler {
+  size_t workers_count;
+  Scheduler_Worker workers[SCHEDULER_WORKERS_CAPACITY];
+  pthread_t threads[SCHEDULER_WORKERS_CAPACITY];
+
+  // * tasks sitting in all of the deques
+  std::atomic<size_t> queued_count;
+
+  pthread_mutex_t mutex;
+  // * signaled when a task is pushed and when a job is done
+  pthread_cond_t cond;
+  // * a job is anything the main thread waits for: a stage of a pipeline
+  size_t jobs_in_flight;
+  bool stop;
+};
+
+// * the worker that runs on this thread, the main thread is the worker 0
+thread_local size_t scheduler_current_worker = 0;
+
+void scheduler_push(Scheduler *scheduler, size_t worker, Task *task) {
+  task_deque_push_bottom(&scheduler->workers[worker].deque, task);
+  scheduler->queued_count.fetch_add(1);
+
+  pthread_mutex_lock(&scheduler->mutex);
+  pthread_cond_signal(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+// * Runs one task from the own deque or from somebody else's.
+// * Returns false if there was nothing to run.
+bool scheduler_run_one(Scheduler *scheduler, size_t worker) {
+  Scheduler_Worker *self = &scheduler->workers[worker];
+
+  Task *task = task_deque_pop_bottom(&self->deque);
+  for (size_t i = 1; task == nullptr && i < scheduler->workers_count; ++i) {
+    size_t victim = (worker + i) % scheduler->workers_count;
+    task = task_deque_steal_top(&scheduler->workers[victim].deque);
+    if (task) self->stolen_count += 1;
+  }
+  if (task == nullptr) return false;
+  scheduler->queued_count.fetch_sub(1);
+
+  // * a finished stage frees its task, so the successor is read first
+  Task *successor = task->successor;
+  task->run(task, worker);
+  self->executed_count += 1;
+
+  if (successor && successor->pending.fetch_sub(1) == 1) {
+    scheduler_push(scheduler, worker, successor);
+  }
+  return true;
+}
+
+void *scheduler_worker_routine(void *arg) {
+  Scheduler_Worker *worker = (Scheduler_Worker *)arg;
+  Scheduler *scheduler = worker->scheduler;
+  scheduler_current_worker = worker->id;
+
+  for (;;) {
+    if (scheduler_run_one(scheduler, worker->id)) continue;
+
+    pthread_mutex_lock(&scheduler->mutex);
+    while (scheduler->queued_count.load() == 0 && !scheduler->stop) {
+      pthread_cond_wait(&scheduler->cond, &scheduler->mutex);
+    }
+    bool stopping = scheduler->stop && scheduler->queued_count.load() == 0;
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if (stopping) return nullptr;
+  }
+}
+
+void scheduler_start(Scheduler *scheduler, size_t workers_count, bool pin) {
+  assert(workers_count > 0);
+  assert(workers_count <= SCHEDULER_WORKERS_CAPACITY);
+
+  // * the scheduler comes value-initialized (new Scheduler()), the atomic
+  // * and the state of the previous run are reset one by one
+  scheduler->workers_count = workers_count;
+  scheduler->queued_count.store(0);
+  scheduler->jobs_in_flight = 0;
+  scheduler->stop = false;
+  pthread_mutex_init(&scheduler->mutex, nullptr);
+  pthread_cond_init(&scheduler->cond, nullptr);
+
+  for (size_t i = 0; i < workers_count; ++i) {
+    scheduler->workers[i].scheduler = scheduler;
+    scheduler->workers[i].id = i;
+    scheduler->workers[i].executed_count = 0;
+    scheduler->workers[i].stolen_count = 0;
+    task_deque_init(&scheduler->workers[i].deque);
+  }
+
+  if (pin) pin_thread_to_cpu(pthread_self(), 0);
+  for (size_t i = 1; i < workers_count; ++i) {
+    pthread_create(&scheduler->threads[i], nullptr, scheduler_worker_routine, &scheduler->workers[i]);
+    if (pin) pin_thread_to_cpu(scheduler->threads[i], i);
+  }
+}
+
+// * The main thread runs the tasks until less than limit jobs are in flight
+void scheduler_wait_jobs(Scheduler *scheduler, size_t limit) {
+  for (;;) {
+    pthread_mutex_lock(&scheduler->mutex);
+    if (scheduler->jobs_in_flight < limit) {
+      pthread_mutex_unlock(&scheduler->mutex);
+      return;
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    if (scheduler_run_one(scheduler, 0)) continue;
+
+    pthread_mutex_lock(&scheduler->mutex);
+    while (scheduler->jobs_in_flight >= limit && scheduler->queued_count.load() == 0) {
+      pthread_cond_wait(&scheduler->cond, &scheduler->mutex);
+    }
+    pthread_mutex_unlock(&scheduler->mutex);
+  }
+}
+
+void scheduler_job_started(Scheduler *scheduler) {
+  pthread_mutex_lock(&scheduler->mutex);
+  scheduler->jobs_in_flight += 1;
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+void scheduler_job_done(Scheduler *scheduler) {
+  pthread_mutex_lock(&scheduler->mutex);
+  scheduler->jobs_in_flight -= 1;
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+// * Waits for all the jobs and joins the workers
+void scheduler_finish(Scheduler *scheduler) {
+  scheduler_wait_jobs(scheduler, 1);
+
+  pthread_mutex_lock(&scheduler->mutex);
+  scheduler->stop = true;
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  // * the workers steal from each other until the very end
+  for (size_t i = 1; i < scheduler->workers_count; ++i) {
+    pthread_join(scheduler->threads[i], nullptr);
+  }
+
+  size_t executed_count = 0;
+  size_t stolen_count = 0;
+  for (size_t i = 0; i < scheduler->workers_count; ++i) {
+    executed_count += scheduler->workers[i].executed_count;
+    stolen_count += scheduler->workers[i].stolen_count;
+    task_deque_destroy(&scheduler->workers[i].deque);
+  }
+  pthread_cond_destroy(&scheduler->cond);
+  pthread_mutex_destroy(&scheduler->mutex);
+
+  printf("Scheduler: %zu workers ran %zu tasks, %zu of them stolen\n",
+         scheduler->workers_count, executed_count, stolen_count);
+}
@@ -0,0 +1,282 @@
+// * ###################################################################
+// * Signed distance field glyph atlas
+// * ###################################################################
+
+// * The glyphs are rasterized once as signed distance fields at
+// * SDF_BASE_SIZE and packed into one 8-bit atlas. Any size is then
+// * reconstructed from the atlas without touching FreeType again, so the
+// * messages of different sizes share one compact atlas.
+// *
+// * A texel of the atlas is 128 on the outline of the glyph, above 128
+// * inside of it and below outside. 0 and 255 are SDF_SPREAD pixels away
+// * from the outline (FreeType's default spread).
+// * https://freetype.org/freetype2/docs/reference/ft2-properties.html#spread
+
+constexpr int SDF_BASE_SIZE = 48;
+constexpr int SDF_SPREAD = 8;
+constexpr int SDF_ATLAS_WIDTH = 1024;
+constexpr int SDF_FIRST_CHAR = 32;
+constexpr int SDF_LAST_CHAR = 126;
+
+typedef float f32x4 __attribute__((vector_size(16)));
+
+struct Sdf_Glyph {
+  bool present;
+  // * rectangle of the glyph in the atlas
+  int atlas_x, atlas_y;
+  int width, height;
+  // * in pixels of SDF_BASE_SIZE, relative to the pen
+  int left, top;
+  float advance;
+};
+
+struct Sdf_Atlas {
+  int width, height;
+  uint8_t *texels;
+  Sdf_Glyph glyphs[256];
+};
+
+// * Changes the pixel size of the face, set it back after this call
+// * if the face is used for anything else.
+void sdf_atlas_generate(Sdf_Atlas *atlas, FT_Face face) {
+  memset(atlas, 0, sizeof(*atlas));
+
+  auto error = FT_Set_Pixel_Sizes(face, 0, SDF_BASE_SIZE);
+  if (error) {
+    fprintf(stderr, "could not set font size in pixels\n");
+    exit(1);
+  }
+
+  // * Every glyph is rendered once and kept until the shelves are packed
+  // * and the height of the atlas is known
+  uint8_t *bitmaps[SDF_LAST_CHAR + 1] = {};
+  int shelf_x = 0, shelf_y = 0, shelf_height = 0;
+  for (int c = SDF_FIRST_CHAR; c <= SDF_LAST_CHAR; ++c) {
+    FT_UInt glyph_index = FT_Get_Char_Index(face, (FT_ULong)c);
+    if (glyph_index == 0) continue;
+
+    if (FT_Load_Glyph(face, glyph_index, FT_LOAD_DEFAULT)) {
+      fprintf(stderr, "could not load glyph for %c\n", c);
+      exit(1);
+    }
+
+    FT_GlyphSlot slot = face->glyph;
+    Sdf_Glyph *glyph = &atlas->glyphs[c];
+    glyph->advance = (float)slot->advance.x / 64.0f;
+
+    // * empty outlines (like space) only move the pen
+    if (slot->outline.n_points == 0) {
+      glyph->present = true;
+      continue;
+    }
+
+    if (FT_Render_Glyph(slot, FT_RENDER_MODE_SDF)) {
+      fprintf(stderr, "could not render SDF for %c\n", c);
+      exit(1);
+    }
+
+    FT_Bitmap *bitmap = &slot->bitmap;
+    int width = (int)bitmap->width;
+    int height = (int)bitmap->rows;
+
+    if (shelf_x + width > SDF_ATLAS_WIDTH) {
+      shelf_x = 0;
+      shelf_y += shelf_height;
+      shelf_height = 0;
+    }
+
+    glyph->present = true;
+    glyph->atlas_x = shelf_x;
+    glyph->atlas_y = shelf_y;
+    glyph->width = width;
+    glyph->height = height;
+    glyph->left = slot->bitmap_left;
+    glyph->top = slot->bitmap_top;
+
+    bitmaps[c] = (uint8_t *)malloc((size_t)std::max(width * height, 1));
+    assert(bitmaps[c]);
+    for (int row = 0; row < height; ++row) {
+      memcpy(bitmaps[c] + row * width, bitmap->buffer + row * bitmap->pitch, (size_t)width);
+    }
+
+    shelf_x += width;
+    shelf_height = std::max(shelf_height, height);
+  }
+
+  atlas->width = SDF_ATLAS_WIDTH;
+  atlas->height = shelf_y + shelf_height;
+  atlas->texels = (uint8_t *)calloc((size_t)atlas->width * (size_t)atlas->height, 1);
+  assert(atlas->texels);
+  for (int c = SDF_FIRST_CHAR; c <= SDF_LAST_CHAR; ++c) {
+    if (bitmaps[c] == nullptr) continue;
+    const Sdf_Glyph *glyph = &atlas->glyphs[c];
+    for (int row = 0; row < glyph->height; ++row) {
+      memcpy(atlas->texels + (glyph->atlas_y + row) * atlas->width + glyph->atlas_x,
+             bitmaps[c] + row * glyph->width,
+             (size_t)glyph->width);
+    }
+    free(bitmaps[c]);
+  }
+
+  printf("Generated %dx%d SDF atlas\n", atlas->width, atlas->height);
+}
+
+// * Whether the atlas has every character of the text
+bool sdf_text_supported(const char *text) {
+  for (const char *c = text; *c; ++c) {
+    if ((unsigned char)*c < SDF_FIRST_CHAR || (unsigned char)*c > SDF_LAST_CHAR) return false;
+  }
+  return true;
+}
+
+// * Scratch buffers of the reconstruction, one set per thread so the bands
+// * can reconstruct glyphs at the same time.
+struct Sdf_Scratch {
+  size_t capacity;
+  float *line;
+  int *u0;
+  float *fu;
+  uint8_t *coverage;
+};
+
+thread_local Sdf_Scratch sdf_scratch = {};
+
+void sdf_scratch_reserve(Sdf_Scratch *scratch, size_t size) {
+  if (scratch->capacity >= size) return;
+  // * + 4 so the vector loops can overrun the tail
+  size_t capacity = size + 4;
+  scratch->line = (float *)realloc(scratch->line, sizeof(float) * capacity);
+  scratch->u0 = (int *)realloc(scratch->u0, sizeof(int) * capacity);
+  scratch->fu = (float *)realloc(scratch->fu, sizeof(float) * capacity);
+  scratch->coverage = (uint8_t *)realloc(scratch->coverage, capacity * capacity);
+  assert(scratch->line && scratch->u0 && scratch->fu && scratch->coverage);
+  scratch->capacity = size;
+}
+
+// * Reconstructs the coverage of the glyph at the given pixel size.
+// * The result lives in the scratch buffers of the calling thread until the
+// * next call.
+void sdf_reconstruct_glyph(Sdf_Atlas *atlas, Sdf_Glyph *glyph, float scale, FT_Bitmap *result) {
+  int width = (int)ceilf((float)glyph->width * scale);
+  int height = (int)ceilf((float)glyph->height * scale);
+
+  Sdf_Scratch *scratch = &sdf_scratch;
+  sdf_scratch_reserve(scratch, (size_t)std::max({width, height, glyph->width}));
+
+  // * Texel value to the distance from the outline in destination pixels
+  // * plus a half, so the coverage is 0.5 right on the outline
+  const float distance_scale = (float)SDF_SPREAD / 128.0f * scale;
+  const f32x4 zero = {0.0f, 0.0f, 0.0f, 0.0f};
+  const f32x4 one = {1.0f, 1.0f, 1.0f, 1.0f};
+
+  // * Horizontal sample positions are the same for every row
+  for (int col = 0; col < width; ++col) {
+    float u = ((float)col + 0.5f) / scale - 0.5f;
+    u = std::clamp(u, 0.0f, (float)(glyph->width - 1));
+    int u0 = std::min((int)u, glyph->width - 2 < 0 ? 0 : glyph->width - 2);
+    scratch->u0[col] = u0;
+    scratch->fu[col] = glyph->width > 1 ? u - (float)u0 : 0.0f;
+  }
+
+  for (int row = 0; row < height; ++row) {
+    float v = ((float)row + 0.5f) / scale - 0.5f;
+    v = std::clamp(v, 0.0f, (float)(glyph->height - 1));
+    int v0 = (int)v;
+    int v1 = std::min(v0 + 1, glyph->height - 1);
+    float fv = v - (float)v0;
+
+    const uint8_t *top = atlas->texels + (glyph->atlas_y + v0) * atlas->width + glyph->atlas_x;
+    const uint8_t *bottom = atlas->texels + (glyph->atlas_y + v1) * atlas->width + glyph->atlas_x;
+
+    // * Vertical interpolation of the two atlas rows, 4 texels at a time
+    f32x4 fv4 = {fv, fv, fv, fv};
+    for (int col = 0; col < glyph->width; col += 4) {
+      f32x4 a, b;
+      for (int k = 0; k < 4; ++k) {
+        int index = std::min(col + k, glyph->width - 1);
+        a[k] = top[index];
+        b[k] = bottom[index];
+      }
+      f32x4 line = a + (b - a) * fv4;
+      memcpy(scratch->line + col, &line, sizeof(line));
+    }
+    // * the last texel is duplicated for the horizontal interpolation
+    scratch->line[glyph->width] = scratch->line[glyph->width - 1];
+
+    // * Horizontal interpolation and distance to coverage, 4 pixels at a time
+    uint8_t *coverage = scratch->coverage + row * width;
+    for (int col = 0; col < width; col += 4) {
+      f32x4 left, right, fu;
+      for (int k = 0; k < 4; ++k) {
+        int index = std::min(col + k, width - 1);
+        left[k] = scratch->line[scratch->u0[index]];
+        right[k] = scratch->line[scratch->u0[index] + 1];
+        fu[k] = scratch->fu[index];
+      }
+      f32x4 texel = left + (right - left) * fu;
+      f32x4 alpha = (texel - 128.0f) * distance_scale + 0.5f;
+      alpha = alpha < zero ? zero : alpha;
+      alpha = alpha > one ? one : alpha;
+      alpha = alpha * 255.0f + 0.5f;
+      for (int k = 0; k < 4 && col + k < width; ++k) {
+        coverage[col + k] = (uint8_t)alpha[k];
+      }
+    }
+  }
+
+  memset(result, 0, sizeof(*result));
+  result->rows = (unsigned int)height;
+  result->width = (unsigned int)width;
+  result->pitch = width;
+  result->buffer = scratch->coverage;
+  result->num_grays = 256;
+  result->pixel_mode = FT_PIXEL_MODE_GRAY;
+}
+
+// * Calls slap(bitmap, x, y) for every glyph of the text reconstructed
+// * at the given pixel size
+template <typename Slap>
+void for_each_sdf_glyph(Sdf_Atlas *atlas, const char *text, int size, int x, int y, Slap slap) {
+  float scale = (float)size / (float)SDF_BASE_SIZE;
+  float pen_x = (float)x;
+
+  for (const char *c = text; *c; ++c) {
+    Sdf_Glyph *glyph = &atlas->glyphs[(unsigned char)*c];
+    if (!glyph->present) {
+      // * the chat messages are not checked upfront like the other texts
+      static std::atomic<bool> warned = false;
+      if (!warned.exchange(true)) {
+        fprintf(stderr, "WARNING: the SDF atlas only has the printable ASCII characters of the font, the others are skipped\n");
+      }
+      continue;
+    }
+
+    if (glyph->width > 0 && glyph->height > 0) {
+      FT_Bitmap bitmap;
+      sdf_reconstruct_glyph(atlas, glyph, scale, &bitmap);
+      slap(&bitmap,
+           (int)floorf(pen_x + (float)glyph->left * scale),
+           (int)floorf((float)y - (float)glyph->top * scale));
+    }
+
+    pen_x += glyph->advance * scale;
+  }
+}
+
+void slap_sdf_text_onto_image32(Image32_View surface, Sdf_Atlas *atlas, const char *text, int size, Pixels32 color, int x, int y) {
+  for_each_sdf_glyph(atlas, text, size, x, y, [&](FT_Bitmap *bitmap, int glyph_x, int glyph_y) {
+    slap_onto_image32(surface, bitmap, color, glyph_x, glyph_y);
+  });
+}
+
+void slap_sdf_text_onto_yuv420p(Yuv420p surface, Sdf_Atlas *atlas, const char *text, int size, Pixels32 color, int x, int y) {
+  for_each_sdf_glyph(atlas, text, size, x, y, [&](FT_Bitmap *bitmap, int glyph_x, int glyph_y) {
+    slap_onto_yuv420p(surface, bitmap, color, glyph_x, glyph_y);
+  });
+}
+
+void slap_sdf_text_onto_yuv444p(Yuv444p surface, Sdf_Atlas *atlas, const char *text, int size, Pixels32 color, int x, int y) {
+  for_each_sdf_glyph(atlas, text, size, x, y, [&](FT_Bitmap *bitmap, int glyph_x, int glyph_y) {
+    slap_onto_yuv444p(surface, bitmap, color, glyph_x, glyph_y);
+  });
+}
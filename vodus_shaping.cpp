@@ -0,0 +1,372 @@
+// * ###################################################################
+// * Text shaping
+// * ###################################################################
+
+// * Chat messages are UTF-8 with combining marks, CJK and emoji all over
+// * the place. The text is split into runs by the first face of the
+// * Font_Chain that has the glyph for the codepoint, every run is shaped by
+// * HarfBuzz and the result is cached by the text. Shaping is way more
+// * expensive than looking up the glyphs by char, but the same messages
+// * ("KEKW", "LUL") show up over and over again.
+
+constexpr uint32_t UTF8_REPLACEMENT_CHARACTER = 0xFFFD;
+
+// * Decodes the codepoint at text[*i] and moves *i past it.
+// * Malformed sequences become U+FFFD one byte at a time.
+uint32_t utf8_decode(const char *text, size_t size, size_t *i) {
+  const uint8_t *s = (const uint8_t *)text;
+  uint8_t c = s[*i];
+
+  size_t n = 0;
+  uint32_t codepoint = 0;
+  if (c < 0x80) {
+    *i += 1;
+    return c;
+  } else if ((c & 0xE0) == 0xC0) {
+    n = 2;
+    codepoint = c & 0x1F;
+  } else if ((c & 0xF0) == 0xE0) {
+    n = 3;
+    codepoint = c & 0x0F;
+  } else if ((c & 0xF8) == 0xF0) {
+    n = 4;
+    codepoint = c & 0x07;
+  } else {
+    *i += 1;
+    return UTF8_REPLACEMENT_CHARACTER;
+  }
+
+  if (*i + n > size) {
+    *i += 1;
+    return UTF8_REPLACEMENT_CHARACTER;
+  }
+
+  for (size_t k = 1; k < n; ++k) {
+    if ((s[*i + k] & 0xC0) != 0x80) {
+      *i += 1;
+      return UTF8_REPLACEMENT_CHARACTER;
+    }
+    codepoint = (codepoint << 6) | (s[*i + k] & 0x3F);
+  }
+
+  *i += n;
+  return codepoint;
+}
+
+constexpr size_t FONT_CHAIN_CAPACITY = 8;
+
+// * The faces are tried in order for every codepoint, the first one that
+// * has a glyph for it wins. The face 0 is the main font.
+// * The faces are opened on their first use, so a run that finds all of
+// * its texts and glyphs in the startup cache never opens any of them.
+struct Font_Chain {
+  size_t count;
+  FT_Library library;
+  const char *paths[FONT_CHAIN_CAPACITY];
+  // * nullptr until opened
+  FT_Face faces[FONT_CHAIN_CAPACITY];
+  hb_font_t *hb_fonts[FONT_CHAIN_CAPACITY];
+  int pixel_size;
+};
+
+void font_chain_push(Font_Chain *chain, FT_Library library, const char *path) {
+  assert(chain->count < FONT_CHAIN_CAPACITY);
+  chain->library = library;
+  chain->paths[chain->count] = path;
+  chain->count += 1;
+}
+
+void font_face_set_pixel_size(FT_Face face, hb_font_t *hb_font, int pixel_size) {
+  auto error = FT_Set_Pixel_Sizes(
+      face,                  /* handle to face object */
+      0,                     /* pixel_width           */
+      (FT_UInt)pixel_size);  /* pixel_height          */
+  if (error) {
+    fprintf(stderr, "could not set font size in pixels\n");
+    exit(1);
+  }
+  // * HarfBuzz has to pick up the new size of the face
+  hb_ft_font_changed(hb_font);
+}
+
+// * Opens the face on the first call
+FT_Face font_chain_face(Font_Chain *chain, size_t i) {
+  assert(i < chain->count);
+  if (chain->faces[i] == nullptr) {
+    FT_Face face;
+    auto error = FT_New_Face(chain->library, chain->paths[i], 0, &face);
+    if (error == FT_Err_Unknown_File_Format) {
+      fprintf(stderr, "the %s could be opened and read, but it appears that its font format is unsupported\n", chain->paths[i]);
+      exit(1);
+    } else if (error) {
+      fprintf(stderr, "could not load font %s\n", chain->paths[i]);
+      exit(1);
+    }
+    printf("Loaded %s\n", chain->paths[i]);
+
+    chain->faces[i] = face;
+    chain->hb_fonts[i] = hb_ft_font_create_referenced(face);
+    if (chain->pixel_size > 0) {
+      font_face_set_pixel_size(face, chain->hb_fonts[i], chain->pixel_size);
+    }
+  }
+  return chain->faces[i];
+}
+
+hb_font_t *font_chain_hb_font(Font_Chain *chain, size_t i) {
+  font_chain_face(chain, i);
+  return chain->hb_fonts[i];
+}
+
+void font_chain_set_pixel_size(Font_Chain *chain, int pixel_size) {
+  for (size_t i = 0; i < chain->count; ++i) {
+    if (chain->faces[i]) {
+      font_face_set_pixel_size(chain->faces[i], chain->hb_fonts[i], pixel_size);
+    }
+  }
+  chain->pixel_size = pixel_size;
+}
+
+size_t font_chain_face_for(Font_Chain *chain, uint32_t codepoint) {
+  for (size_t i = 0; i < chain->count; ++i) {
+    if (FT_Get_Char_Index(font_chain_face(chain, i), codepoint) != 0) {
+      return i;
+    }
+  }
+  // * nobody has it, the main font draws its .notdef box
+  return 0;
+}
+
+// * Codepoints that are drawn together with the previous one, so they have
+// * to stay in its run even if another face of the chain has them
+bool continues_run(uint32_t codepoint) {
+  if (codepoint == 0x200D) return true;                          // ZERO WIDTH JOINER
+  if (codepoint >= 0xFE00 && codepoint <= 0xFE0F) return true;   // variation selectors
+  if (codepoint >= 0xE0100 && codepoint <= 0xE01EF) return true; // variation selectors supplement
+  if (codepoint >= 0x1F3FB && codepoint <= 0x1F3FF) return true; // emoji skin tone modifiers
+
+  hb_unicode_general_category_t category =
+    hb_unicode_general_category(hb_unicode_funcs_get_default(), codepoint);
+  return category == HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK
+      || category == HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK
+      || category == HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK;
+}
+
+struct Shaped_Glyph {
+  uint32_t face;
+  uint32_t glyph_index;
+  // * 26.6 pixels, y goes up like in HarfBuzz
+  int32_t x_offset, y_offset;
+  int32_t x_advance, y_advance;
+};
+
+struct Shaped_Text {
+  // * the key: copy of the text and the pixel size it was shaped at
+  char *text;
+  size_t text_size;
+  int pixel_size;
+  uint64_t hash;
+  // * saved into the startup atlas, see shape_cache_keep
+  bool keep;
+
+  size_t count;
+  size_t capacity;
+  Shaped_Glyph *glyphs;
+};
+
+void shaped_text_push(Shaped_Text *shaped, Shaped_Glyph glyph) {
+  if (shaped->count >= shaped->capacity) {
+    shaped->capacity = shaped->capacity == 0 ? 16 : shaped->capacity * 2;
+    shaped->glyphs = (Shaped_Glyph *)realloc(shaped->glyphs, sizeof(Shaped_Glyph) * shaped->capacity);
+    assert(shaped->glyphs);
+  }
+  shaped->glyphs[shaped->count++] = glyph;
+}
+
+void shape_run(Font_Chain *chain, hb_buffer_t *buffer, Shaped_Text *shaped,
+               size_t face, size_t offset, size_t length) {
+  // * The whole text goes into the buffer, so HarfBuzz sees the context
+  // * around the run
+  hb_buffer_clear_contents(buffer);
+  hb_buffer_add_utf8(buffer, shaped->text, (int)shaped->text_size, (unsigned int)offset, (int)length);
+  hb_buffer_guess_segment_properties(buffer);
+  hb_shape(font_chain_hb_font(chain, face), buffer, nullptr, 0);
+
+  unsigned int count = 0;
+  hb_glyph_info_t *infos = hb_buffer_get_glyph_infos(buffer, &count);
+  hb_glyph_position_t *positions = hb_buffer_get_glyph_positions(buffer, &count);
+
+  for (unsigned int i = 0; i < count; ++i) {
+    Shaped_Glyph glyph = {};
+    glyph.face = (uint32_t)face;
+    glyph.glyph_index = infos[i].codepoint;
+    glyph.x_offset = positions[i].x_offset;
+    glyph.y_offset = positions[i].y_offset;
+    glyph.x_advance = positions[i].x_advance;
+    glyph.y_advance = positions[i].y_advance;
+    shaped_text_push(shaped, glyph);
+  }
+}
+
+// * shaped->text must be set
+void shape_text(Font_Chain *chain, hb_buffer_t *buffer, Shaped_Text *shaped) {
+  const char *text = shaped->text;
+  size_t size = shaped->text_size;
+
+  size_t run_begin = 0;
+  size_t run_face = 0;
+  bool run_started = false;
+
+  for (size_t i = 0; i < size;) {
+    size_t at = i;
+    uint32_t codepoint = utf8_decode(text, size, &i);
+
+    size_t face = run_started && continues_run(codepoint)
+      ? run_face
+      : font_chain_face_for(chain, codepoint);
+
+    if (!run_started) {
+      run_started = true;
+      run_face = face;
+    } else if (face != run_face) {
+      shape_run(chain, buffer, shaped, run_face, run_begin, at - run_begin);
+      run_begin = at;
+      run_face = face;
+    }
+  }
+
+  if (run_started) {
+    shape_run(chain, buffer, shaped, run_face, run_begin, size - run_begin);
+  }
+}
+
+// * Open addressing hash table of the shaped texts
+struct Shape_Cache {
+  size_t capacity;
+  size_t count;
+  Shaped_Text *entries;
+  hb_buffer_t *buffer;
+};
+
+uint64_t hash_text(const char *text, size_t size, int pixel_size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= (uint8_t)text[i];
+    hash *= 1099511628211ULL;
+  }
+  hash ^= (uint64_t)pixel_size;
+  hash *= 1099511628211ULL;
+  return hash;
+}
+
+Shaped_Text *shape_cache_find_slot(Shaped_Text *entries, size_t capacity,
+                                   const char *text, size_t size, int pixel_size, uint64_t hash) {
+  for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+    Shaped_Text *entry = &entries[i];
+    if (entry->text == nullptr) {
+      return entry;
+    }
+    if (entry->hash == hash
+        && entry->pixel_size == pixel_size
+        && entry->text_size == size
+        && memcmp(entry->text, text, size) == 0) {
+      return entry;
+    }
+  }
+}
+
+void shape_cache_grow(Shape_Cache *cache) {
+  size_t capacity = cache->capacity == 0 ? 256 : cache->capacity * 2;
+  Shaped_Text *entries = (Shaped_Text *)calloc(capacity, sizeof(Shaped_Text));
+  assert(entries);
+  memory_track_alloc(MEMORY_GLYPHS, capacity * sizeof(Shaped_Text));
+
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    Shaped_Text *entry = &cache->entries[i];
+    if (entry->text) {
+      *shape_cache_find_slot(entries, capacity, entry->text, entry->text_size, entry->pixel_size, entry->hash) = *entry;
+    }
+  }
+
+  free(cache->entries);
+  memory_track_free(MEMORY_GLYPHS, cache->capacity * sizeof(Shaped_Text));
+  cache->entries = entries;
+  cache->capacity = capacity;
+}
+
+// * Not thread-safe when the text is not in the cache yet
+const Shaped_Text *shape_cache_get(Shape_Cache *cache, Font_Chain *chain, const char *text) {
+  size_t size = strlen(text);
+  uint64_t hash = hash_text(text, size, chain->pixel_size);
+
+  if (cache->capacity > 0) {
+    Shaped_Text *entry = shape_cache_find_slot(cache->entries, cache->capacity, text, size, chain->pixel_size, hash);
+    if (entry->text) {
+      return entry;
+    }
+  }
+
+  // * keep the load factor under 70%
+  if ((cache->count + 1) * 10 > cache->capacity * 7) {
+    shape_cache_grow(cache);
+  }
+  if (cache->buffer == nullptr) {
+    cache->buffer = hb_buffer_create();
+  }
+
+  Shaped_Text *entry = shape_cache_find_slot(cache->entries, cache->capacity, text, size, chain->pixel_size, hash);
+  entry->text = (char *)malloc(size + 1);
+  assert(entry->text);
+  memcpy(entry->text, text, size + 1);
+  entry->text_size = size;
+  entry->pixel_size = chain->pixel_size;
+  entry->hash = hash;
+  shape_text(chain, cache->buffer, entry);
+  memory_track_alloc(MEMORY_GLYPHS, size + 1 + entry->capacity * sizeof(Shaped_Glyph));
+  cache->count += 1;
+
+  return entry;
+}
+
+// * Whether the entry is one of the texts, hashes are the hash_text of them
+bool text_in(const char *text, size_t size, uint64_t hash, const char *const *texts, const uint64_t *hashes, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (hashes[i] == hash && strlen(texts[i]) == size && memcmp(texts[i], text, size) == 0) return true;
+  }
+  return false;
+}
+
+// * Drops every text that is neither kept nor one of the texts. The chat
+// * modes call it with the messages on the screen, otherwise the cache
+// * would hold every message of an endless chat. The table keeps its
+// * capacity, the entries are inserted into a fresh one.
+void shape_cache_retain(Shape_Cache *cache, int pixel_size, const char *const *texts, const uint64_t *hashes, size_t count) {
+  if (cache->capacity == 0) return;
+  Shaped_Text *entries = (Shaped_Text *)calloc(cache->capacity, sizeof(Shaped_Text));
+  assert(entries);
+
+  size_t retained = 0;
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    Shaped_Text *entry = &cache->entries[i];
+    if (entry->text == nullptr) continue;
+    if (entry->keep || (entry->pixel_size == pixel_size && text_in(entry->text, entry->text_size, entry->hash, texts, hashes, count))) {
+      *shape_cache_find_slot(entries, cache->capacity, entry->text, entry->text_size, entry->pixel_size, entry->hash) = *entry;
+      retained += 1;
+    } else {
+      memory_track_free(MEMORY_GLYPHS, entry->text_size + 1 + entry->capacity * sizeof(Shaped_Glyph));
+      free(entry->text);
+      free(entry->glyphs);
+    }
+  }
+
+  free(cache->entries);
+  cache->entries = entries;
+  cache->count = retained;
+}
+
+// * Marks the text to be saved into the startup atlas (vodus_startup.cpp).
+// * Only the texts of the command line and of the batch jobs are kept, the
+// * chat of --live and --bench would make every warm start slower.
+void shape_cache_keep(Shape_Cache *cache, Font_Chain *chain, const char *text) {
+  ((Shaped_Text *)shape_cache_get(cache, chain, text))->keep = true;
+}
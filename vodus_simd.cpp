@@ -0,0 +1,1003 @@
+// * ###################################################################
+// * SIMD kernels
+// * ###################################################################
+
+// * The inner loops of the compositing and of the color conversion in
+// * scalar, SSE2, AVX2 and AVX-512 variants. The binary is built without
+// * -march, every variant is compiled for its own instruction set with the
+// * target attribute, and the best one the CPU supports is picked once on
+// * the start up (kernels_select). --simd caps the level, --list-kernels
+// * shows what every kernel ended up with and --check-kernels compares
+// * every variant against the scalar one (kernels_check).
+// *
+// * All the variants give bit-exact the same results as the scalar one,
+// * including the float blending, so the output does not depend on the
+// * machine it was rendered on.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VODUS_X86 1
+#include <immintrin.h>
+#endif
+
+enum Simd_Level {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_AVX512,
+  COUNT_SIMD_LEVELS,
+};
+
+const char *simd_level_names[COUNT_SIMD_LEVELS] = {"scalar", "sse2", "avx2", "avx512"};
+
+bool parse_simd_level(const char *name, Simd_Level *level) {
+  for (int i = 0; i < COUNT_SIMD_LEVELS; ++i) {
+    if (strcmp(name, simd_level_names[i]) == 0) {
+      *level = (Simd_Level)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+Simd_Level cpu_simd_level() {
+#ifdef VODUS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+  return SIMD_SCALAR;
+}
+
+// * a * b + c must not become an FMA in some of the variants only, the
+// * targets with AVX-512 have it
+#if defined(__GNUC__) && !defined(__clang__)
+#define VODUS_NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define VODUS_NO_CONTRACT
+#endif
+
+// * ------------------------------------------------------------------
+// * Scalar
+// * ------------------------------------------------------------------
+
+void fill_pixels32_scalar(Pixels32 *dst, size_t count, Pixels32 color) {
+  for (size_t i = 0; i < count; ++i) dst[i] = color;
+}
+
+void copy_pixels32_scalar(Pixels32 *dst, const Pixels32 *src, size_t count) {
+  memcpy(dst, src, sizeof(Pixels32) * count);
+}
+
+// * Text onto RGBA, the coverage is the alpha of the color
+VODUS_NO_CONTRACT void blend_pixels32_scalar(Pixels32 *dst, const uint8_t *coverage, size_t count, Pixels32 color) {
+  for (size_t i = 0; i < count; ++i) {
+    float a = coverage[i] / 255.0f;
+    dst[i].r = (uint8_t)(color.r * a + (1.0f - a) * dst[i].r);
+    dst[i].g = (uint8_t)(color.g * a + (1.0f - a) * dst[i].g);
+    dst[i].b = (uint8_t)(color.b * a + (1.0f - a) * dst[i].b);
+    dst[i].a = (uint8_t)(color.a * a + (1.0f - a) * dst[i].a);
+  }
+}
+
+// * Text onto a plane of Yuv420p, see blend_channel
+void blend_plane_scalar(uint8_t *dst, const uint8_t *coverage, size_t count, uint8_t value) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = (uint8_t)((value * coverage[i] + dst[i] * (255 - coverage[i]) + 127) / 255);
+  }
+}
+
+// * GIF color indices to RGB, the alpha of dst is kept
+void expand_palette_scalar(Pixels32 *dst, const uint8_t *indices, size_t count, const Pixels32 *palette) {
+  for (size_t i = 0; i < count; ++i) {
+    Pixels32 color = palette[indices[i]];
+    dst[i].r = color.r;
+    dst[i].g = color.g;
+    dst[i].b = color.b;
+  }
+}
+
+// * The formulas of rgb_to_y, rgb_to_u and rgb_to_v
+void rgba_to_y_scalar(uint8_t *y, const Pixels32 *src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    y[i] = (uint8_t)(((66 * src[i].r + 129 * src[i].g + 25 * src[i].b + 128) >> 8) + 16);
+  }
+}
+
+void rgba_to_uv_scalar(uint8_t *u, uint8_t *v, const Pixels32 *src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    u[i] = (uint8_t)(((-38 * src[i].r - 74 * src[i].g + 112 * src[i].b + 128) >> 8) + 128);
+    v[i] = (uint8_t)(((112 * src[i].r - 94 * src[i].g - 18 * src[i].b + 128) >> 8) + 128);
+  }
+}
+
+// * The separable filters of the text effects, see vodus_effects.cpp
+void max_plane_scalar(uint8_t *dst, const uint8_t *src, size_t count) {
+  for (size_t i = 0; i < count; ++i) dst[i] = std::max(dst[i], src[i]);
+}
+
+void accumulate_plane_scalar(uint16_t *sum, const uint8_t *src, size_t count) {
+  for (size_t i = 0; i < count; ++i) sum[i] = (uint16_t)(sum[i] + src[i]);
+}
+
+// * (sum * reciprocal) >> 16, that is the division of the box filter
+void divide_plane_scalar(uint8_t *dst, const uint16_t *sum, size_t count, uint16_t reciprocal) {
+  for (size_t i = 0; i < count; ++i) dst[i] = (uint8_t)(((uint32_t)sum[i] * reciprocal) >> 16);
+}
+
+// * The separable passes of the emote resampler, see vodus_resample.cpp.
+// * The weights are fixed point with RESAMPLE_WEIGHT_BITS fractional bits,
+// * the accumulator has 4 channels per pixel.
+constexpr int RESAMPLE_WEIGHT_BITS = 14;
+
+void weigh_pixels32_scalar(uint32_t *acc, const Pixels32 *src, size_t count, uint32_t weight) {
+  for (size_t i = 0; i < count; ++i) {
+    acc[4 * i + 0] += src[i].r * weight;
+    acc[4 * i + 1] += src[i].g * weight;
+    acc[4 * i + 2] += src[i].b * weight;
+    acc[4 * i + 3] += src[i].a * weight;
+  }
+}
+
+void resolve_pixels32_scalar(Pixels32 *dst, const uint32_t *acc, size_t count) {
+  constexpr uint32_t half = 1u << (RESAMPLE_WEIGHT_BITS - 1);
+  for (size_t i = 0; i < count; ++i) {
+    dst[i].r = (uint8_t)((acc[4 * i + 0] + half) >> RESAMPLE_WEIGHT_BITS);
+    dst[i].g = (uint8_t)((acc[4 * i + 1] + half) >> RESAMPLE_WEIGHT_BITS);
+    dst[i].b = (uint8_t)((acc[4 * i + 2] + half) >> RESAMPLE_WEIGHT_BITS);
+    dst[i].a = (uint8_t)((acc[4 * i + 3] + half) >> RESAMPLE_WEIGHT_BITS);
+  }
+}
+
+#ifdef VODUS_X86
+
+// * The pixels are little endian uint32: r | g << 8 | b << 16 | a << 24
+static_assert(sizeof(Pixels32) == 4, "the kernels treat a pixel as uint32");
+
+// * ------------------------------------------------------------------
+// * SSE2
+// * ------------------------------------------------------------------
+
+#define VODUS_SSE2 __attribute__((target("sse2")))
+
+VODUS_SSE2 void fill_pixels32_sse2(Pixels32 *dst, size_t count, Pixels32 color) {
+  uint32_t value;
+  memcpy(&value, &color, sizeof(value));
+  __m128i v = _mm_set1_epi32((int)value);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) _mm_storeu_si128((__m128i *)(dst + i), v);
+  fill_pixels32_scalar(dst + i, count - i, color);
+}
+
+VODUS_SSE2 void copy_pixels32_sse2(Pixels32 *dst, const Pixels32 *src, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+  }
+  copy_pixels32_scalar(dst + i, src + i, count - i);
+}
+
+// * One pixel per vector, the four channels of it side by side
+VODUS_SSE2 VODUS_NO_CONTRACT void blend_pixels32_sse2(Pixels32 *dst, const uint8_t *coverage, size_t count, Pixels32 color) {
+  __m128i zero = _mm_setzero_si128();
+  __m128 colorf = _mm_setr_ps(color.r, color.g, color.b, color.a);
+  __m128 one = _mm_set1_ps(1.0f);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint32_t cov;
+    memcpy(&cov, coverage + i, sizeof(cov));
+    if (cov == 0) continue;
+
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i d16[2] = {_mm_unpacklo_epi8(d, zero), _mm_unpackhi_epi8(d, zero)};
+    __m128i r32[4];
+    for (int p = 0; p < 4; ++p) {
+      __m128i d32 = p % 2 == 0 ? _mm_unpacklo_epi16(d16[p / 2], zero) : _mm_unpackhi_epi16(d16[p / 2], zero);
+      __m128 a = _mm_set1_ps(coverage[i + (size_t)p] / 255.0f);
+      __m128 result = _mm_add_ps(_mm_mul_ps(colorf, a), _mm_mul_ps(_mm_sub_ps(one, a), _mm_cvtepi32_ps(d32)));
+      r32[p] = _mm_cvttps_epi32(result);
+    }
+    __m128i r16lo = _mm_packs_epi32(r32[0], r32[1]);
+    __m128i r16hi = _mm_packs_epi32(r32[2], r32[3]);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(r16lo, r16hi));
+  }
+  blend_pixels32_scalar(dst + i, coverage + i, count - i, color);
+}
+
+// * x / 255 == (x + 1 + (x >> 8)) >> 8 for all the x below 65535
+VODUS_SSE2 static inline __m128i div255_epu16_sse2(__m128i x) {
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+VODUS_SSE2 void blend_plane_sse2(uint8_t *dst, const uint8_t *coverage, size_t count, uint8_t value) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i value16 = _mm_set1_epi16(value);
+  __m128i max16 = _mm_set1_epi16(255);
+  __m128i half16 = _mm_set1_epi16(127);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(coverage + i)), zero);
+    __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(dst + i)), zero);
+    // * at most 255 * 255 + 127, fits into unsigned 16 bits
+    __m128i x = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(value16, a),
+                                            _mm_mullo_epi16(d, _mm_sub_epi16(max16, a))),
+                              half16);
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(div255_epu16_sse2(x), zero));
+  }
+  blend_plane_scalar(dst + i, coverage + i, count - i, value);
+}
+
+// * No gather in SSE2, only the alpha is merged in vectors
+VODUS_SSE2 void expand_palette_sse2(Pixels32 *dst, const uint8_t *indices, size_t count, const Pixels32 *palette) {
+  const uint32_t *table = (const uint32_t *)palette;
+  __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i colors = _mm_setr_epi32((int)table[indices[i]], (int)table[indices[i + 1]],
+                                    (int)table[indices[i + 2]], (int)table[indices[i + 3]]);
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i result = _mm_or_si128(_mm_and_si128(d, alpha), _mm_andnot_si128(alpha, colors));
+    _mm_storeu_si128((__m128i *)(dst + i), result);
+  }
+  expand_palette_scalar(dst + i, indices + i, count - i, palette);
+}
+
+// * The channels of 8 pixels as 16 bit lanes
+VODUS_SSE2 static inline void split_channels_sse2(const Pixels32 *src, __m128i *r, __m128i *g, __m128i *b) {
+  __m128i mask = _mm_set1_epi32(0xff);
+  __m128i lo = _mm_loadu_si128((const __m128i *)src);
+  __m128i hi = _mm_loadu_si128((const __m128i *)(src + 4));
+  *r = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+  *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask), _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+  *b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask), _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+}
+
+// * 66 * 255 + 129 * 255 + 25 * 255 + 128 still fits into unsigned 16 bits
+VODUS_SSE2 void rgba_to_y_sse2(uint8_t *y, const Pixels32 *src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i r, g, b;
+    split_channels_sse2(src + i, &r, &g, &b);
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                                              _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+                                _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+    __m128i result = _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+    _mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(result, _mm_setzero_si128()));
+  }
+  rgba_to_y_scalar(y + i, src + i, count - i);
+}
+
+// * and the chroma sums fit into signed 16 bits
+VODUS_SSE2 void rgba_to_uv_sse2(uint8_t *u, uint8_t *v, const Pixels32 *src, size_t count) {
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i r, g, b;
+    split_channels_sse2(src + i, &r, &g, &b);
+    __m128i su = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-38)),
+                                             _mm_mullo_epi16(g, _mm_set1_epi16(-74))),
+                               _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)), _mm_set1_epi16(128)));
+    __m128i sv = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+                                             _mm_mullo_epi16(g, _mm_set1_epi16(-94))),
+                               _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(-18)), _mm_set1_epi16(128)));
+    __m128i ru = _mm_add_epi16(_mm_srai_epi16(su, 8), _mm_set1_epi16(128));
+    __m128i rv = _mm_add_epi16(_mm_srai_epi16(sv, 8), _mm_set1_epi16(128));
+    _mm_storel_epi64((__m128i *)(u + i), _mm_packus_epi16(ru, zero));
+    _mm_storel_epi64((__m128i *)(v + i), _mm_packus_epi16(rv, zero));
+  }
+  rgba_to_uv_scalar(u + i, v + i, src + i, count - i);
+}
+
+VODUS_SSE2 void max_plane_sse2(uint8_t *dst, const uint8_t *src, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_max_epu8(d, s));
+  }
+  max_plane_scalar(dst + i, src + i, count - i);
+}
+
+VODUS_SSE2 void accumulate_plane_sse2(uint16_t *sum, const uint8_t *src, size_t count) {
+  __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + i)), zero);
+    __m128i d = _mm_loadu_si128((const __m128i *)(sum + i));
+    _mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi16(d, s));
+  }
+  accumulate_plane_scalar(sum + i, src + i, count - i);
+}
+
+VODUS_SSE2 void divide_plane_sse2(uint8_t *dst, const uint16_t *sum, size_t count, uint16_t reciprocal) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i r = _mm_set1_epi16((short)reciprocal);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i q = _mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)(sum + i)), r);
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(q, zero));
+  }
+  divide_plane_scalar(dst + i, sum + i, count - i, reciprocal);
+}
+
+// * No 32 bit multiplication in SSE2. The weight is below 2^15, so the
+// * pairs of 16 bit halves of madd are (channel, 0) * (weight, 0).
+VODUS_SSE2 void weigh_pixels32_sse2(uint32_t *acc, const Pixels32 *src, size_t count, uint32_t weight) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i w = _mm_set1_epi32((int)weight);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_unpacklo_epi8(p, zero);
+    __m128i hi = _mm_unpackhi_epi8(p, zero);
+    __m128i c[4] = {_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+                    _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+    for (size_t k = 0; k < 4; ++k) {
+      __m128i *a = (__m128i *)(acc + 4 * (i + k));
+      _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_madd_epi16(c[k], w)));
+    }
+  }
+  weigh_pixels32_scalar(acc + 4 * i, src + i, count - i, weight);
+}
+
+VODUS_SSE2 void resolve_pixels32_sse2(Pixels32 *dst, const uint32_t *acc, size_t count) {
+  __m128i half = _mm_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i c[4];
+    for (size_t k = 0; k < 4; ++k) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(acc + 4 * (i + k)));
+      c[k] = _mm_srli_epi32(_mm_add_epi32(a, half), RESAMPLE_WEIGHT_BITS);
+    }
+    __m128i lo = _mm_packs_epi32(c[0], c[1]);
+    __m128i hi = _mm_packs_epi32(c[2], c[3]);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+  resolve_pixels32_scalar(dst + i, acc + 4 * i, count - i);
+}
+
+// * ------------------------------------------------------------------
+// * AVX2
+// * ------------------------------------------------------------------
+
+#define VODUS_AVX2 __attribute__((target("avx2")))
+
+VODUS_AVX2 void fill_pixels32_avx2(Pixels32 *dst, size_t count, Pixels32 color) {
+  uint32_t value;
+  memcpy(&value, &color, sizeof(value));
+  __m256i v = _mm256_set1_epi32((int)value);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) _mm256_storeu_si256((__m256i *)(dst + i), v);
+  fill_pixels32_scalar(dst + i, count - i, color);
+}
+
+VODUS_AVX2 void copy_pixels32_avx2(Pixels32 *dst, const Pixels32 *src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+  }
+  copy_pixels32_scalar(dst + i, src + i, count - i);
+}
+
+// * Two pixels per vector
+VODUS_AVX2 VODUS_NO_CONTRACT void blend_pixels32_avx2(Pixels32 *dst, const uint8_t *coverage, size_t count, Pixels32 color) {
+  __m256 colorf = _mm256_setr_ps(color.r, color.g, color.b, color.a, color.r, color.g, color.b, color.a);
+  __m256 one = _mm256_set1_ps(1.0f);
+
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    if (coverage[i] == 0 && coverage[i + 1] == 0) continue;
+
+    float a0 = coverage[i] / 255.0f;
+    float a1 = coverage[i + 1] / 255.0f;
+    __m256 a = _mm256_setr_ps(a0, a0, a0, a0, a1, a1, a1, a1);
+    __m256i d32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(dst + i)));
+    __m256 result = _mm256_add_ps(_mm256_mul_ps(colorf, a), _mm256_mul_ps(_mm256_sub_ps(one, a), _mm256_cvtepi32_ps(d32)));
+    __m256i r32 = _mm256_cvttps_epi32(result);
+    __m128i r16 = _mm_packs_epi32(_mm256_castsi256_si128(r32), _mm256_extracti128_si256(r32, 1));
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(r16, r16));
+  }
+  blend_pixels32_scalar(dst + i, coverage + i, count - i, color);
+}
+
+VODUS_AVX2 void blend_plane_avx2(uint8_t *dst, const uint8_t *coverage, size_t count, uint8_t value) {
+  __m256i value16 = _mm256_set1_epi16(value);
+  __m256i max16 = _mm256_set1_epi16(255);
+  __m256i one16 = _mm256_set1_epi16(1);
+  __m256i half16 = _mm256_set1_epi16(127);
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(coverage + i)));
+    __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(dst + i)));
+    __m256i x = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(value16, a),
+                                                  _mm256_mullo_epi16(d, _mm256_sub_epi16(max16, a))),
+                                 half16);
+    __m256i q = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, one16), _mm256_srli_epi16(x, 8)), 8);
+    __m128i result = _mm_packus_epi16(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+    _mm_storeu_si128((__m128i *)(dst + i), result);
+  }
+  blend_plane_scalar(dst + i, coverage + i, count - i, value);
+}
+
+VODUS_AVX2 void expand_palette_avx2(Pixels32 *dst, const uint8_t *indices, size_t count, const Pixels32 *palette) {
+  const int *table = (const int *)palette;
+  __m256i alpha = _mm256_set1_epi32((int)0xff000000u);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(indices + i)));
+    __m256i colors = _mm256_i32gather_epi32(table, index, 4);
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_and_si256(d, alpha), _mm256_andnot_si256(alpha, colors)));
+  }
+  expand_palette_scalar(dst + i, indices + i, count - i, palette);
+}
+
+// * 8 pixels in 32 bit lanes to 8 bytes
+VODUS_AVX2 static inline void store_epi32_as_u8_avx2(uint8_t *dst, __m256i x) {
+  __m128i x16 = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+  _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(x16, x16));
+}
+
+VODUS_AVX2 void rgba_to_y_avx2(uint8_t *y, const Pixels32 *src, size_t count) {
+  __m256i mask = _mm256_set1_epi32(0xff);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i r = _mm256_and_si256(p, mask);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask);
+    __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(66)),
+                                                    _mm256_mullo_epi32(g, _mm256_set1_epi32(129))),
+                                   _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(25)), _mm256_set1_epi32(128)));
+    store_epi32_as_u8_avx2(y + i, _mm256_add_epi32(_mm256_srai_epi32(sum, 8), _mm256_set1_epi32(16)));
+  }
+  rgba_to_y_scalar(y + i, src + i, count - i);
+}
+
+VODUS_AVX2 void rgba_to_uv_avx2(uint8_t *u, uint8_t *v, const Pixels32 *src, size_t count) {
+  __m256i mask = _mm256_set1_epi32(0xff);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i r = _mm256_and_si256(p, mask);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask);
+    __m256i su = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(-38)),
+                                                   _mm256_mullo_epi32(g, _mm256_set1_epi32(-74))),
+                                  _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(112)), _mm256_set1_epi32(128)));
+    __m256i sv = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(112)),
+                                                   _mm256_mullo_epi32(g, _mm256_set1_epi32(-94))),
+                                  _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(-18)), _mm256_set1_epi32(128)));
+    store_epi32_as_u8_avx2(u + i, _mm256_add_epi32(_mm256_srai_epi32(su, 8), _mm256_set1_epi32(128)));
+    store_epi32_as_u8_avx2(v + i, _mm256_add_epi32(_mm256_srai_epi32(sv, 8), _mm256_set1_epi32(128)));
+  }
+  rgba_to_uv_scalar(u + i, v + i, src + i, count - i);
+}
+
+VODUS_AVX2 void max_plane_avx2(uint8_t *dst, const uint8_t *src, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epu8(d, s));
+  }
+  max_plane_scalar(dst + i, src + i, count - i);
+}
+
+VODUS_AVX2 void accumulate_plane_avx2(uint16_t *sum, const uint8_t *src, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(sum + i));
+    _mm256_storeu_si256((__m256i *)(sum + i), _mm256_add_epi16(d, s));
+  }
+  accumulate_plane_scalar(sum + i, src + i, count - i);
+}
+
+VODUS_AVX2 void divide_plane_avx2(uint8_t *dst, const uint16_t *sum, size_t count, uint16_t reciprocal) {
+  __m256i r = _mm256_set1_epi16((short)reciprocal);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i q = _mm256_mulhi_epu16(_mm256_loadu_si256((const __m256i *)(sum + i)), r);
+    // * the quotients are at most 255, packing the halves keeps them in order
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1)));
+  }
+  divide_plane_scalar(dst + i, sum + i, count - i, reciprocal);
+}
+
+// * Two pixels per vector
+VODUS_AVX2 void weigh_pixels32_avx2(uint32_t *acc, const Pixels32 *src, size_t count, uint32_t weight) {
+  __m256i w = _mm256_set1_epi32((int)weight);
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+    __m256i *a = (__m256i *)(acc + 4 * i);
+    _mm256_storeu_si256(a, _mm256_add_epi32(_mm256_loadu_si256(a), _mm256_mullo_epi32(c, w)));
+  }
+  weigh_pixels32_scalar(acc + 4 * i, src + i, count - i, weight);
+}
+
+VODUS_AVX2 void resolve_pixels32_avx2(Pixels32 *dst, const uint32_t *acc, size_t count) {
+  __m256i half = _mm256_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+  // * the packs work within the 128 bit lanes, this puts the pixels back
+  // * in order
+  __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i c[4];
+    for (size_t k = 0; k < 4; ++k) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(acc + 4 * (i + 2 * k)));
+      c[k] = _mm256_srli_epi32(_mm256_add_epi32(a, half), RESAMPLE_WEIGHT_BITS);
+    }
+    __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(c[0], c[1]), _mm256_packs_epi32(c[2], c[3]));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permutevar8x32_epi32(bytes, order));
+  }
+  resolve_pixels32_scalar(dst + i, acc + 4 * i, count - i);
+}
+
+// * ------------------------------------------------------------------
+// * AVX-512
+// * ------------------------------------------------------------------
+
+#define VODUS_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+// * GCC 12 warns about the _mm512_undefined_* inside its own intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+VODUS_AVX512 void fill_pixels32_avx512(Pixels32 *dst, size_t count, Pixels32 color) {
+  uint32_t value;
+  memcpy(&value, &color, sizeof(value));
+  __m512i v = _mm512_set1_epi32((int)value);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) _mm512_storeu_si512((void *)(dst + i), v);
+  // * the tail in one masked store
+  __mmask16 tail = (__mmask16)((1u << (count - i)) - 1);
+  _mm512_mask_storeu_epi32((void *)(dst + i), tail, v);
+}
+
+VODUS_AVX512 void copy_pixels32_avx512(Pixels32 *dst, const Pixels32 *src, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    _mm512_storeu_si512((void *)(dst + i), _mm512_loadu_si512((const void *)(src + i)));
+  }
+  __mmask16 tail = (__mmask16)((1u << (count - i)) - 1);
+  _mm512_mask_storeu_epi32((void *)(dst + i), tail, _mm512_maskz_loadu_epi32(tail, (const void *)(src + i)));
+}
+
+// * Four pixels per vector
+VODUS_AVX512 VODUS_NO_CONTRACT void blend_pixels32_avx512(Pixels32 *dst, const uint8_t *coverage, size_t count, Pixels32 color) {
+  __m512 colorf = _mm512_setr_ps(color.r, color.g, color.b, color.a, color.r, color.g, color.b, color.a,
+                                 color.r, color.g, color.b, color.a, color.r, color.g, color.b, color.a);
+  __m512 one = _mm512_set1_ps(1.0f);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint32_t cov;
+    memcpy(&cov, coverage + i, sizeof(cov));
+    if (cov == 0) continue;
+
+    float a0 = coverage[i] / 255.0f;
+    float a1 = coverage[i + 1] / 255.0f;
+    float a2 = coverage[i + 2] / 255.0f;
+    float a3 = coverage[i + 3] / 255.0f;
+    __m512 a = _mm512_setr_ps(a0, a0, a0, a0, a1, a1, a1, a1, a2, a2, a2, a2, a3, a3, a3, a3);
+    __m512i d32 = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(dst + i)));
+    __m512 result = _mm512_add_ps(_mm512_mul_ps(colorf, a), _mm512_mul_ps(_mm512_sub_ps(one, a), _mm512_cvtepi32_ps(d32)));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(result)));
+  }
+  blend_pixels32_scalar(dst + i, coverage + i, count - i, color);
+}
+
+VODUS_AVX512 void blend_plane_avx512(uint8_t *dst, const uint8_t *coverage, size_t count, uint8_t value) {
+  __m512i value16 = _mm512_set1_epi16(value);
+  __m512i max16 = _mm512_set1_epi16(255);
+  __m512i one16 = _mm512_set1_epi16(1);
+  __m512i half16 = _mm512_set1_epi16(127);
+
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m512i a = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(coverage + i)));
+    __m512i d = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(dst + i)));
+    __m512i x = _mm512_add_epi16(_mm512_add_epi16(_mm512_mullo_epi16(value16, a),
+                                                  _mm512_mullo_epi16(d, _mm512_sub_epi16(max16, a))),
+                                 half16);
+    __m512i q = _mm512_srli_epi16(_mm512_add_epi16(_mm512_add_epi16(x, one16), _mm512_srli_epi16(x, 8)), 8);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm512_cvtepi16_epi8(q));
+  }
+  blend_plane_scalar(dst + i, coverage + i, count - i, value);
+}
+
+VODUS_AVX512 void expand_palette_avx512(Pixels32 *dst, const uint8_t *indices, size_t count, const Pixels32 *palette) {
+  __m512i alpha = _mm512_set1_epi32((int)0xff000000u);
+
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i index = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(indices + i)));
+    __m512i colors = _mm512_i32gather_epi32(index, (const void *)palette, 4);
+    __m512i d = _mm512_loadu_si512((const void *)(dst + i));
+    // * bits from colors where alpha is 0, from d where it is 1
+    _mm512_storeu_si512((void *)(dst + i), _mm512_ternarylogic_epi32(alpha, d, colors, 0xca));
+  }
+  expand_palette_scalar(dst + i, indices + i, count - i, palette);
+}
+
+VODUS_AVX512 void rgba_to_y_avx512(uint8_t *y, const Pixels32 *src, size_t count) {
+  __m512i mask = _mm512_set1_epi32(0xff);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i p = _mm512_loadu_si512((const void *)(src + i));
+    __m512i r = _mm512_and_si512(p, mask);
+    __m512i g = _mm512_and_si512(_mm512_srli_epi32(p, 8), mask);
+    __m512i b = _mm512_and_si512(_mm512_srli_epi32(p, 16), mask);
+    __m512i sum = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(r, _mm512_set1_epi32(66)),
+                                                    _mm512_mullo_epi32(g, _mm512_set1_epi32(129))),
+                                   _mm512_add_epi32(_mm512_mullo_epi32(b, _mm512_set1_epi32(25)), _mm512_set1_epi32(128)));
+    __m512i result = _mm512_add_epi32(_mm512_srai_epi32(sum, 8), _mm512_set1_epi32(16));
+    _mm_storeu_si128((__m128i *)(y + i), _mm512_cvtepi32_epi8(result));
+  }
+  rgba_to_y_scalar(y + i, src + i, count - i);
+}
+
+VODUS_AVX512 void rgba_to_uv_avx512(uint8_t *u, uint8_t *v, const Pixels32 *src, size_t count) {
+  __m512i mask = _mm512_set1_epi32(0xff);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512i p = _mm512_loadu_si512((const void *)(src + i));
+    __m512i r = _mm512_and_si512(p, mask);
+    __m512i g = _mm512_and_si512(_mm512_srli_epi32(p, 8), mask);
+    __m512i b = _mm512_and_si512(_mm512_srli_epi32(p, 16), mask);
+    __m512i su = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(r, _mm512_set1_epi32(-38)),
+                                                   _mm512_mullo_epi32(g, _mm512_set1_epi32(-74))),
+                                  _mm512_add_epi32(_mm512_mullo_epi32(b, _mm512_set1_epi32(112)), _mm512_set1_epi32(128)));
+    __m512i sv = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(r, _mm512_set1_epi32(112)),
+                                                   _mm512_mullo_epi32(g, _mm512_set1_epi32(-94))),
+                                  _mm512_add_epi32(_mm512_mullo_epi32(b, _mm512_set1_epi32(-18)), _mm512_set1_epi32(128)));
+    _mm_storeu_si128((__m128i *)(u + i), _mm512_cvtepi32_epi8(_mm512_add_epi32(_mm512_srai_epi32(su, 8), _mm512_set1_epi32(128))));
+    _mm_storeu_si128((__m128i *)(v + i), _mm512_cvtepi32_epi8(_mm512_add_epi32(_mm512_srai_epi32(sv, 8), _mm512_set1_epi32(128))));
+  }
+  rgba_to_uv_scalar(u + i, v + i, src + i, count - i);
+}
+
+VODUS_AVX512 void max_plane_avx512(uint8_t *dst, const uint8_t *src, size_t count) {
+  size_t i = 0;
+  for (; i + 64 <= count; i += 64) {
+    __m512i d = _mm512_loadu_si512((const void *)(dst + i));
+    __m512i s = _mm512_loadu_si512((const void *)(src + i));
+    _mm512_storeu_si512((void *)(dst + i), _mm512_max_epu8(d, s));
+  }
+  max_plane_scalar(dst + i, src + i, count - i);
+}
+
+VODUS_AVX512 void accumulate_plane_avx512(uint16_t *sum, const uint8_t *src, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m512i s = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(src + i)));
+    __m512i d = _mm512_loadu_si512((const void *)(sum + i));
+    _mm512_storeu_si512((void *)(sum + i), _mm512_add_epi16(d, s));
+  }
+  accumulate_plane_scalar(sum + i, src + i, count - i);
+}
+
+VODUS_AVX512 void divide_plane_avx512(uint8_t *dst, const uint16_t *sum, size_t count, uint16_t reciprocal) {
+  __m512i r = _mm512_set1_epi16((short)reciprocal);
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m512i q = _mm512_mulhi_epu16(_mm512_loadu_si512((const void *)(sum + i)), r);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm512_cvtepi16_epi8(q));
+  }
+  divide_plane_scalar(dst + i, sum + i, count - i, reciprocal);
+}
+
+// * Four pixels per vector
+VODUS_AVX512 void weigh_pixels32_avx512(uint32_t *acc, const Pixels32 *src, size_t count, uint32_t weight) {
+  __m512i w = _mm512_set1_epi32((int)weight);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m512i c = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+    uint32_t *a = acc + 4 * i;
+    _mm512_storeu_si512((void *)a, _mm512_add_epi32(_mm512_loadu_si512((const void *)a), _mm512_mullo_epi32(c, w)));
+  }
+  weigh_pixels32_scalar(acc + 4 * i, src + i, count - i, weight);
+}
+
+VODUS_AVX512 void resolve_pixels32_avx512(Pixels32 *dst, const uint32_t *acc, size_t count) {
+  __m512i half = _mm512_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m512i a = _mm512_loadu_si512((const void *)(acc + 4 * i));
+    __m512i c = _mm512_srli_epi32(_mm512_add_epi32(a, half), RESAMPLE_WEIGHT_BITS);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm512_cvtepi32_epi8(c));
+  }
+  resolve_pixels32_scalar(dst + i, acc + 4 * i, count - i);
+}
+
+#pragma GCC diagnostic pop
+
+#define VODUS_VARIANTS(name) {name##_scalar, name##_sse2, name##_avx2, name##_avx512}
+#else
+#define VODUS_VARIANTS(name) {name##_scalar, nullptr, nullptr, nullptr}
+#endif // VODUS_X86
+
+// * ------------------------------------------------------------------
+// * Dispatch
+// * ------------------------------------------------------------------
+
+// * run starts as the scalar variant, so the kernels work before
+// * kernels_select too
+template <typename F>
+struct Kernel {
+  const char *name;
+  // * nullptr where there is no variant for the level
+  F variants[COUNT_SIMD_LEVELS];
+  F run;
+  Simd_Level level;
+};
+
+using Fill_Pixels32 = void (*)(Pixels32 *, size_t, Pixels32);
+using Copy_Pixels32 = void (*)(Pixels32 *, const Pixels32 *, size_t);
+using Blend_Pixels32 = void (*)(Pixels32 *, const uint8_t *, size_t, Pixels32);
+using Blend_Plane = void (*)(uint8_t *, const uint8_t *, size_t, uint8_t);
+using Expand_Palette = void (*)(Pixels32 *, const uint8_t *, size_t, const Pixels32 *);
+using Rgba_To_Y = void (*)(uint8_t *, const Pixels32 *, size_t);
+using Rgba_To_Uv = void (*)(uint8_t *, uint8_t *, const Pixels32 *, size_t);
+using Max_Plane = void (*)(uint8_t *, const uint8_t *, size_t);
+using Accumulate_Plane = void (*)(uint16_t *, const uint8_t *, size_t);
+using Divide_Plane = void (*)(uint8_t *, const uint16_t *, size_t, uint16_t);
+using Weigh_Pixels32 = void (*)(uint32_t *, const Pixels32 *, size_t, uint32_t);
+using Resolve_Pixels32 = void (*)(Pixels32 *, const uint32_t *, size_t);
+
+Kernel<Fill_Pixels32> fill_pixels32 = {"fill", VODUS_VARIANTS(fill_pixels32), fill_pixels32_scalar, SIMD_SCALAR};
+Kernel<Copy_Pixels32> copy_pixels32 = {"blit", VODUS_VARIANTS(copy_pixels32), copy_pixels32_scalar, SIMD_SCALAR};
+Kernel<Blend_Pixels32> blend_pixels32 = {"text-blend-rgba", VODUS_VARIANTS(blend_pixels32), blend_pixels32_scalar, SIMD_SCALAR};
+Kernel<Blend_Plane> blend_plane = {"text-blend-yuv", VODUS_VARIANTS(blend_plane), blend_plane_scalar, SIMD_SCALAR};
+Kernel<Expand_Palette> expand_palette = {"palette-expand", VODUS_VARIANTS(expand_palette), expand_palette_scalar, SIMD_SCALAR};
+Kernel<Rgba_To_Y> rgba_to_y = {"rgba-to-y", VODUS_VARIANTS(rgba_to_y), rgba_to_y_scalar, SIMD_SCALAR};
+Kernel<Rgba_To_Uv> rgba_to_uv = {"rgba-to-uv", VODUS_VARIANTS(rgba_to_uv), rgba_to_uv_scalar, SIMD_SCALAR};
+Kernel<Max_Plane> max_plane = {"effect-dilate", VODUS_VARIANTS(max_plane), max_plane_scalar, SIMD_SCALAR};
+Kernel<Accumulate_Plane> accumulate_plane = {"effect-blur-sum", VODUS_VARIANTS(accumulate_plane), accumulate_plane_scalar, SIMD_SCALAR};
+Kernel<Divide_Plane> divide_plane = {"effect-blur-div", VODUS_VARIANTS(divide_plane), divide_plane_scalar, SIMD_SCALAR};
+Kernel<Weigh_Pixels32> weigh_pixels32 = {"resample-weigh", VODUS_VARIANTS(weigh_pixels32), weigh_pixels32_scalar, SIMD_SCALAR};
+Kernel<Resolve_Pixels32> resolve_pixels32 = {"resample-resolve", VODUS_VARIANTS(resolve_pixels32), resolve_pixels32_scalar, SIMD_SCALAR};
+
+template <typename F>
+void kernel_select(Kernel<F> *kernel, Simd_Level max_level) {
+  for (int level = max_level; level >= SIMD_SCALAR; --level) {
+    if (kernel->variants[level]) {
+      kernel->run = kernel->variants[level];
+      kernel->level = (Simd_Level)level;
+      return;
+    }
+  }
+}
+
+template <typename F>
+void kernel_print(FILE *stream, Kernel<F> *kernel) {
+  fprintf(stream, "    %-16s %s\n", kernel->name, simd_level_names[kernel->level]);
+}
+
+// * Called once on the start up before any thread is started
+void kernels_select(Simd_Level max_level) {
+  kernel_select(&fill_pixels32, max_level);
+  kernel_select(&copy_pixels32, max_level);
+  kernel_select(&blend_pixels32, max_level);
+  kernel_select(&blend_plane, max_level);
+  kernel_select(&expand_palette, max_level);
+  kernel_select(&rgba_to_y, max_level);
+  kernel_select(&rgba_to_uv, max_level);
+  kernel_select(&max_plane, max_level);
+  kernel_select(&accumulate_plane, max_level);
+  kernel_select(&divide_plane, max_level);
+  kernel_select(&weigh_pixels32, max_level);
+  kernel_select(&resolve_pixels32, max_level);
+}
+
+void kernels_print(FILE *stream) {
+  fprintf(stream, "CPU: %s\n", simd_level_names[cpu_simd_level()]);
+  fprintf(stream, "Kernels:\n");
+  kernel_print(stream, &fill_pixels32);
+  kernel_print(stream, &copy_pixels32);
+  kernel_print(stream, &blend_pixels32);
+  kernel_print(stream, &blend_plane);
+  kernel_print(stream, &expand_palette);
+  kernel_print(stream, &rgba_to_y);
+  kernel_print(stream, &rgba_to_uv);
+  kernel_print(stream, &max_plane);
+  kernel_print(stream, &accumulate_plane);
+  kernel_print(stream, &divide_plane);
+  kernel_print(stream, &weigh_pixels32);
+  kernel_print(stream, &resolve_pixels32);
+}
+
+// * ------------------------------------------------------------------
+// * Self-check
+// * ------------------------------------------------------------------
+
+// * --check-kernels runs every variant up to the level against the scalar
+// * one on random inputs. The lengths go up to a few of the widest vectors
+// * and the starts are shifted off the alignment, so the tails after the
+// * last full vector are covered too. The destinations are compared past
+// * the length as well, a variant must not write there.
+constexpr size_t KERNEL_CHECK_MAX_COUNT = 200;
+constexpr size_t KERNEL_CHECK_OFFSETS = 4;
+constexpr size_t KERNEL_CHECK_GUARD = 64;
+constexpr size_t KERNEL_CHECK_CAPACITY = KERNEL_CHECK_OFFSETS + KERNEL_CHECK_MAX_COUNT + KERNEL_CHECK_GUARD;
+
+// * xorshift64, the same inputs on every run
+uint64_t kernel_check_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+void kernel_check_fill(void *data, size_t size, uint64_t *state) {
+  uint8_t *bytes = (uint8_t *)data;
+  for (size_t i = 0; i < size; ++i) bytes[i] = (uint8_t)kernel_check_random(state);
+}
+
+// * check(variant, count, offset) runs the variant and the scalar one on
+// * the same inputs and tells whether they agree
+template <typename F, typename Check>
+bool kernel_check(FILE *stream, Kernel<F> *kernel, Simd_Level max_level, Check check) {
+  bool ok = true;
+  for (int level = SIMD_SCALAR + 1; level <= max_level; ++level) {
+    F variant = kernel->variants[level];
+    if (variant == nullptr) continue;
+
+    bool passed = true;
+    size_t count = 0;
+    size_t offset = 0;
+    for (count = 0; passed && count <= KERNEL_CHECK_MAX_COUNT; ++count) {
+      for (offset = 0; passed && offset < KERNEL_CHECK_OFFSETS; ++offset) {
+        passed = check(variant, count, offset);
+      }
+    }
+
+    if (passed) {
+      fprintf(stream, "    %-16s %-7s ok\n", kernel->name, simd_level_names[level]);
+    } else {
+      fprintf(stream, "    %-16s %-7s MISMATCH with %zu elements at offset %zu\n", kernel->name,
+              simd_level_names[level], count - 1, offset - 1);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+bool kernels_check(FILE *stream, Simd_Level max_level) {
+  constexpr size_t N = KERNEL_CHECK_CAPACITY;
+  static Pixels32 src[N], expected[N], actual[N], palette[256];
+  static uint8_t bytes[N], expected_plane[N], actual_plane[N], expected_plane2[N], actual_plane2[N];
+  static uint16_t sums[N], expected_sums[N], actual_sums[N];
+  static uint32_t expected_acc[4 * N], actual_acc[4 * N];
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+  // * the inputs are random for every case, the destinations start equal
+  auto random_pixels = [&](Pixels32 *dst) { kernel_check_fill(dst, sizeof(Pixels32) * N, &state); };
+  auto same_pixels = [&]() {
+    random_pixels(expected);
+    memcpy(actual, expected, sizeof(expected));
+  };
+  auto same_planes = [&]() {
+    kernel_check_fill(expected_plane, N, &state);
+    kernel_check_fill(expected_plane2, N, &state);
+    memcpy(actual_plane, expected_plane, N);
+    memcpy(actual_plane2, expected_plane2, N);
+  };
+  auto planes_equal = [&]() {
+    return memcmp(expected_plane, actual_plane, N) == 0 && memcmp(expected_plane2, actual_plane2, N) == 0;
+  };
+  auto pixels_equal = [&]() { return memcmp(expected, actual, sizeof(expected)) == 0; };
+
+  fprintf(stream, "CPU: %s\n", simd_level_names[cpu_simd_level()]);
+  fprintf(stream, "Kernels:\n");
+  bool ok = true;
+
+  ok &= kernel_check(stream, &fill_pixels32, max_level, [&](Fill_Pixels32 f, size_t count, size_t offset) {
+    same_pixels();
+    Pixels32 color;
+    kernel_check_fill(&color, sizeof(color), &state);
+    fill_pixels32_scalar(expected + offset, count, color);
+    f(actual + offset, count, color);
+    return pixels_equal();
+  });
+  ok &= kernel_check(stream, &copy_pixels32, max_level, [&](Copy_Pixels32 f, size_t count, size_t offset) {
+    same_pixels();
+    random_pixels(src);
+    copy_pixels32_scalar(expected + offset, src + offset, count);
+    f(actual + offset, src + offset, count);
+    return pixels_equal();
+  });
+  ok &= kernel_check(stream, &blend_pixels32, max_level, [&](Blend_Pixels32 f, size_t count, size_t offset) {
+    same_pixels();
+    kernel_check_fill(bytes, N, &state);
+    Pixels32 color;
+    kernel_check_fill(&color, sizeof(color), &state);
+    blend_pixels32_scalar(expected + offset, bytes + offset, count, color);
+    f(actual + offset, bytes + offset, count, color);
+    return pixels_equal();
+  });
+  ok &= kernel_check(stream, &blend_plane, max_level, [&](Blend_Plane f, size_t count, size_t offset) {
+    same_planes();
+    kernel_check_fill(bytes, N, &state);
+    uint8_t value = (uint8_t)kernel_check_random(&state);
+    blend_plane_scalar(expected_plane + offset, bytes + offset, count, value);
+    f(actual_plane + offset, bytes + offset, count, value);
+    return planes_equal();
+  });
+  ok &= kernel_check(stream, &expand_palette, max_level, [&](Expand_Palette f, size_t count, size_t offset) {
+    same_pixels();
+    kernel_check_fill(bytes, N, &state);
+    kernel_check_fill(palette, sizeof(palette), &state);
+    expand_palette_scalar(expected + offset, bytes + offset, count, palette);
+    f(actual + offset, bytes + offset, count, palette);
+    return pixels_equal();
+  });
+  ok &= kernel_check(stream, &rgba_to_y, max_level, [&](Rgba_To_Y f, size_t count, size_t offset) {
+    same_planes();
+    random_pixels(src);
+    rgba_to_y_scalar(expected_plane + offset, src + offset, count);
+    f(actual_plane + offset, src + offset, count);
+    return planes_equal();
+  });
+  ok &= kernel_check(stream, &rgba_to_uv, max_level, [&](Rgba_To_Uv f, size_t count, size_t offset) {
+    same_planes();
+    random_pixels(src);
+    rgba_to_uv_scalar(expected_plane + offset, expected_plane2 + offset, src + offset, count);
+    f(actual_plane + offset, actual_plane2 + offset, src + offset, count);
+    return planes_equal();
+  });
+  ok &= kernel_check(stream, &max_plane, max_level, [&](Max_Plane f, size_t count, size_t offset) {
+    same_planes();
+    kernel_check_fill(bytes, N, &state);
+    max_plane_scalar(expected_plane + offset, bytes + offset, count);
+    f(actual_plane + offset, bytes + offset, count);
+    return planes_equal();
+  });
+  ok &= kernel_check(stream, &accumulate_plane, max_level, [&](Accumulate_Plane f, size_t count, size_t offset) {
+    kernel_check_fill(expected_sums, sizeof(expected_sums), &state);
+    memcpy(actual_sums, expected_sums, sizeof(expected_sums));
+    kernel_check_fill(bytes, N, &state);
+    accumulate_plane_scalar(expected_sums + offset, bytes + offset, count);
+    f(actual_sums + offset, bytes + offset, count);
+    return memcmp(expected_sums, actual_sums, sizeof(expected_sums)) == 0;
+  });
+  // * the sums and the reciprocal of a box filter of n pixels, the
+  // * quotient always fits a byte there
+  ok &= kernel_check(stream, &divide_plane, max_level, [&](Divide_Plane f, size_t count, size_t offset) {
+    same_planes();
+    uint32_t n = 2 + (uint32_t)(kernel_check_random(&state) % 255);
+    uint16_t reciprocal = (uint16_t)((65536 + n - 1) / n);
+    for (size_t i = 0; i < N; ++i) sums[i] = (uint16_t)(kernel_check_random(&state) % (255 * n + 1));
+    divide_plane_scalar(expected_plane + offset, sums + offset, count, reciprocal);
+    f(actual_plane + offset, sums + offset, count, reciprocal);
+    return planes_equal();
+  });
+  // * a weight is at most 1 << RESAMPLE_WEIGHT_BITS and the weights of a
+  // * result pixel add up to it, so a channel resolves into a byte
+  constexpr uint32_t resample_one = 1u << RESAMPLE_WEIGHT_BITS;
+  ok &= kernel_check(stream, &weigh_pixels32, max_level, [&](Weigh_Pixels32 f, size_t count, size_t offset) {
+    for (size_t i = 0; i < 4 * N; ++i) expected_acc[i] = (uint32_t)(kernel_check_random(&state) % (255 * resample_one));
+    memcpy(actual_acc, expected_acc, sizeof(expected_acc));
+    random_pixels(src);
+    uint32_t weight = (uint32_t)(kernel_check_random(&state) % (resample_one + 1));
+    weigh_pixels32_scalar(expected_acc + 4 * offset, src + offset, count, weight);
+    f(actual_acc + 4 * offset, src + offset, count, weight);
+    return memcmp(expected_acc, actual_acc, sizeof(expected_acc)) == 0;
+  });
+  ok &= kernel_check(stream, &resolve_pixels32, max_level, [&](Resolve_Pixels32 f, size_t count, size_t offset) {
+    same_pixels();
+    for (size_t i = 0; i < 4 * N; ++i) expected_acc[i] = (uint32_t)(kernel_check_random(&state) % (255 * resample_one + 1));
+    resolve_pixels32_scalar(expected + offset, expected_acc + 4 * offset, count);
+    f(actual + offset, expected_acc + 4 * offset, count);
+    return pixels_equal();
+  });
+
+  return ok;
+}
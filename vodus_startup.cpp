@@ -0,0 +1,504 @@
+// * ###################################################################
+// * Startup cache
+// * ###################################################################
+
+// * Keeps what every run of the same inputs would compute again in a
+// * directory: the rasterized glyphs and the shaped texts of a font chain
+// * at a pixel size (the glyph atlas) and the decoded pixels of the pngs at
+// * the sizes they are drawn at. The files are memory-mapped as they are,
+// * the caches point straight into the mappings, so a warm start neither
+// * opens the fonts nor decodes anything.
+// *
+// *   glyphs-<key>.vga: Glyph_Atlas_Header
+// *                     Glyph_Atlas_Glyph[glyphs_count]
+// *                     Glyph_Atlas_Text[texts_count]
+// *                     coverage, runs, texts and shaped glyphs the records
+// *                     point at by their offsets, 8 byte aligned
+// *   emote-<key>.vem:  Emote_File_Header
+// *                     width * height RGBA pixels
+// *
+// * The key of the atlas is the hash of the font files and the pixel size,
+// * the key of an emote is the hash of the png and the height. The files
+// * are keyed by what stat says about them (the path, the device, the
+// * inode, the size and the mtime), so a warm start does not read the
+// * fonts and the pngs at all. The hash of their contents is only stored
+// * in the header as the identity of what the file was made from.
+// *
+// * An atlas with new glyphs or texts is written again at the end of the
+// * run, so the atlas gathers the glyphs of all the runs. Of the texts only
+// * the ones of the command line and of the batch jobs are saved
+// * (shape_cache_keep), the chat of --live and --bench is not. The records
+// * are validated on the load like the offsets, a broken glyph or text is
+// * dropped instead of read out of the mapping. Everything is in
+// * the byte order of the machine that wrote it, bump STARTUP_CACHE_VERSION
+// * whenever the rasterization or the layout of the files changes.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+constexpr uint32_t STARTUP_CACHE_VERSION = 3;
+constexpr char GLYPH_ATLAS_MAGIC[8] = {'V', 'O', 'D', 'U', 'S', 'G', 'L', 'Y'};
+constexpr char EMOTE_FILE_MAGIC[8] = {'V', 'O', 'D', 'U', 'S', 'E', 'M', 'O'};
+
+struct Glyph_Atlas_Header {
+  char magic[8];
+  uint32_t version;
+  int32_t pixel_size;
+  uint32_t faces_count;
+  uint32_t glyphs_count;
+  uint32_t texts_count;
+  uint32_t reserved;
+  // * the hash of the contents of the font files
+  uint64_t fonts_hash;
+};
+
+struct Glyph_Atlas_Glyph {
+  uint32_t face;
+  uint32_t glyph_index;
+  int32_t left, top;
+  uint32_t width, rows;
+  int32_t pitch;
+  uint32_t runs_count;
+  uint64_t coverage_offset;
+  uint64_t row_runs_offset;
+  uint64_t runs_offset;
+};
+
+struct Glyph_Atlas_Text {
+  uint64_t text_offset;
+  uint64_t glyphs_offset;
+  // * without the terminator, which is in the file too
+  uint32_t text_size;
+  uint32_t glyphs_count;
+};
+
+struct Emote_File_Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t width, height;
+  uint32_t reserved;
+  // * the hash of the contents of the png
+  uint64_t png_hash;
+};
+
+static_assert(sizeof(Glyph_Atlas_Header) == 40, "the header is part of the file format");
+static_assert(sizeof(Glyph_Atlas_Glyph) == 56, "the glyph records are part of the file format");
+static_assert(sizeof(Glyph_Atlas_Text) == 24, "the text records are part of the file format");
+static_assert(sizeof(Emote_File_Header) == 32, "the header is part of the file format");
+static_assert(sizeof(Mask_Run) == 4, "the runs are stored as they are");
+static_assert(sizeof(Shaped_Glyph) == 24, "the shaped glyphs are stored as they are");
+static_assert(sizeof(Pixels32) == 4, "the pixels are stored as they are");
+
+// * What the atlas had when it was mapped, the run writes it again only
+// * if it got more
+struct Glyph_Atlas {
+  uint64_t key;
+  // * 0 until the font files are hashed
+  uint64_t fonts_hash;
+  size_t glyphs_count;
+  size_t texts_count;
+};
+
+void startup_cache_path(char *path, size_t capacity, const char *dir, const char *kind, uint64_t key, const char *extension) {
+  snprintf(path, capacity, "%s/%s-%016llx.%s", dir, kind, (unsigned long long)key, extension);
+}
+
+// * The whole file read-only, nullptr if there is none. The mapping is
+// * never unmapped, the caches point into it until the exit.
+const uint8_t *map_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    }
+    return nullptr;
+  }
+  defer(close(fd));
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    return nullptr;
+  }
+  void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "could not map %s: %s\n", path, strerror(errno));
+    return nullptr;
+  }
+  *size = (size_t)st.st_size;
+  return (const uint8_t *)data;
+}
+
+// * Written next to the final name and renamed, so a concurrent run never
+// * maps a half written file
+void write_file_atomically(const char *dir, const char *path, const void *data, size_t size) {
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return;
+  }
+
+  char temp_path[4096];
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", temp_path, strerror(errno));
+    return;
+  }
+  struct iovec iov = {(void *)data, size};
+  write_all_iov(fd, &iov, 1, temp_path);
+  close(fd);
+
+  if (rename(temp_path, path) < 0) {
+    fprintf(stderr, "could not rename %s to %s: %s\n", temp_path, path, strerror(errno));
+    unlink(temp_path);
+  }
+}
+
+// * The file as the file system sees it, without reading it. Replacing or
+// * editing the file changes the inode, the size or the mtime.
+uint64_t fnv1a_file_stat(uint64_t hash, const char *file_path) {
+  struct stat st;
+  if (stat(file_path, &st) < 0) {
+    fprintf(stderr, "could not stat %s: %s\n", file_path, strerror(errno));
+    exit(1);
+  }
+  hash = fnv1a_string(hash, file_path);
+  hash = fnv1a_value(hash, (uint64_t)st.st_dev);
+  hash = fnv1a_value(hash, (uint64_t)st.st_ino);
+  hash = fnv1a_value(hash, (uint64_t)st.st_size);
+  hash = fnv1a_value(hash, (int64_t)st.st_mtim.tv_sec);
+  hash = fnv1a_value(hash, (int64_t)st.st_mtim.tv_nsec);
+  return hash;
+}
+
+uint64_t glyph_atlas_key(const Font_Chain *chain) {
+  uint64_t hash = fnv1a_value(FNV1A_OFFSET_BASIS, STARTUP_CACHE_VERSION);
+  hash = fnv1a_value(hash, chain->pixel_size);
+  for (size_t i = 0; i < chain->count; ++i) {
+    hash = fnv1a_file_stat(hash, chain->paths[i]);
+  }
+  return hash;
+}
+
+uint64_t glyph_atlas_fonts_hash(const Font_Chain *chain) {
+  uint64_t hash = FNV1A_OFFSET_BASIS;
+  for (size_t i = 0; i < chain->count; ++i) {
+    hash = fnv1a_file(hash, chain->paths[i]);
+  }
+  return hash;
+}
+
+// * Checks that the record points at size bytes inside of the file
+bool atlas_range_ok(size_t file_size, uint64_t offset, uint64_t size) {
+  return offset <= file_size && size <= file_size - offset;
+}
+
+// * The runs of every row cover exactly the width of the glyph, like
+// * mask_from_bitmap makes them, so slapping never reads past the runs
+// * or the coverage. The ranges of the record must be checked already.
+bool atlas_glyph_runs_ok(const uint8_t *data, const Glyph_Atlas_Glyph *record) {
+  if (record->pitch < 0 || (uint32_t)record->pitch < record->width) return false;
+
+  const uint32_t *row_runs = (const uint32_t *)(data + record->row_runs_offset);
+  const Mask_Run *runs = (const Mask_Run *)(data + record->runs_offset);
+  if (row_runs[0] != 0 || row_runs[record->rows] != record->runs_count) return false;
+  for (uint32_t row = 0; row < record->rows; ++row) {
+    if (row_runs[row] > row_runs[row + 1]) return false;
+    uint64_t width = 0;
+    for (uint32_t i = row_runs[row]; i < row_runs[row + 1]; ++i) {
+      if (runs[i].kind > MASK_RUN_PARTIAL) return false;
+      width += runs[i].length;
+    }
+    if (width != record->width) return false;
+  }
+  return true;
+}
+
+// * The shaped glyphs point at the faces of the chain
+bool atlas_text_glyphs_ok(const Shaped_Glyph *glyphs, uint32_t count, size_t faces_count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    if (glyphs[i].face >= faces_count) return false;
+  }
+  return true;
+}
+
+// * Puts the glyphs and the texts of the atlas file into the cache
+Glyph_Atlas glyph_atlas_load(Glyph_Cache *cache, const char *dir) {
+  Glyph_Atlas atlas = {};
+  atlas.key = glyph_atlas_key(&cache->fonts);
+
+  char path[4096];
+  startup_cache_path(path, sizeof(path), dir, "glyphs", atlas.key, "vga");
+  size_t size = 0;
+  const uint8_t *data = map_file(path, &size);
+  if (data == nullptr) return atlas;
+
+  const Glyph_Atlas_Header *header = (const Glyph_Atlas_Header *)data;
+  if (size < sizeof(*header)) {
+    fprintf(stderr, "ignoring the broken glyph atlas %s\n", path);
+    munmap((void *)data, size);
+    return atlas;
+  }
+  size_t records_size = (size_t)header->glyphs_count * sizeof(Glyph_Atlas_Glyph)
+                      + (size_t)header->texts_count * sizeof(Glyph_Atlas_Text);
+  if (memcmp(header->magic, GLYPH_ATLAS_MAGIC, sizeof(header->magic)) != 0
+      || header->version != STARTUP_CACHE_VERSION
+      || header->pixel_size != cache->fonts.pixel_size
+      || header->faces_count != cache->fonts.count
+      || !atlas_range_ok(size, sizeof(*header), records_size)) {
+    fprintf(stderr, "ignoring the broken glyph atlas %s\n", path);
+    munmap((void *)data, size);
+    return atlas;
+  }
+
+  atlas.fonts_hash = header->fonts_hash;
+  const Glyph_Atlas_Glyph *glyphs = (const Glyph_Atlas_Glyph *)(header + 1);
+  for (uint32_t i = 0; i < header->glyphs_count; ++i) {
+    const Glyph_Atlas_Glyph *record = &glyphs[i];
+    if (record->face >= cache->fonts.count
+        || !atlas_range_ok(size, record->coverage_offset, (uint64_t)record->pitch * record->rows)
+        || !atlas_range_ok(size, record->row_runs_offset, sizeof(uint32_t) * ((uint64_t)record->rows + 1))
+        || !atlas_range_ok(size, record->runs_offset, sizeof(Mask_Run) * (uint64_t)record->runs_count)
+        || !atlas_glyph_runs_ok(data, record)) {
+      fprintf(stderr, "ignoring the broken glyph %u in %s\n", record->glyph_index, path);
+      continue;
+    }
+
+    if ((cache->count + 1) * 10 > cache->capacity * 7) {
+      glyph_cache_grow(cache);
+    }
+    Glyph *glyph = glyph_cache_find_slot(cache->glyphs, cache->capacity, record->face, record->glyph_index);
+    if (glyph->loaded) continue;
+
+    glyph->face = record->face;
+    glyph->glyph_index = record->glyph_index;
+    glyph->left = record->left;
+    glyph->top = record->top;
+    glyph->mask.bitmap = {};
+    glyph->mask.bitmap.rows = record->rows;
+    glyph->mask.bitmap.width = record->width;
+    glyph->mask.bitmap.pitch = record->pitch;
+    glyph->mask.bitmap.num_grays = 256;
+    glyph->mask.bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+    // * the mapping is read-only, nobody writes into the cached glyphs
+    glyph->mask.bitmap.buffer = (unsigned char *)(data + record->coverage_offset);
+    glyph->mask.row_runs = (uint32_t *)(data + record->row_runs_offset);
+    glyph->mask.runs = (Mask_Run *)(data + record->runs_offset);
+    glyph->loaded = true;
+    cache->count += 1;
+    atlas.glyphs_count += 1;
+  }
+
+  const Glyph_Atlas_Text *texts = (const Glyph_Atlas_Text *)(glyphs + header->glyphs_count);
+  Shape_Cache *shapes = &cache->shapes;
+  for (uint32_t i = 0; i < header->texts_count; ++i) {
+    const Glyph_Atlas_Text *record = &texts[i];
+    if (!atlas_range_ok(size, record->text_offset, (uint64_t)record->text_size + 1)
+        || !atlas_range_ok(size, record->glyphs_offset, sizeof(Shaped_Glyph) * (uint64_t)record->glyphs_count)
+        || !atlas_text_glyphs_ok((const Shaped_Glyph *)(data + record->glyphs_offset), record->glyphs_count,
+                                 cache->fonts.count)) {
+      fprintf(stderr, "ignoring a broken text in %s\n", path);
+      continue;
+    }
+
+    const char *text = (const char *)(data + record->text_offset);
+    uint64_t hash = hash_text(text, record->text_size, cache->fonts.pixel_size);
+    if ((shapes->count + 1) * 10 > shapes->capacity * 7) {
+      shape_cache_grow(shapes);
+    }
+    Shaped_Text *entry = shape_cache_find_slot(shapes->entries, shapes->capacity, text, record->text_size,
+                                               cache->fonts.pixel_size, hash);
+    if (entry->text) continue;
+
+    entry->text = (char *)text;
+    entry->text_size = record->text_size;
+    entry->pixel_size = cache->fonts.pixel_size;
+    entry->hash = hash;
+    entry->keep = true;
+    entry->count = record->glyphs_count;
+    entry->capacity = record->glyphs_count;
+    entry->glyphs = (Shaped_Glyph *)(data + record->glyphs_offset);
+    shapes->count += 1;
+    atlas.texts_count += 1;
+  }
+
+  memory_track_alloc(MEMORY_GLYPHS, size);
+  return atlas;
+}
+
+struct Atlas_Builder {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+// * Appends the bytes 8 byte aligned and returns their offset, nullptr
+// * bytes reserve zeros to be filled in later
+uint64_t atlas_builder_push(Atlas_Builder *builder, const void *bytes, size_t size) {
+  size_t offset = (builder->size + 7) & ~(size_t)7;
+  if (offset + size > builder->capacity) {
+    builder->capacity = std::max(builder->capacity * 2, offset + size);
+    builder->data = (uint8_t *)realloc(builder->data, builder->capacity);
+    assert(builder->data);
+  }
+  memset(builder->data + builder->size, 0, offset - builder->size);
+  if (bytes == nullptr) {
+    memset(builder->data + offset, 0, size);
+  } else if (size > 0) {
+    memcpy(builder->data + offset, bytes, size);
+  }
+  builder->size = offset + size;
+  return offset;
+}
+
+// * Writes the atlas again if the run added any glyph or kept text
+void glyph_atlas_save(Glyph_Cache *cache, Glyph_Atlas *atlas, const char *dir) {
+  size_t texts_count = 0;
+  for (size_t i = 0; i < cache->shapes.capacity; ++i) {
+    if (cache->shapes.entries[i].text && cache->shapes.entries[i].keep) texts_count += 1;
+  }
+  if (cache->count == atlas->glyphs_count && texts_count == atlas->texts_count) {
+    return;
+  }
+
+  Glyph_Atlas_Header header = {};
+  memcpy(header.magic, GLYPH_ATLAS_MAGIC, sizeof(header.magic));
+  header.version = STARTUP_CACHE_VERSION;
+  header.pixel_size = cache->fonts.pixel_size;
+  header.faces_count = (uint32_t)cache->fonts.count;
+  header.glyphs_count = (uint32_t)cache->count;
+  header.texts_count = (uint32_t)texts_count;
+  if (atlas->fonts_hash == 0) {
+    atlas->fonts_hash = glyph_atlas_fonts_hash(&cache->fonts);
+  }
+  header.fonts_hash = atlas->fonts_hash;
+
+  // * the records are filled in after the data they point at is placed
+  Atlas_Builder builder = {};
+  defer(free(builder.data));
+  atlas_builder_push(&builder, &header, sizeof(header));
+  uint64_t glyphs_offset = atlas_builder_push(&builder, nullptr, sizeof(Glyph_Atlas_Glyph) * cache->count);
+  uint64_t texts_offset = atlas_builder_push(&builder, nullptr, sizeof(Glyph_Atlas_Text) * texts_count);
+
+  size_t glyph_index = 0;
+  for (size_t i = 0; i < cache->capacity; ++i) {
+    const Glyph *glyph = &cache->glyphs[i];
+    if (!glyph->loaded) continue;
+    const FT_Bitmap *bitmap = &glyph->mask.bitmap;
+
+    Glyph_Atlas_Glyph record = {};
+    record.face = glyph->face;
+    record.glyph_index = glyph->glyph_index;
+    record.left = glyph->left;
+    record.top = glyph->top;
+    record.width = bitmap->width;
+    record.rows = bitmap->rows;
+    record.pitch = bitmap->pitch;
+    record.runs_count = glyph->mask.row_runs[bitmap->rows];
+    record.coverage_offset = atlas_builder_push(&builder, bitmap->buffer, (size_t)bitmap->pitch * bitmap->rows);
+    record.row_runs_offset = atlas_builder_push(&builder, glyph->mask.row_runs, sizeof(uint32_t) * (bitmap->rows + 1));
+    record.runs_offset = atlas_builder_push(&builder, glyph->mask.runs, sizeof(Mask_Run) * record.runs_count);
+    memcpy(builder.data + glyphs_offset + sizeof(record) * glyph_index++, &record, sizeof(record));
+  }
+
+  size_t text_index = 0;
+  for (size_t i = 0; i < cache->shapes.capacity; ++i) {
+    const Shaped_Text *entry = &cache->shapes.entries[i];
+    if (entry->text == nullptr || !entry->keep) continue;
+
+    Glyph_Atlas_Text record = {};
+    record.text_size = (uint32_t)entry->text_size;
+    record.glyphs_count = (uint32_t)entry->count;
+    record.text_offset = atlas_builder_push(&builder, entry->text, entry->text_size + 1);
+    record.glyphs_offset = atlas_builder_push(&builder, entry->glyphs, sizeof(Shaped_Glyph) * entry->count);
+    memcpy(builder.data + texts_offset + sizeof(record) * text_index++, &record, sizeof(record));
+  }
+
+  char path[4096];
+  startup_cache_path(path, sizeof(path), dir, "glyphs", atlas->key, "vga");
+  write_file_atomically(dir, path, builder.data, builder.size);
+  printf("Saved %zu glyphs and %zu texts into %s\n", cache->count, texts_count, path);
+}
+
+uint64_t emote_file_key(const char *png_filepath, int height) {
+  uint64_t hash = fnv1a_value(FNV1A_OFFSET_BASIS, STARTUP_CACHE_VERSION);
+  hash = fnv1a_value(hash, height);
+  return fnv1a_file_stat(hash, png_filepath);
+}
+
+bool emote_file_load(const char *dir, uint64_t key, Image32 *image) {
+  char path[4096];
+  startup_cache_path(path, sizeof(path), dir, "emote", key, "vem");
+  size_t size = 0;
+  const uint8_t *data = map_file(path, &size);
+  if (data == nullptr) return false;
+
+  const Emote_File_Header *header = (const Emote_File_Header *)data;
+  if (size < sizeof(*header)
+      || memcmp(header->magic, EMOTE_FILE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != STARTUP_CACHE_VERSION
+      || header->width == 0 || header->height == 0
+      || size - sizeof(*header) != sizeof(Pixels32) * (size_t)header->width * header->height) {
+    fprintf(stderr, "ignoring the broken emote %s\n", path);
+    munmap((void *)data, size);
+    return false;
+  }
+
+  image->width = (int)header->width;
+  image->height = (int)header->height;
+  image->stride = (int)header->width;
+  image->pixels = (Pixels32 *)(header + 1);
+  memory_track_alloc(MEMORY_EMOTES, size);
+  return true;
+}
+
+void emote_file_save(const char *dir, uint64_t key, uint64_t png_hash, const Image32 *image) {
+  Emote_File_Header header = {};
+  memcpy(header.magic, EMOTE_FILE_MAGIC, sizeof(header.magic));
+  header.version = STARTUP_CACHE_VERSION;
+  header.width = (uint32_t)image->width;
+  header.height = (uint32_t)image->height;
+  header.png_hash = png_hash;
+
+  size_t size = sizeof(header) + sizeof(Pixels32) * (size_t)image->width * (size_t)image->height;
+  uint8_t *data = (uint8_t *)malloc(size);
+  assert(data);
+  defer(free(data));
+  memcpy(data, &header, sizeof(header));
+  for (int row = 0; row < image->height; ++row) {
+    memcpy(data + sizeof(header) + sizeof(Pixels32) * (size_t)(row * image->width),
+           image->pixels + row * image->stride, sizeof(Pixels32) * (size_t)image->width);
+  }
+
+  char path[4096];
+  startup_cache_path(path, sizeof(path), dir, "emote", key, "vem");
+  write_file_atomically(dir, path, data, size);
+}
+
+// * The decoded png, mapped from the cache when dir is not nullptr
+Image32 load_emote_cached(const char *dir, const char *png_filepath) {
+  if (dir == nullptr) {
+    return load_image32_from_png(png_filepath);
+  }
+
+  Image32 image = {};
+  uint64_t key = emote_file_key(png_filepath, 0);
+  if (!emote_file_load(dir, key, &image)) {
+    image = load_image32_from_png(png_filepath);
+    emote_file_save(dir, key, fnv1a_file(FNV1A_OFFSET_BASIS, png_filepath), &image);
+  }
+  return image;
+}
+
+// * Puts the png scaled to the height into the emote cache, mapped from
+// * the cache directory or scaled and saved there
+void load_scaled_emote_cached(const char *dir, Emote_Cache *emotes, Image32 *png, const char *png_filepath, int height) {
+  if (height <= 0 || height == png->height) return;
+
+  uint64_t key = emote_file_key(png_filepath, height);
+  Image32 image = {};
+  if (emote_file_load(dir, key, &image)) {
+    emote_cache_put(emotes, png, height, image);
+  } else {
+    emote_file_save(dir, key, fnv1a_file(FNV1A_OFFSET_BASIS, png_filepath), emote_cache_get(emotes, png, height));
+  }
+}
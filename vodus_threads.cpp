@@ -0,0 +1,78 @@
+// * ###################################################################
+// * Stage threads
+// * ###################################################################
+
+// * The PNG pipeline has two CPU heavy stages: rendering and compression.
+// * Both are sized at runtime from the amount of cores and run on the
+// * workers of the scheduler (see vodus_pipeline.cpp). The frame writer
+// * thread is mostly waiting for the disk and is not counted.
+// *
+// * The bands take CPUs 0, 1, 2..., the band 0 is the main thread. The
+// * numbers are indices into the CPUs the process may run on (taskset,
+// * cpusets, containers), not the ids of the CPUs.
+
+#include <thread>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+size_t hardware_threads() {
+  size_t count = std::thread::hardware_concurrency();
+  // * 0 means the standard library does not know
+  return count > 0 ? count : 4;
+}
+
+#ifdef __linux__
+struct Allowed_Cpus {
+  size_t count;
+  int ids[CPU_SETSIZE];
+};
+
+// * Read before the first thread is pinned, the affinity of the process is
+// * inherited by all the threads
+Allowed_Cpus read_allowed_cpus() {
+  Allowed_Cpus cpus = {};
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int id = 0; id < CPU_SETSIZE; ++id) {
+      if (CPU_ISSET(id, &set)) cpus.ids[cpus.count++] = id;
+    }
+  }
+  if (cpus.count == 0) {
+    for (size_t id = 0; id < hardware_threads(); ++id) cpus.ids[cpus.count++] = (int)id;
+  }
+  return cpus;
+}
+#endif
+
+// * cpu is the index into the allowed CPUs, wrapping around
+void pin_thread_to_cpu(pthread_t thread, size_t cpu) {
+#ifdef __linux__
+  static const Allowed_Cpus allowed = read_allowed_cpus();
+  int id = allowed.ids[cpu % allowed.count];
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(id, &set);
+  int error = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (error != 0) {
+    fprintf(stderr, "could not pin a thread to CPU %d: %s\n", id, strerror(error));
+  }
+#else
+  (void)thread;
+  (void)cpu;
+  static bool warned = false;
+  if (!warned) {
+    fprintf(stderr, "CPU pinning is not supported on this platform, ignoring it\n");
+    warned = true;
+  }
+#endif
+}
+
+// * band i gets CPU i
+void pin_bands(Band_Pool *bands) {
+  pin_thread_to_cpu(pthread_self(), 0);
+  for (size_t band = 1; band < bands->count; ++band) {
+    pin_thread_to_cpu(bands->threads[band], band);
+  }
+}